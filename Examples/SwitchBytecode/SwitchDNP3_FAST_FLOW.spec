@@ -0,0 +1,11 @@
+# Declarative equivalent of SwitchDNP3_FAST_FLOW.s - pass it to MiniPlex with -E instead of -C
+
+min_len 10              # DNP3 link layer header is 10 bytes
+match 0 u16le 0x6405    # start bytes 0x05 0x64
+len 2 u8                # DNP3 len byte can't be more than the size of the data
+
+# Combine DNP3 addrs as a 'flow ID'
+src 4 u16le shift 16    # dst:src as the source
+src 6 u16le
+dst 6 u16le shift 16    # src:dst as the destination
+dst 4 u16le
@@ -36,7 +36,7 @@ get_addrs:
 	
 	#write outputs
 	sd t2, 0(a2) #src
-	sd t1, 0(a4) #dst
+	sd t1, 0(a3) #dst
 	
 	li a0, 0
 	jr ra
@@ -2,6 +2,8 @@
 	# a1: size of packet
 	# a2: pointer to src (output u64)
 	# a3: pointer to dst (output u64)
+	# a4: pointer to shared state (see -V - this needs at least 524288 bytes)
+	# a5: size of shared state
 
 #
 #	WireGuard (WG) sessions are established by a handshake which establishes 32bit sender and receiver IDs
@@ -9,19 +11,22 @@
 #	So, we need to keep a record of the sender/receiver pairs from the handshake
 #	Here we use a simple 'hash' table (the 'hash' is really just the 16 LSBits of an ID) to store the pairs
 #	Hash collisions aren't really a problem, a session will get dropped and it will just change IDs and restart
+#	The table is in the shared state (so it's the same for every router), and each entry is one aligned
+#	8 byte word, stored and loaded in one go - so it's never seen half written
 #
 
 # macro to lookup a hash table entry
 .macro LOOKUP addr key
 	li t2, 0xFFFF
 	and t2, \key, t2	# take 'hash' (lower 16)
-	la t3, hash_table	# load the address of the hash table
-	li t4, 6			# size of an entry (2byte receiver msbs, 4byte sender)
-	mul \addr, t4, t2	# get the offset for the hash
-	add \addr, \addr, t3# address of the hash table entry
+	slli t2, t2, 3		# get the offset for the hash (8 byte entries: 2byte msbs, 4byte id)
+	add \addr, a4, t2	# address of the hash table entry
 .endm
 
 start:
+	li t0, 0x80000		# 64k 8 byte slots
+	bltu a5, t0, err	# error, not enough shared state for the hash table
+
 	li t0, 12           # All WG packets are more than 12 bytes
 	bltu a1, t0, err	# error, buffer size < 12
 	
@@ -44,21 +49,25 @@ resp:
 	lwu t1, 8(a0)		# load receiver
 	LOOKUP t5, t1		# lookup receiver
 	srli t2, t1, 16		# get most significant bytes of receiver
-	sh t2, 0(t5)		# store the receiver msbs
-	sd t0, 2(t5)		# store the sender
+	slli t2, t2, 32		# the receiver msbs
+	or t2, t2, t0		#   with the sender
+	sd t2, 0(t5)		# store the entry
 	LOOKUP t5, t0		# lookup sender
 	srli t2, t0, 16		# get most significant bytes of sender
-	sh t2, 0(t5)		# store the sender msbs
-	sd t1, 2(t5)		# store the receiver
+	slli t2, t2, 32		# the sender msbs
+	or t2, t2, t1		#   with the receiver
+	sd t2, 0(t5)		# store the entry
 	j success
 cookie:
 trans:
 	lwu t1, 4(a0)		# load receiver
 	LOOKUP t5, t1		# lookup receiver
-	lhu t2, 0(t5)		# load msbs from table
+	ld t4, 0(t5)		# load the entry
+	srli t2, t4, 32		# msbs from table
 	srli t3, t1, 16		# get receiver msbs
 	bne t2, t3, err		# error, 'hash' collision - drop and it'll switch addrs
-	lwu t0, 2(t5)		# load sender
+	slli t0, t4, 32
+	srli t0, t0, 32		# sender from table
 success:
 	sd t0, 0(a2)		# store src to output
 	sd t1, 0(a3)		# store dst to output
@@ -67,5 +76,3 @@ success:
 err:
     li a0, -1			# error return -1
     jr ra
-hash_table:
-	.space 399360, 0	# 64k 6 byte slots
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+#Test MiniPlex new cache entry admission: with one new branch a second per prefix, a second branch from the same
+#	prefix straight after the first still gets its datagrams forwarded, but isn't cached to get any back
+
+#Usage: <this_script> <MiniPlex executable> <MiniPlex port>
+
+# Check if the executable and port are provided
+if [ $# -ne 2 ]; then
+    echo "Error: Please provide the MiniPlex executable and port arguments"
+    echo "Usage: $0 <MiniPlex executable> <MiniPlex port>"
+    exit 1
+fi
+
+MINIPLEX=$1
+PORT=$2
+
+"$MINIPLEX" -H -p $PORT -U 1 -c off -f off &
+MP_PID=$!
+sleep 0.5
+
+# Branch A is admitted, then branch B (same /24) isn't
+exec 3< <((echo -n 1 && sleep 1 && echo -n 3 && sleep 1) | ncat -u -p 40111 127.0.0.1 $PORT)
+sleep 0.3
+exec 4< <((echo -n 2 && sleep 2) | ncat -u -p 40112 127.0.0.1 $PORT)
+sleep 2.5
+OUT_A=$(cat <&3)
+OUT_B=$(cat <&4)
+kill -INT $MP_PID
+wait $MP_PID
+
+if [ "$OUT_A" != "2" ]; then
+    echo "Error: admitted branch expected '2' from the branch that wasn't admitted, got '$OUT_A'"
+    exit 1
+fi
+if [ "$OUT_B" != "" ]; then
+    echo "Error: branch that wasn't admitted expected nothing, got '$OUT_B'"
+    exit 1
+fi
+
+echo "All tests passed."
+exit 0
@@ -0,0 +1,59 @@
+#!/bin/bash
+
+#Check forwarding datagrams doesn't allocate: run the MiniPlex benchmark (built with -DMP_ALLOC_COUNT=ON)
+#	and count the heap allocations in the steady state (the second half of the run)
+#	The first half is the warm up: the buffer pools and handler memory fill up to the buffer limit (-Y), and the
+#	hand-off queues are sized for the fan out up front - so after that there must be no allocations at all.
+#	The window has to have cycled through the buffers a few times over, or it proves nothing
+
+#Usage: <this_script> <MiniPlex executable> <MiniPlex mode args...>
+
+# Check if the executable and mode are provided
+if [ $# -lt 2 ]; then
+    echo "Error: Please provide the MiniPlex executable and mode arguments"
+    echo "Usage: $0 <MiniPlex executable> <MiniPlex mode args...>"
+    exit 1
+fi
+
+MINIPLEX=$1
+shift
+
+# Find the buffer limit
+MAX_BUFS=""
+ARGS=("$@")
+for ((i=0; i<${#ARGS[@]}-1; i++)); do
+    if [ "${ARGS[$i]}" = "-Y" ]; then
+        MAX_BUFS=${ARGS[$((i+1))]}
+    fi
+done
+if ! [[ "$MAX_BUFS" =~ ^[0-9]+$ ]] || [ "$MAX_BUFS" -eq 0 ]; then
+    echo "Error: pass a buffer limit (-Y <n>) - small enough for the pools to fill up in the warm up"
+    exit 1
+fi
+MIN_DGRAMS=$((8*MAX_BUFS))
+
+# Run the benchmark and capture output
+OUT=$("$MINIPLEX" -M -m 6000 -c critical -f off "$@" 2>&1)
+echo "$OUT"
+
+# Get the allocation and datagram counts
+COUNTS=$(echo "$OUT" | sed -n 's/.*Steady state heap allocations \([0-9]*\) for \([0-9]*\) datagrams.*/\1 \2/p')
+
+if [ -z "$COUNTS" ]; then
+    echo "Error: no allocation count in the benchmark output - was MiniPlex built with -DMP_ALLOC_COUNT=ON?"
+    exit 1
+fi
+read -r ALLOCS DGRAMS <<< "$COUNTS"
+
+if [ "$DGRAMS" -lt "$MIN_DGRAMS" ]; then
+    echo "Error: only $DGRAMS datagrams in the steady state - need at least $MIN_DGRAMS for the allocation count to mean anything"
+    exit 1
+fi
+
+if [ "$ALLOCS" -ne 0 ]; then
+    echo "Error: $ALLOCS heap allocations for $DGRAMS datagrams in the steady state - there should be none"
+    exit 1
+fi
+
+echo "All tests passed."
+exit 0
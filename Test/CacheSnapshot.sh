@@ -0,0 +1,73 @@
+#!/bin/bash
+
+#Test MiniPlex warm-starting from a cache snapshot: a branch learned before a restart
+#	still gets forwarded datagrams after it, without having to send anything first
+#	and that corrupt snapshots (a bad address family, or a timestamp too big to age the TTLs by) are ignored
+
+#Usage: <this_script> <MiniPlex executable> <MiniPlex port>
+
+# Check if the executable and port are provided
+if [ $# -ne 2 ]; then
+    echo "Error: Please provide the MiniPlex executable and port arguments"
+    echo "Usage: $0 <MiniPlex executable> <MiniPlex port>"
+    exit 1
+fi
+
+MINIPLEX=$1
+PORT=$2
+SNAPSHOT=$(mktemp -u)
+
+# Learn a branch (from a fixed port), then stop MiniPlex - which saves the snapshot
+"$MINIPLEX" -H -p $PORT -o 30000 -d "$SNAPSHOT" -c off -f off &
+MP_PID=$!
+sleep 0.5
+(echo -n 1 && sleep 0.5) | ncat -u -p 40101 127.0.0.1 $PORT
+kill -INT $MP_PID
+wait $MP_PID
+
+if [ ! -s "$SNAPSHOT" ]; then
+    echo "Error: no cache snapshot saved"
+    exit 1
+fi
+
+# Start from corrupt copies of the snapshot - they should be ignored, with a warning
+CORRUPT=$(mktemp -u)
+LOG=$(mktemp)
+for PATCH in "21 \x05" "5 \xff\xff\xff\xff\xff\xff\xff\xff"; do
+    read -r OFFSET BYTES <<< "$PATCH"
+    cp "$SNAPSHOT" "$CORRUPT"
+    printf "$BYTES" | dd of="$CORRUPT" bs=1 seek=$OFFSET conv=notrunc 2>/dev/null
+    "$MINIPLEX" -H -p $PORT -o 30000 -d "$CORRUPT" -c warn -f off > "$LOG" 2>&1 &
+    MP_PID=$!
+    sleep 0.5
+    kill -INT $MP_PID
+    wait $MP_PID
+    if ! grep -q "Ignoring cache snapshot: Not a MiniPlex cache snapshot" "$LOG"; then
+        echo "Error: corrupt cache snapshot (bytes at $OFFSET set to '$BYTES') wasn't ignored:"
+        cat "$LOG"
+        rm -f "$SNAPSHOT" "$CORRUPT" "$LOG"
+        exit 1
+    fi
+done
+rm -f "$CORRUPT" "$LOG"
+
+# Restart from the snapshot - the branch should get a datagram from a new one
+"$MINIPLEX" -H -p $PORT -o 30000 -d "$SNAPSHOT" -c off -f off &
+MP_PID=$!
+sleep 0.5
+exec 3< <(sleep 2 | ncat -u -p 40101 127.0.0.1 $PORT)
+sleep 0.5
+(echo -n 2 && sleep 0.5) | ncat -u -p 40102 127.0.0.1 $PORT
+sleep 1.5
+OUT=$(cat <&3)
+kill -INT $MP_PID
+wait $MP_PID
+rm -f "$SNAPSHOT"
+
+if [ "$OUT" != "2" ]; then
+    echo "Error: learned branch expected '2' after restart, got '$OUT'"
+    exit 1
+fi
+
+echo "All tests passed."
+exit 0
@@ -12,6 +12,14 @@ if($ARGV[0])
 
 my $procs = do $DNP3Flows or die "Failed to load DNP3 send commands from $DNP3Flows";
 
+# Optionally send to a different MiniPlex port than the one in the flows file
+if($ARGV[1])
+{
+	for my $id (keys %{$procs}) {
+		$procs->{$id}{command} =~ s/^(\S+\s+\S+\s+\S+\s+)\d+/$1$ARGV[1]/ or die "No port to replace in '$procs->{$id}{command}'";
+	}
+}
+
 # Launch all commands
 for my $id (keys %{$procs}) {
     my $p = $procs->{$id};
@@ -0,0 +1,51 @@
+#!/bin/bash
+
+#Test MiniPlex source prefix ACL filtering: datagrams from a denied prefix are dropped (and the senders never learned),
+#	and a longer allowed prefix overrides a shorter denied one
+
+#Usage: <this_script> <MiniPlex executable> <MiniPlex port>
+
+# Check if the executable and port are provided
+if [ $# -ne 2 ]; then
+    echo "Error: Please provide the MiniPlex executable and port arguments"
+    echo "Usage: $0 <MiniPlex executable> <MiniPlex port>"
+    exit 1
+fi
+
+MINIPLEX=$1
+PORT=$2
+ACL=$(mktemp)
+
+# Two branches (both 127.0.0.1) take turns sending, Hub mode. Prints what the first one got
+run_hub()
+{
+    "$MINIPLEX" -H -p $PORT -i "$ACL" -c off -f off &
+    MP_PID=$!
+    sleep 0.5
+    exec 3< <((echo -n 1 && sleep 1.5) | ncat -u -p 40121 127.0.0.1 $PORT)
+    sleep 0.5
+    (echo -n 2 && sleep 0.5) | ncat -u -p 40122 127.0.0.1 $PORT
+    sleep 1
+    cat <&3
+    kill -INT $MP_PID
+    wait $MP_PID
+}
+
+printf "# loopback denied\ndeny 127.0.0.0/8\nallow 10.0.0.0/8\n" > "$ACL"
+OUT=$(run_hub)
+if [ "$OUT" != "" ]; then
+    echo "Error: denied branch expected nothing, got '$OUT'"
+    rm -f "$ACL"
+    exit 1
+fi
+
+printf "deny 127.0.0.0/8\nallow 127.0.0.1/32\n" > "$ACL"
+OUT=$(run_hub)
+rm -f "$ACL"
+if [ "$OUT" != "2" ]; then
+    echo "Error: branch allowed by the longer prefix expected '2', got '$OUT'"
+    exit 1
+fi
+
+echo "All tests passed."
+exit 0
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+#Measure how routing scales with the number of routers: run the MiniPlex benchmark in each mode
+#	with 1 up to the given number of routers (-w), and print the RX/TX counts for each
+#	(nothing to pass or fail - the scaling depends on the cores available)
+
+#Usage: <this_script> <MiniPlex executable> <max routers> [extra MiniPlex args...]
+
+# Check if the executable and router count are provided
+if [ $# -lt 2 ]; then
+    echo "Error: Please provide the MiniPlex executable and max number of routers"
+    echo "Usage: $0 <MiniPlex executable> <max routers> [extra MiniPlex args...]"
+    exit 1
+fi
+
+MINIPLEX=$1
+MAX_ROUTERS=$2
+shift 2
+
+SCRIPT_DIR=$(dirname "$0")
+BYTECODE="$SCRIPT_DIR/../Examples/SwitchBytecode/SwitchDNP3_FAST.bin"
+
+declare -A MODES=(
+    [Hub]="-H"
+    [Trunk]="-T -r 127.0.0.1 -t 50100"
+    [Prune]="-P -r 127.0.0.1 -t 50100"
+    [Switch]="-X -C $BYTECODE"
+)
+
+for MODE in Hub Trunk Prune Switch; do
+    for ROUTERS in $(seq 1 "$MAX_ROUTERS"); do
+        OUT=$("$MINIPLEX" ${MODES[$MODE]} -p 20100 -M -m 3000 -j 64 -w "$ROUTERS" -c critical -f off "$@" 2>&1)
+        COUNTS=$(echo "$OUT" | sed -n 's/.*RX\/TX count \([0-9]*\/[0-9]*\) over \([0-9]*ms\).*/\1 over \2/p')
+        if [ -z "$COUNTS" ]; then
+            echo "Error: no benchmark counts for $MODE mode with $ROUTERS routers"
+            echo "$OUT"
+            exit 1
+        fi
+        echo "$MODE, $ROUTERS routers: RX/TX $COUNTS"
+    done
+done
+
+exit 0
@@ -0,0 +1,58 @@
+#!/bin/bash
+
+#Test MiniPlex Switch mode with declarative address extractor specs (-E) instead of byte code:
+#	the FAST DNP3 flows have to be switched the same as with the equivalent byte code,
+#	and a bad spec has to stop MiniPlex starting
+
+#Usage: <this_script> <MiniPlex executable> <MiniPlex port>
+
+# Check if the executable and port are provided
+if [ $# -ne 2 ]; then
+    echo "Error: Please provide the MiniPlex executable and port arguments"
+    echo "Usage: $0 <MiniPlex executable> <MiniPlex port>"
+    exit 1
+fi
+
+MINIPLEX=$1
+PORT=$2
+SPEC=$(mktemp)
+
+# Runs a set of flows (from the byte code tests, sent to our port) through MiniPlex using a spec
+run_flows()
+{
+    "$MINIPLEX" -X -p $PORT -E "$1" -c off -f off &
+    MP_PID=$!
+    sleep 0.5
+    Test/DNP3SwitchMode.pl "$2" $PORT
+    RESULT=$?
+    kill -INT $MP_PID
+    wait $MP_PID
+    return $RESULT
+}
+
+if ! run_flows Examples/SwitchBytecode/SwitchDNP3_FAST.spec ./Test/OneToOneDNP3FlowsFAST.pl; then
+    echo "Error: one to one flows failed with SwitchDNP3_FAST.spec"
+    rm -f "$SPEC"
+    exit 1
+fi
+if ! run_flows Examples/SwitchBytecode/SwitchDNP3_FAST_FLOW.spec ./Test/OneToManyDNP3FlowsFAST.pl; then
+    echo "Error: one to many flows failed with SwitchDNP3_FAST_FLOW.spec"
+    rm -f "$SPEC"
+    exit 1
+fi
+
+printf "min_len 10\nmatch 0 u16le 0x6405\nsrc 6 u24le\ndst 4 u16le\n" > "$SPEC"
+"$MINIPLEX" -X -p $PORT -E "$SPEC" -c off -f off &
+MP_PID=$!
+sleep 0.5
+if kill -0 $MP_PID 2>/dev/null; then
+    echo "Error: MiniPlex started with a bad extractor spec"
+    kill -INT $MP_PID
+    wait $MP_PID
+    rm -f "$SPEC"
+    exit 1
+fi
+rm -f "$SPEC"
+
+echo "All tests passed."
+exit 0
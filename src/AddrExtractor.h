@@ -0,0 +1,264 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef ADDREXTRACTOR_H
+#define ADDREXTRACTOR_H
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+//Switch mode address extraction without the VM, for protocols where it's just checks and fixed fields
+//	Each field is read by a loader specialised for its width and byte order (picked when the spec is parsed),
+//	and the datagram is checked once up front to be long enough for all of them - so there's no bounds checking per field
+//	Built once, then read only - so it's safe to extract from any thread
+class AddrExtractor
+{
+public:
+	enum class Check {MIN_LEN,MATCH,LEN};
+	struct Rule
+	{
+		Check check;
+		std::string text; //as written (for logging)
+	};
+	static constexpr size_t Extracted = std::numeric_limits<size_t>::max();
+
+	//Empty - no rules or fields
+	AddrExtractor() = default;
+
+	//A rule or field per line ('#' starts a comment):
+	//	min_len <bytes>                                   reject datagrams shorter than this
+	//	match <offset> <type> <value> [mask <mask>]       reject unless (field & mask) == value
+	//	len <offset> <type> [mask <mask>]                 reject if (field & mask) - a length - is more than the datagram size
+	//	src|dst <offset> <type> [mask <mask>] [shift <bits>]   OR (field & mask) << bits into the address
+	//	where <type> is u8, u16le, u16be, u32le, u32be, u64le or u64be, and numbers are decimal or 0x hex
+	//	The rules are checked in order, after an implied min_len for the furthest field
+	//	throws std::invalid_argument
+	explicit AddrExtractor(const std::string& path)
+	{
+		std::ifstream file(path);
+		if(!file)
+			throw std::invalid_argument("Failed to open extractor spec file: "+path);
+		size_t min_len = 0;
+		std::string line;
+		for(size_t line_num = 1; std::getline(file,line); line_num++)
+		{
+			line = line.substr(0,line.find('#'));
+			std::istringstream words(line);
+			std::string keyword;
+			if(!(words >> keyword))
+				continue;
+			auto invalid = [&](const std::string& why)
+			{
+				return std::invalid_argument("Invalid extractor spec ("+path+" line "+std::to_string(line_num)+"): "+why);
+			};
+			auto number = [&](const char* what)
+			{
+				std::string word;
+				if(!(words >> word))
+					throw invalid(std::string("expected ")+what);
+				const bool hex = word.size() > 2 && word[0] == '0' && (word[1] == 'x' || word[1] == 'X');
+				const auto digits = hex ? word.substr(2) : word;
+				if(digits.empty() || digits.size() > (hex ? 16 : 20)
+					|| !std::all_of(digits.begin(),digits.end(),[hex](char c){ return hex ? std::isxdigit(static_cast<unsigned char>(c)) : std::isdigit(static_cast<unsigned char>(c)); }))
+					throw invalid(std::string("bad ")+what+" '"+word+"'");
+				try { return static_cast<uint64_t>(std::stoull(digits,nullptr,hex ? 16 : 10)); }
+				catch(const std::out_of_range&) { throw invalid(std::string("bad ")+what+" '"+word+"'"); }
+			};
+			auto field = [&]()
+			{
+				Field f;
+				const auto offset = number("offset");
+				if(offset > MaxOffset)
+					throw invalid("offset "+std::to_string(offset)+" is past the largest datagram");
+				std::string type;
+				if(!(words >> type))
+					throw invalid("expected a field type");
+				const auto loader = std::find_if(std::begin(Loaders),std::end(Loaders),[&](const auto& l){ return type == l.name; });
+				if(loader == std::end(Loaders))
+					throw invalid("unknown field type '"+type+"'");
+				f.load = loader->load;
+				f.offset = static_cast<uint32_t>(offset);
+				f.width = loader->width;
+				f.mask = WidthMask(f.width);
+				return f;
+			};
+			auto options = [&](Field& f, const bool shiftable)
+			{
+				std::string option;
+				while(words >> option)
+				{
+					if(option == "mask")
+					{
+						const auto mask = number("mask");
+						if(mask & ~WidthMask(f.width))
+							throw invalid("mask is wider than the field");
+						f.mask = mask;
+					}
+					else if(shiftable && option == "shift")
+					{
+						const auto shift = number("shift");
+						if(shift > 63)
+							throw invalid("shift is more than 63 bits");
+						f.shift = static_cast<uint8_t>(shift);
+					}
+					else
+						throw invalid("unexpected '"+option+"'");
+				}
+				min_len = std::max<size_t>(min_len,f.offset+f.width);
+			};
+
+			if(keyword == "min_len")
+			{
+				const auto len = number("length");
+				std::string extra;
+				if(words >> extra)
+					throw invalid("unexpected '"+extra+"'");
+				if(len > MaxOffset+1)
+					throw invalid("length "+std::to_string(len)+" is more than the largest datagram");
+				min_len = std::max<size_t>(min_len,len);
+			}
+			else if(keyword == "match")
+			{
+				auto f = field();
+				const auto value = number("value");
+				options(f,false);
+				if(value & ~f.mask)
+					throw invalid("value doesn't fit in the (masked) field");
+				checks.push_back({f,value});
+				rules.push_back({Check::MATCH,Normalise(line)});
+			}
+			else if(keyword == "len")
+			{
+				auto f = field();
+				options(f,false);
+				checks.push_back({f,0});
+				rules.push_back({Check::LEN,Normalise(line)});
+			}
+			else if(keyword == "src" || keyword == "dst")
+			{
+				auto f = field();
+				options(f,true);
+				(keyword == "src" ? src_fields : dst_fields).push_back(f);
+			}
+			else
+				throw invalid("unknown keyword '"+keyword+"'");
+		}
+		if(src_fields.empty() || dst_fields.empty())
+			throw std::invalid_argument("Invalid extractor spec ("+path+"): it needs at least one src and one dst field");
+		min_len_bytes = min_len;
+		rules.insert(rules.begin(),{Check::MIN_LEN,"min_len "+std::to_string(min_len)});
+	}
+
+	bool Empty() const { return rules.empty(); }
+	//The checks, in the order they're made (the first is always the min_len)
+	const std::vector<Rule>& Rules() const { return rules; }
+
+	//The index of the rule that rejected the datagram, or Extracted (and src and dst are set)
+	size_t Extract(const uint8_t* const buf, const size_t n, uint64_t& src, uint64_t& dst) const
+	{
+		if(n < min_len_bytes) [[unlikely]]
+			return 0;
+		for(size_t i=0; i<checks.size(); i++)
+		{
+			const auto& c = checks[i];
+			const auto value = c.field.load(buf+c.field.offset) & c.field.mask;
+			if(rules[i+1].check == Check::MATCH ? value != c.value : value > n) [[unlikely]]
+				return i+1;
+		}
+		src = Combine(src_fields,buf);
+		dst = Combine(dst_fields,buf);
+		return Extracted;
+	}
+
+private:
+	using Loader = uint64_t(*)(const uint8_t*);
+	struct Field
+	{
+		Loader load = nullptr;
+		uint32_t offset = 0;
+		uint8_t width = 0;
+		uint8_t shift = 0;
+		uint64_t mask = 0;
+	};
+	struct FieldCheck
+	{
+		Field field;
+		uint64_t value; //(to match)
+	};
+	static constexpr uint64_t MaxOffset = 65535;
+
+	//(a fixed size byte loop, so the compiler makes it a single load - and a byte swap for big-endian)
+	template<size_t Width, bool BigEndian>
+	static uint64_t Load(const uint8_t* const p)
+	{
+		uint64_t val = 0;
+		for(size_t i=0; i<Width; i++)
+			val |= uint64_t(p[BigEndian ? Width-1-i : i]) << (8*i);
+		return val;
+	}
+	struct LoaderType
+	{
+		const char* name;
+		uint8_t width;
+		Loader load;
+	};
+	static constexpr LoaderType Loaders[] =
+	{
+		{"u8",1,&Load<1,false>},
+		{"u16le",2,&Load<2,false>},
+		{"u16be",2,&Load<2,true>},
+		{"u32le",4,&Load<4,false>},
+		{"u32be",4,&Load<4,true>},
+		{"u64le",8,&Load<8,false>},
+		{"u64be",8,&Load<8,true>}
+	};
+
+	static uint64_t WidthMask(const uint8_t width)
+	{
+		return width == 8 ? ~uint64_t(0) : (uint64_t(1) << (8*width))-1;
+	}
+	static std::string Normalise(const std::string& line)
+	{
+		std::istringstream words(line);
+		std::string word, normal;
+		while(words >> word)
+			normal += (normal.empty() ? "" : " ")+word;
+		return normal;
+	}
+	static uint64_t Combine(const std::vector<Field>& fields, const uint8_t* const buf)
+	{
+		uint64_t addr = 0;
+		for(const auto& f : fields)
+			addr |= (f.load(buf+f.offset) & f.mask) << f.shift;
+		return addr;
+	}
+
+	std::vector<Rule> rules;
+	std::vector<FieldCheck> checks; //rules[1..]
+	std::vector<Field> src_fields;
+	std::vector<Field> dst_fields;
+	size_t min_len_bytes = 0;
+};
+
+#endif // ADDREXTRACTOR_H
@@ -0,0 +1,392 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef ADDRESSTABLE_H
+#define ADDRESSTABLE_H
+
+#include "TimeoutCache.h"
+#include "BranchTable.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <cstdint>
+
+//Switch mode address -> branches table
+//	A fixed number of addresses (allocated up front), each with a few branches inline: the first is the active one,
+//	and the rest take over in turn if it times out. Any more than that spill into an overflow store (allocated as needed)
+//	When the table's full, the least recently used address makes way
+//	When an address has all the branches it can have, a new one is dropped - or with the LRU policy, the least
+//	recently refreshed branch makes way for it
+//	Branches age in epochs - the owner calls Tick() every EpochPeriod() (AgeEpochs times per timeout), and a branch that
+//	hasn't been refreshed for more than AgeEpochs ticks has timed out. Timed out branches are dropped when their address
+//	is next looked up, or by a sweep through part of the table each tick. An address with no branches left is freed
+//	Branches are interned IDs (see BranchTable) - the handler is told about every one that's dropped, so it can let go of it
+//	Not thread safe - the owner serializes access (Tick() included). The counts can be read from anywhere
+class AddressTable
+{
+public:
+	static constexpr size_t InlineBranches = 4;
+	static constexpr uint32_t AgeEpochs = 8;
+	static constexpr size_t SweepPerEpoch = 256;
+
+	//max_branches: per address (0 means unlimited) - the ones past InlineBranches are in the overflow store
+	//branch_policy: what to do with a new branch for an address that already has max_branches
+	AddressTable(const size_t max_addrs, const size_t max_branches, const FullPolicy branch_policy, const size_t timeout_ms,
+		std::function<void(const uint64_t addr, const branch_id_t branch, const bool evicted)> drop_handler = [](const uint64_t, const branch_id_t, const bool){}):
+		epoch_period(std::max<size_t>(1,timeout_ms/AgeEpochs)),
+		max_branches(max_branches ? max_branches : std::numeric_limits<size_t>::max()),
+		branch_lru(branch_policy == FullPolicy::LRU),
+		drop_handler(drop_handler),
+		Entries(max_addrs),
+		Table(max_addrs ? std::bit_ceil(max_addrs*2) : 0),
+		shift(Table.empty() ? 0 : 64-std::countr_zero(Table.size()))
+	{
+		free_list.reserve(max_addrs);
+		for(size_t i = max_addrs; i-- > 0;)
+			free_list.push_back(static_cast<uint32_t>(i));
+	}
+	AddressTable(const AddressTable&) = delete;
+	AddressTable& operator=(const AddressTable&) = delete;
+
+	//Associate a branch with an address (or refresh it), and return the active branch for the address
+	//	(it's DROPPED if the address has no room for it, or with NoBranch active, if the table has no room at all)
+	//	admit: only called for a new association there's room for (before anything's evicted) - it's REJECTED
+	//	if it returns false (with NoBranch active, if the address is new)
+	template <typename Admit = AdmitAll>
+	std::pair<AddResult,branch_id_t> Associate(const uint64_t addr, const branch_id_t branch, Admit admit = Admit())
+	{
+		auto index = Find(addr);
+		if(index != None && !Prune(index))
+			index = None; //freed
+		if(index == None)
+		{
+			if(Entries.empty()) [[unlikely]]
+				return {AddResult::DROPPED,NoBranch};
+			if(!admit())
+				return {AddResult::REJECTED,NoBranch};
+			index = Allocate(addr);
+			Touch(index);
+		}
+		else
+		{
+			Touch(index);
+			auto& entry = Entries[index];
+			for(size_t i=0; i<entry.count; i++)
+				if(At(index,i).id == branch)
+				{
+					At(index,i).seen = epoch;
+					return {AddResult::REFRESHED,entry.branches[0].id};
+				}
+			if(entry.count >= max_branches && !branch_lru)
+			{
+				branch_drops++;
+				return {AddResult::DROPPED,entry.branches[0].id};
+			}
+			if(!admit())
+				return {AddResult::REJECTED,entry.branches[0].id};
+			if(entry.count >= max_branches)
+				EvictBranch(index);
+		}
+
+		auto& entry = Entries[index];
+		if(entry.count < InlineBranches)
+			entry.branches[entry.count] = {branch,epoch};
+		else
+		{
+			overflow[index].push_back({branch,epoch});
+			overflowed = overflow.size();
+		}
+		entry.count++;
+		return {AddResult::ADDED,entry.branches[0].id};
+	}
+
+	//Associate a branch that only has 'remaining' left before it times out (eg. from a snapshot)
+	//	an address that's already got the branch is left alone
+	AddResult Restore(const uint64_t addr, const branch_id_t branch, const std::chrono::milliseconds remaining)
+	{
+		const auto index = Find(addr);
+		if(index != None)
+			for(size_t i=0; i<Entries[index].count; i++)
+				if(At(index,i).id == branch)
+					return AddResult::REFRESHED;
+		const auto res = Associate(addr,branch).first;
+		if(res == AddResult::ADDED)
+		{
+			//(rounded up to whole epochs)
+			const auto left = static_cast<uint32_t>(std::min<int64_t>(AgeEpochs,(remaining+epoch_period-std::chrono::milliseconds(1))/epoch_period));
+			const auto added = Find(addr);
+			At(added,Entries[added].count-1).seen = epoch-(AgeEpochs-left);
+		}
+		return res;
+	}
+
+	//Call f(addr, branch, remaining) for every branch that hasn't timed out, in up to count entries from 'from' on
+	//	in table order, and each address's branches in order (the active one first). Returns where to carry on from
+	//	(Capacity() when it's done) - so a big table can be gone through a chunk at a time, letting go of it in between
+	template<typename F> size_t ForEach(const size_t from, const size_t count, F&& f) const
+	{
+		const auto end = std::min(Entries.size(),from+count);
+		for(auto index = static_cast<uint32_t>(from); index < end; index++)
+		{
+			const auto& entry = Entries[index];
+			for(size_t i=0; i<entry.count; i++)
+			{
+				const auto& br = At(index,i);
+				const auto age = epoch-br.seen;
+				if(age <= AgeEpochs)
+					f(entry.addr,br.id,epoch_period*(AgeEpochs-age));
+			}
+		}
+		return end;
+	}
+
+	//The active branch for an address, if there is one
+	branch_id_t Active(const uint64_t addr)
+	{
+		const auto index = Find(addr);
+		if(index == None || !Prune(index))
+			return NoBranch;
+		Touch(index);
+		return Entries[index].branches[0].id;
+	}
+
+	//Age everything by an epoch - and so addresses that aren't looked up any more don't hang around,
+	//	sweep through the next part of the table for timed out branches
+	void Tick()
+	{
+		epoch++;
+		for(size_t i=0; i<SweepPerEpoch && i<Entries.size(); i++)
+		{
+			sweep_pos = (sweep_pos+1)%Entries.size();
+			if(Entries[sweep_pos].count)
+				Prune(static_cast<uint32_t>(sweep_pos));
+		}
+	}
+	std::chrono::milliseconds EpochPeriod() const { return epoch_period; }
+
+	size_t Size() const { return used; }
+	size_t Capacity() const { return Entries.size(); }
+	size_t Evictions() const { return evictions; }
+	size_t BranchEvictions() const { return branch_evictions; }
+	size_t BranchDrops() const { return branch_drops; }
+	size_t Overflowed() const { return overflowed; } //addresses with more than InlineBranches
+	//table memory per address (all allocated up front - not counting the overflow store)
+	size_t BytesPerAddress() const
+	{
+		return sizeof(Entry) + sizeof(uint32_t) + (Entries.empty() ? 0 : Table.size()*sizeof(Slot)/Entries.size());
+	}
+
+private:
+	static constexpr uint32_t None = std::numeric_limits<uint32_t>::max();
+
+	struct Branch
+	{
+		branch_id_t id = NoBranch;
+		uint32_t seen = 0; //epoch it was last refreshed
+	};
+	struct Entry
+	{
+		uint64_t addr = 0;
+		uint32_t newer = None; //LRU list
+		uint32_t older = None;
+		uint32_t count = 0;    //branches - zero if the entry's free
+		std::array<Branch,InlineBranches> branches;
+	};
+	struct Slot
+	{
+		uint64_t addr = 0;
+		uint32_t index = None;
+	};
+
+	size_t Home(const uint64_t addr) const
+	{
+		return static_cast<size_t>((addr*0x9E3779B97F4A7C15ull) >> shift);
+	}
+	//An address's i'th branch
+	Branch& At(const uint32_t index, const size_t i)
+	{
+		return i < InlineBranches ? Entries[index].branches[i] : overflow.find(index)->second[i-InlineBranches];
+	}
+	const Branch& At(const uint32_t index, const size_t i) const
+	{
+		return i < InlineBranches ? Entries[index].branches[i] : overflow.find(index)->second[i-InlineBranches];
+	}
+	//Cut an address's branches down to the first count
+	void Truncate(const uint32_t index, const size_t count)
+	{
+		auto& entry = Entries[index];
+		if(entry.count > InlineBranches)
+		{
+			if(count > InlineBranches)
+				overflow[index].resize(count-InlineBranches);
+			else
+				overflow.erase(index);
+		}
+		entry.count = static_cast<uint32_t>(count);
+		overflowed = overflow.size();
+	}
+
+	uint32_t Find(const uint64_t addr) const
+	{
+		if(Table.empty())
+			return None;
+		for(auto pos = Home(addr); Table[pos].index != None; pos = (pos+1) & (Table.size()-1))
+			if(Table[pos].addr == addr)
+				return Table[pos].index;
+		return None;
+	}
+	//Empty the slot for an address, and shift back any following slots that would be unreachable otherwise
+	void Erase(const uint64_t addr)
+	{
+		const auto mask = Table.size()-1;
+		auto hole = Home(addr);
+		while(Table[hole].addr != addr || Table[hole].index == None)
+			hole = (hole+1) & mask;
+		for(auto pos = (hole+1) & mask; Table[pos].index != None; pos = (pos+1) & mask)
+		{
+			const auto home = Home(Table[pos].addr);
+			if(((pos-home) & mask) >= ((pos-hole) & mask))
+			{
+				Table[hole] = Table[pos];
+				hole = pos;
+			}
+		}
+		Table[hole] = Slot();
+	}
+
+	void Unlink(const uint32_t index)
+	{
+		auto& entry = Entries[index];
+		(entry.newer != None ? Entries[entry.newer].older : lru_newest) = entry.older;
+		(entry.older != None ? Entries[entry.older].newer : lru_oldest) = entry.newer;
+		entry.newer = entry.older = None;
+	}
+	void LinkNewest(const uint32_t index)
+	{
+		Entries[index].older = lru_newest;
+		(lru_newest != None ? Entries[lru_newest].newer : lru_oldest) = index;
+		lru_newest = index;
+	}
+	//Most recently used
+	void Touch(const uint32_t index)
+	{
+		if(index == lru_newest)
+			return;
+		Unlink(index);
+		LinkNewest(index);
+	}
+
+	uint32_t Allocate(const uint64_t addr)
+	{
+		if(free_list.empty())
+		{
+			auto& oldest = Entries[lru_oldest];
+			for(size_t i=0; i<oldest.count; i++)
+				drop_handler(oldest.addr,At(lru_oldest,i).id,true);
+			Free(lru_oldest);
+			evictions++;
+		}
+		const auto index = free_list.back();
+		free_list.pop_back();
+		used++;
+		auto& entry = Entries[index];
+		entry.addr = addr;
+		entry.count = 0;
+		auto pos = Home(addr);
+		while(Table[pos].index != None)
+			pos = (pos+1) & (Table.size()-1);
+		Table[pos] = {addr,index};
+		LinkNewest(index);
+		return index;
+	}
+	void Free(const uint32_t index)
+	{
+		Erase(Entries[index].addr);
+		Unlink(index);
+		Truncate(index,0);
+		free_list.push_back(index);
+		used--;
+	}
+
+	//Make way for a new branch: drop the least recently refreshed one (keeping the order of the rest)
+	//	(ties go to the later branch - the active one stays put if it's as fresh as any)
+	void EvictBranch(const uint32_t index)
+	{
+		auto& entry = Entries[index];
+		size_t victim = 0;
+		for(size_t i=1; i<entry.count; i++)
+			if(epoch-At(index,i).seen >= epoch-At(index,victim).seen)
+				victim = i;
+		drop_handler(entry.addr,At(index,victim).id,true);
+		for(size_t i=victim+1; i<entry.count; i++)
+			At(index,i-1) = At(index,i);
+		Truncate(index,entry.count-1);
+		branch_evictions++;
+	}
+
+	//Drop any timed out branches (keeping the order of the rest), and free the entry if there are none left
+	//	returns the number of branches left
+	size_t Prune(const uint32_t index)
+	{
+		auto& entry = Entries[index];
+		size_t kept = 0;
+		for(size_t i=0; i<entry.count; i++)
+		{
+			//(wraps around safely - the sweep gets to every entry long before the epoch could)
+			if(epoch-At(index,i).seen <= AgeEpochs)
+			{
+				if(kept != i)
+					At(index,kept) = At(index,i);
+				kept++;
+			}
+			else
+				drop_handler(entry.addr,At(index,i).id,false);
+		}
+		Truncate(index,kept);
+		if(!kept)
+			Free(index);
+		return kept;
+	}
+
+	const std::chrono::milliseconds epoch_period;
+	const size_t max_branches;
+	const bool branch_lru;
+	std::function<void(const uint64_t addr, const branch_id_t branch, const bool evicted)> drop_handler;
+	std::vector<Entry> Entries;
+	std::unordered_map<uint32_t,std::vector<Branch>> overflow; //by entry index - the branches past InlineBranches
+	std::vector<Slot> Table;
+	const int shift;
+	std::vector<uint32_t> free_list;
+	uint32_t lru_newest = None;
+	uint32_t lru_oldest = None;
+	uint32_t epoch = 0;
+	size_t sweep_pos = 0;
+	std::atomic<size_t> used = 0;
+	std::atomic<size_t> evictions = 0;
+	std::atomic<size_t> branch_evictions = 0;
+	std::atomic<size_t> branch_drops = 0;
+	std::atomic<size_t> overflowed = 0;
+};
+
+#endif // ADDRESSTABLE_H
@@ -0,0 +1,126 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef ADMISSIONLIMITER_H
+#define ADMISSIONLIMITER_H
+
+#include <asio.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+//Rate limits new cache entries - overall, and per source prefix
+//	so a burst of new (eg. spoofed) senders can't churn the caches, or crowd out the real branches
+//	Each limit is a token bucket kept as one timestamp (GCRA): when the bucket would next be full again.
+//	An entry is admitted if that's no more than a burst (a second's worth) ahead, and then it moves on by one interval
+//	The prefix buckets are a fixed array indexed by a hash of the prefix (prefixes that collide share a bucket),
+//	so nothing is allocated however many prefixes there are
+//	Not thread safe - the owner serializes access. The counts can be read from anywhere
+class AdmissionLimiter
+{
+public:
+	using Clock = std::chrono::steady_clock;
+	static constexpr size_t PrefixBucketBits = 12;
+	static constexpr uint8_t PrefixLenV6 = 64;
+
+	//rates: per second (0 means unlimited). prefix_len_v4: IPv4 source prefix length (IPv6 sources use a /64)
+	AdmissionLimiter(const double rate, const double prefix_rate, const uint8_t prefix_len_v4):
+		global(rate),
+		prefix(prefix_rate),
+		mask_v4(prefix_len_v4 ? ~uint32_t(0) << (32-std::min<uint8_t>(prefix_len_v4,32)) : 0)
+	{}
+	AdmissionLimiter(const AdmissionLimiter&) = delete;
+	AdmissionLimiter& operator=(const AdmissionLimiter&) = delete;
+
+	bool Enabled() const { return global.interval.count() || prefix.interval.count(); }
+
+	//Whether to admit a new entry from the sender - it's only counted against the limits if it is
+	bool Admit(const asio::ip::udp::endpoint& sender, const Clock::time_point& now = Clock::now())
+	{
+		const auto t = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+		uint64_t* prefix_tat = prefix.interval.count() ? &prefix_tats[Bucket(sender)] : nullptr;
+		if(prefix_tat && !prefix.Conforms(*prefix_tat,t))
+		{
+			rejected_prefix++;
+			return false;
+		}
+		if(global.interval.count() && !global.Conforms(global_tat,t))
+		{
+			rejected_global++;
+			return false;
+		}
+		if(prefix_tat)
+			prefix.Take(*prefix_tat,t);
+		if(global.interval.count())
+			global.Take(global_tat,t);
+		return true;
+	}
+
+	size_t RejectedGlobal() const { return rejected_global; }
+	size_t RejectedPrefix() const { return rejected_prefix; }
+
+private:
+	struct Limit
+	{
+		explicit Limit(const double rate):
+			interval(rate > 0 ? std::max<int64_t>(1,static_cast<int64_t>(1e9/rate)) : 0),
+			//a second's worth (at least one)
+			tolerance(rate > 0 ? interval*(std::max<int64_t>(1,static_cast<int64_t>(rate))-1) : std::chrono::nanoseconds(0))
+		{}
+		bool Conforms(const uint64_t tat, const uint64_t t) const
+		{
+			return tat <= t || tat-t <= static_cast<uint64_t>(tolerance.count());
+		}
+		void Take(uint64_t& tat, const uint64_t t) const
+		{
+			tat = std::max(tat,t)+interval.count();
+		}
+		const std::chrono::nanoseconds interval; //between admissions at the steady rate - zero if unlimited
+		const std::chrono::nanoseconds tolerance;
+	};
+
+	//(IPv4-mapped IPv6 addresses are bucketed as IPv4 - eg. from a dual stack socket)
+	size_t Bucket(const asio::ip::udp::endpoint& sender) const
+	{
+		const auto& addr = sender.address();
+		uint64_t key;
+		if(addr.is_v4())
+			key = addr.to_v4().to_uint() & mask_v4;
+		else if(addr.to_v6().is_v4_mapped())
+			key = asio::ip::make_address_v4(asio::ip::v4_mapped,addr.to_v6()).to_uint() & mask_v4;
+		else
+		{
+			const auto bytes = addr.to_v6().to_bytes();
+			key = 0;
+			for(size_t i=0; i<PrefixLenV6/8; i++)
+				key = (key << 8) | bytes[i];
+		}
+		return static_cast<size_t>((key*0x9E3779B97F4A7C15ull) >> (64-PrefixBucketBits));
+	}
+
+	const Limit global;
+	const Limit prefix;
+	const uint32_t mask_v4;
+	uint64_t global_tat = 0;
+	std::array<uint64_t,size_t(1) << PrefixBucketBits> prefix_tats = {};
+	std::atomic<size_t> rejected_global = 0;
+	std::atomic<size_t> rejected_prefix = 0;
+};
+
+#endif // ADMISSIONLIMITER_H
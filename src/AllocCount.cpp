@@ -0,0 +1,56 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include "AllocCount.h"
+
+#ifdef MP_ALLOC_COUNT
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<size_t> alloc_count = 0;
+
+size_t AllocCount()
+{
+	return alloc_count.load();
+}
+
+//The rest of the replaceable forms (arrays, nothrow) forward to these by default
+void* operator new(std::size_t size)
+{
+	alloc_count.fetch_add(1,std::memory_order_relaxed);
+	if(auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t align)
+{
+	alloc_count.fetch_add(1,std::memory_order_relaxed);
+	const auto alignment = static_cast<std::size_t>(align);
+	//aligned_alloc wants a (non-zero) multiple of the alignment
+	if(auto p = std::aligned_alloc(alignment,size ? (size+alignment-1)/alignment*alignment : alignment))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+#endif //MP_ALLOC_COUNT
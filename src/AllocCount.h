@@ -0,0 +1,31 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef ALLOCCOUNT_H
+#define ALLOCCOUNT_H
+
+/// Heap allocation counting - MP_ALLOC_COUNT is defined by the build (cmake -DMP_ALLOC_COUNT=ON)
+/// to replace the global operator new with a counting one, so the benchmark can check the datagram path doesn't allocate
+#ifdef MP_ALLOC_COUNT
+#include <cstddef>
+
+//number of heap allocations (operator new) since startup, from all threads
+size_t AllocCount();
+
+#endif //MP_ALLOC_COUNT
+
+#endif // ALLOCCOUNT_H
@@ -0,0 +1,163 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include "BatchIO.h"
+
+#ifdef HAVE_BATCH_IO
+#include <cerrno>
+#include <cstring>
+
+RcvBatch::RcvBatch(const size_t max_size, const bool with_gro):
+	msgs(max_size),
+	iovs(max_size*2),
+	senders(max_size),
+	controls(with_gro ? max_size : 0)
+{
+	for(size_t i=0; i<max_size; i++)
+	{
+		msgs[i].msg_hdr = {};
+		msgs[i].msg_hdr.msg_iov = &iovs[i*2];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+void RcvBatch::Prep(const size_t i, uint8_t* const buf, const size_t len, uint8_t* const spill, const size_t spill_len)
+{
+	auto& hdr = msgs[i].msg_hdr;
+	hdr.msg_iov[0].iov_base = buf;
+	hdr.msg_iov[0].iov_len = len;
+	hdr.msg_iov[1].iov_base = spill;
+	hdr.msg_iov[1].iov_len = spill_len;
+	hdr.msg_iovlen = spill ? 2 : 1;
+	hdr.msg_name = senders[i].data();
+	hdr.msg_namelen = senders[i].capacity();
+	if(!controls.empty())
+	{
+		hdr.msg_control = controls[i].buf;
+		hdr.msg_controllen = sizeof(controls[i].buf);
+	}
+	msgs[i].msg_len = 0;
+}
+
+size_t RcvBatch::SegmentSize(const size_t i) const
+{
+	if(controls.empty())
+		return 0;
+	return GROSegmentSize(msgs[i].msg_hdr);
+}
+
+size_t GROSegmentSize(const msghdr& msg)
+{
+#ifdef UDP_GRO
+	for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&msg),cmsg))
+		if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+		{
+			int segment_size;
+			std::memcpy(&segment_size,CMSG_DATA(cmsg),sizeof(segment_size));
+			return segment_size;
+		}
+#endif
+	return 0;
+}
+
+size_t RcvBatch::Receive(const int fd, const size_t count, asio::error_code& err)
+{
+	err.clear();
+	int n;
+	do n = recvmmsg(fd, msgs.data(), count, MSG_DONTWAIT, nullptr);
+	while(n < 0 && errno == EINTR);
+
+	if(n < 0)
+	{
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			err = asio::error_code(errno,asio::error::get_system_category());
+		return 0;
+	}
+	for(int i=0; i<n; i++)
+		senders[i].resize(msgs[i].msg_hdr.msg_namelen);
+	return n;
+}
+
+SndBatch::SndBatch(const size_t max_size, const bool with_gso):
+	iov_stride(with_gso ? MaxSegments : 1),
+	msgs(max_size),
+	iovs(max_size*iov_stride),
+	controls(with_gso ? max_size : 0)
+{
+	for(size_t i=0; i<max_size; i++)
+	{
+		msgs[i].msg_hdr = {};
+		msgs[i].msg_hdr.msg_iov = &iovs[i*iov_stride];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+void SndBatch::Prep(const size_t i, const uint8_t* const buf, const size_t len, const asio::ip::udp::endpoint& dest)
+{
+	auto& hdr = msgs[i].msg_hdr;
+	hdr.msg_iov[0].iov_base = const_cast<uint8_t*>(buf);
+	hdr.msg_iov[0].iov_len = len;
+	hdr.msg_iovlen = 1;
+	hdr.msg_name = const_cast<sockaddr*>(reinterpret_cast<const sockaddr*>(dest.data()));
+	hdr.msg_namelen = dest.size();
+	hdr.msg_control = nullptr;
+	hdr.msg_controllen = 0;
+	msgs[i].msg_len = 0;
+}
+
+void SndBatch::Append(const size_t i, const uint8_t* const buf, const size_t len)
+{
+#ifdef HAVE_UDP_GSO
+	auto& hdr = msgs[i].msg_hdr;
+	hdr.msg_iov[hdr.msg_iovlen].iov_base = const_cast<uint8_t*>(buf);
+	hdr.msg_iov[hdr.msg_iovlen].iov_len = len;
+	hdr.msg_iovlen++;
+
+	//the segment size is the size of the first datagram
+	if(!hdr.msg_control)
+	{
+		hdr.msg_control = controls[i].buf;
+		hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+		auto cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		const uint16_t segment_size = hdr.msg_iov[0].iov_len;
+		std::memcpy(CMSG_DATA(cmsg),&segment_size,sizeof(segment_size));
+	}
+#endif
+}
+
+size_t SndBatch::Send(const int fd, const size_t count, asio::error_code& err)
+{
+	err.clear();
+	int n;
+	do n = sendmmsg(fd, msgs.data(), count, MSG_DONTWAIT);
+	while(n < 0 && errno == EINTR);
+
+	if(n < 0)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			err = asio::error::would_block;
+		else
+			err = asio::error_code(errno,asio::error::get_system_category());
+		return 0;
+	}
+	return n;
+}
+
+#endif //HAVE_BATCH_IO
@@ -0,0 +1,106 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef BATCHIO_H
+#define BATCHIO_H
+
+#include <asio.hpp>
+#include <vector>
+#include <cstdint>
+
+/// Batched datagram syscalls (recvmmsg/sendmmsg) are only available on Linux
+#if defined(__linux__)
+#define HAVE_BATCH_IO
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#ifdef UDP_SEGMENT
+#define HAVE_UDP_GSO
+#endif
+
+//aligned space for one int sized (UDP_GRO/UDP_SEGMENT) control message
+union udp_control_t
+{
+	cmsghdr align;
+	uint8_t buf[CMSG_SPACE(sizeof(int))];
+};
+
+//Scatter descriptors for draining up to max_size datagrams in a single recvmmsg
+class RcvBatch
+{
+public:
+	//with_gro: also receive the UDP_GRO segment size control message
+	explicit RcvBatch(const size_t max_size, const bool with_gro = false);
+
+	//point slot i at a receive buffer
+	//	optionally with a spill buffer for the rest of a datagram that doesn't fit
+	void Prep(const size_t i, uint8_t* const buf, const size_t len, uint8_t* const spill = nullptr, const size_t spill_len = 0);
+	//non-blocking read of up to count datagrams into the first count slots
+	//  returns the number of datagrams read (zero if none were ready)
+	size_t Receive(const int fd, const size_t count, asio::error_code& err);
+
+	size_t MaxSize() const { return msgs.size(); }
+	uint8_t* Buf(const size_t i) const { return static_cast<uint8_t*>(msgs[i].msg_hdr.msg_iov[0].iov_base); }
+	size_t Size(const size_t i) const { return msgs[i].msg_len; }
+	const asio::ip::udp::endpoint& Sender(const size_t i) const { return senders[i]; }
+	//the size of the segments that were coalesced into datagram i, or zero if it's just one datagram
+	size_t SegmentSize(const size_t i) const;
+
+private:
+	std::vector<mmsghdr> msgs;
+	std::vector<iovec> iovs;
+	std::vector<asio::ip::udp::endpoint> senders;
+	std::vector<udp_control_t> controls;
+};
+
+//Parse a UDP_GRO control message - returns the segment size, or zero if there isn't one
+size_t GROSegmentSize(const msghdr& msg);
+
+//Gather descriptors for sending up to max_size datagrams in a single sendmmsg
+class SndBatch
+{
+public:
+	static constexpr size_t MaxSegments = 64;  //UDP_MAX_SEGMENTS - most datagrams in one GSO send
+	static constexpr size_t MaxGSOBytes = 65487; //max IP datagram, less the biggest IP and UDP headers
+
+	//with_gso: slots can hold a train of datagrams, sent as one with UDP GSO
+	explicit SndBatch(const size_t max_size, const bool with_gso = false);
+
+	//point slot i at a datagram and its destination
+	void Prep(const size_t i, const uint8_t* const buf, const size_t len, const asio::ip::udp::endpoint& dest);
+	//add another datagram to slot i, for the kernel to segment (GSO)
+	//	all the datagrams in a slot go to the same destination, and all but the last have to be the same size
+	void Append(const size_t i, const uint8_t* const buf, const size_t len);
+	//number of datagrams in slot i
+	size_t Count(const size_t i) const { return msgs[i].msg_hdr.msg_iovlen; }
+	//non-blocking send of the first count slots
+	//  returns the number of slots sent - fewer than count if the socket would block (err == would_block)
+	//  or there was an error sending the next slot
+	size_t Send(const int fd, const size_t count, asio::error_code& err);
+
+	size_t MaxSize() const { return msgs.size(); }
+
+private:
+	const size_t iov_stride;
+	std::vector<mmsghdr> msgs;
+	std::vector<iovec> iovs;
+	std::vector<udp_control_t> controls;
+};
+
+#endif //__linux__
+
+#endif // BATCHIO_H
@@ -0,0 +1,157 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef BRANCHTABLE_H
+#define BRANCHTABLE_H
+
+#include <asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <cstdint>
+
+//A branch endpoint, interned
+using branch_id_t = uint32_t;
+constexpr branch_id_t NoBranch = std::numeric_limits<branch_id_t>::max();
+
+//Interns branch endpoints as small dense IDs
+//	a sender is looked up here once per datagram, and the rest of the routing state (caches, address table,
+//	fixed branches) works in IDs - cheap to hash, compare and store. The endpoint is only needed again to send to it
+//	IDs are reference counted by whatever holds onto them, and freed (to be reused) when the last reference goes
+//	Not thread safe - everything happens on the process strand. The count can be read from anywhere
+class BranchTable
+{
+public:
+	using endpoint_t = asio::ip::udp::endpoint;
+
+	BranchTable() = default;
+	BranchTable(const BranchTable&) = delete;
+	BranchTable& operator=(const BranchTable&) = delete;
+
+	//The ID for an endpoint - a new one (with no references yet) if it hasn't been seen
+	branch_id_t Intern(const endpoint_t& ep)
+	{
+		const auto hash = Hash(ep);
+		if(!Table.empty())
+			for(auto pos = Home(hash); Table[pos].id != NoBranch; pos = (pos+1) & (Table.size()-1))
+				if(Table[pos].tag == static_cast<uint32_t>(hash) && Endpoints[Table[pos].id] == ep)
+					return Table[pos].id;
+
+		branch_id_t id;
+		if(free_ids.empty())
+		{
+			id = static_cast<branch_id_t>(Endpoints.size());
+			Endpoints.push_back(ep);
+			Hashes.push_back(hash);
+			Refs.push_back(0);
+		}
+		else
+		{
+			id = free_ids.back();
+			free_ids.pop_back();
+			Endpoints[id] = ep;
+			Hashes[id] = hash;
+		}
+		if((used+1)*2 > Table.size())
+			Rehash(std::max<size_t>(16,Table.size()*2));
+		Insert(id,hash);
+		used++;
+		return id;
+	}
+	const endpoint_t& Endpoint(const branch_id_t id) const
+	{
+		return Endpoints[id];
+	}
+	void Ref(const branch_id_t id)
+	{
+		Refs[id]++;
+	}
+	void Unref(const branch_id_t id)
+	{
+		if(--Refs[id] == 0)
+			Free(id);
+	}
+	size_t Size() const { return used; }
+
+private:
+	//id, and some of the hash to check before comparing endpoints
+	struct Slot
+	{
+		branch_id_t id = NoBranch;
+		uint32_t tag = 0;
+	};
+
+	//(Fibonacci hashing - spreads out hashes that only differ in a few bits, like ports)
+	static uint64_t Hash(const endpoint_t& ep)
+	{
+		return static_cast<uint64_t>(std::hash<endpoint_t>()(ep))*0x9E3779B97F4A7C15ull;
+	}
+	size_t Home(const uint64_t hash) const
+	{
+		return static_cast<size_t>(hash >> shift);
+	}
+	void Insert(const branch_id_t id, const uint64_t hash)
+	{
+		auto pos = Home(hash);
+		while(Table[pos].id != NoBranch)
+			pos = (pos+1) & (Table.size()-1);
+		Table[pos] = {id,static_cast<uint32_t>(hash)};
+	}
+	void Rehash(const size_t size)
+	{
+		const auto old = std::exchange(Table,std::vector<Slot>(size));
+		shift = 64-std::countr_zero(size);
+		for(const auto& slot : old)
+			if(slot.id != NoBranch)
+				Insert(slot.id,Hashes[slot.id]);
+	}
+	//Empty the slot for an ID, and shift back any following slots that would be unreachable otherwise (no tombstones)
+	void Free(const branch_id_t id)
+	{
+		const auto mask = Table.size()-1;
+		auto hole = Home(Hashes[id]);
+		while(Table[hole].id != id)
+			hole = (hole+1) & mask;
+		for(auto pos = (hole+1) & mask; Table[pos].id != NoBranch; pos = (pos+1) & mask)
+		{
+			const auto home = Home(Hashes[Table[pos].id]);
+			if(((pos-home) & mask) >= ((pos-hole) & mask))
+			{
+				Table[hole] = Table[pos];
+				hole = pos;
+			}
+		}
+		Table[hole] = Slot();
+		free_ids.push_back(id);
+		used--;
+	}
+
+	//by ID
+	std::vector<endpoint_t> Endpoints;
+	std::vector<uint64_t> Hashes;
+	std::vector<uint32_t> Refs;
+	std::vector<branch_id_t> free_ids;
+	std::vector<Slot> Table;
+	int shift = 64;
+	std::atomic<size_t> used = 0;
+};
+
+#endif // BRANCHTABLE_H
@@ -0,0 +1,145 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <array>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+//A datagram - shares ownership of the buffer it's in
+using p_rbuf_t = std::shared_ptr<uint8_t>;
+
+//A view of a datagram further into a shared buffer (eg. one segment of a GRO datagram)
+inline p_rbuf_t SubBuf(const p_rbuf_t& buf, const size_t offset)
+{
+	return p_rbuf_t(buf,buf.get()+offset);
+}
+
+//Recycled datagram buffers in a few size classes
+//	datagrams are received into MTU sized slabs, and only the ones that don't fit are copied into a bigger class
+//	Not thread safe - the owner serialises access (eg. on a strand). The counts can be read from anywhere
+class BufferPool
+{
+public:
+	static constexpr std::array<size_t,3> ClassSizes = {2048, 9216, 64*1024};
+	static constexpr size_t SlabClass = 0;
+	static constexpr size_t LargeClass = ClassSizes.size()-1;
+	static constexpr size_t SlabSize = ClassSizes[SlabClass];
+	static constexpr size_t LargeSize = ClassSizes[LargeClass];
+
+	//the smallest class that holds n bytes
+	static constexpr size_t ClassFor(const size_t n)
+	{
+		size_t c = 0;
+		while(c < LargeClass && ClassSizes[c] < n)
+			c++;
+		return c;
+	}
+
+	//max_bufs: limit on the buffers allocated (all classes), before Reserve() stops allocating
+	//rcv_class: the class datagrams are received into - those are all kept for reuse
+	//spares: how many free buffers to keep in each of the other classes - the rest go back to the heap
+	BufferPool(const size_t max_bufs, const size_t rcv_class, const size_t spares):
+		max_bufs(max_bufs),
+		rcv_class(rcv_class),
+		spares(spares)
+	{}
+	~BufferPool()
+	{
+		for(auto& free_list : free)
+			for(auto p : free_list)
+				delete[] p;
+	}
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	//Make sure there are free buffers of class c - up to 'want' of them, if the limit allows
+	//	returns the number that are free
+	size_t Reserve(const size_t c, const size_t want)
+	{
+		while(free[c].size() < want && Allocated() < max_bufs)
+		{
+			free[c].push_back(new uint8_t[ClassSizes[c]]);
+			allocated[c]++;
+		}
+		return free[c].size();
+	}
+	size_t Available(const size_t c) const { return free[c].size(); }
+
+	//Take a free buffer, or allocate one if there aren't any
+	//	(ignores the limit - a datagram that's already been received has to go somewhere,
+	//	and Reserve() holds back until there's room again)
+	uint8_t* Take(const size_t c)
+	{
+		uint8_t* p;
+		if(free[c].empty())
+		{
+			p = new uint8_t[ClassSizes[c]];
+			allocated[c]++;
+		}
+		else
+		{
+			//most recently used first - it's more likely to still be in cache
+			p = free[c].back();
+			free[c].pop_back();
+		}
+		in_use[c]++;
+		return p;
+	}
+	//Give back a buffer from Take()
+	void Give(const size_t c, uint8_t* const p)
+	{
+		in_use[c]--;
+		if(c != rcv_class && free[c].size() >= spares)
+		{
+			delete[] p;
+			allocated[c]--;
+			return;
+		}
+		free[c].push_back(p);
+	}
+
+	size_t Allocated() const
+	{
+		size_t total = 0;
+		for(const auto& count : allocated)
+			total += count;
+		return total;
+	}
+	size_t Allocated(const size_t c) const { return allocated[c]; }
+	size_t InUse(const size_t c) const { return in_use[c]; }
+
+	static std::string ClassName(const size_t c)
+	{
+		return ClassSizes[c]%1024 ? std::to_string(ClassSizes[c])+"B" : std::to_string(ClassSizes[c]/1024)+"KiB";
+	}
+
+private:
+	const size_t max_bufs;
+	const size_t rcv_class;
+	const size_t spares;
+	std::array<std::vector<uint8_t*>,ClassSizes.size()> free; //(stacks - they keep their storage, unlike a deque)
+	std::array<std::atomic<size_t>,ClassSizes.size()> allocated = {};
+	std::array<std::atomic<size_t>,ClassSizes.size()> in_use = {};
+};
+
+#endif // BUFFERPOOL_H
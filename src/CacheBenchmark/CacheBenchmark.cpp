@@ -0,0 +1,230 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+//Cost of the branch cache timeouts, as the number of entries grows
+//	TimeoutCache (on a TimingWheel): add, refresh, catching up with refreshes, and expiry
+//	vs. just the timers, with an asio timer per entry (how TimeoutCache used to do it): add and expiry
+//And the cost of fanning a datagram out to all the keys (like Hub mode forwarding to every branch)
+//	vs. walking a linked list of them, allocated along with a hash map (how TimeoutCache used to keep them)
+//And what a full cache holds under churn: a hot set of branches arriving after the cache has filled up with stale ones,
+//	with one-off branches mixed in - with the drop policy vs. LRU eviction
+//Usage: CacheBenchmark [timeout milliseconds (default 1000)]
+
+#include "../TimeoutCache.h"
+#include <asio.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static double NsPer(const Clock::time_point& start, const Clock::time_point& end, const size_t n)
+{
+	return n ? std::chrono::duration<double,std::nano>(end-start).count()/n : 0;
+}
+
+static asio::ip::udp::endpoint Endpoint(const size_t i)
+{
+	return asio::ip::udp::endpoint(asio::ip::address_v4(0x0A000000 | (i >> 8)),static_cast<unsigned short>(1024 + (i & 0xFF)));
+}
+
+static bool BenchWheel(const size_t n, const size_t timeout_ms)
+{
+	asio::io_context IOC;
+	asio::io_context::strand strand(IOC);
+	TimingWheel wheel(strand);
+	size_t expired = 0;
+	TimeoutCache<asio::ip::udp::endpoint> cache(wheel,timeout_ms,[&expired](const asio::ip::udp::endpoint&){expired++;});
+
+	std::vector<asio::ip::udp::endpoint> eps;
+	eps.reserve(n);
+	for(size_t i=0; i<n; i++)
+		eps.push_back(Endpoint(i));
+
+	const auto add_start = Clock::now();
+	for(const auto& ep : eps)
+		cache.Add(ep);
+	const auto added = Clock::now();
+
+	//so every refresh moves the expiry well past the original deadlines
+	std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms/2));
+
+	const auto refresh_start = Clock::now();
+	for(const auto& ep : eps)
+		cache.Add(ep);
+	const auto refreshed = Clock::now();
+
+	//the original deadlines: every entry has been refreshed, so it gets rescheduled
+	std::this_thread::sleep_until(added+std::chrono::milliseconds(timeout_ms+2));
+	const auto catchup_start = Clock::now();
+	wheel.Advance(catchup_start);
+	const auto catchup_end = Clock::now();
+	const auto early = expired;
+
+	//the refreshed deadlines: everything expires
+	std::this_thread::sleep_until(refreshed+std::chrono::milliseconds(timeout_ms+2));
+	const auto expire_start = Clock::now();
+	wheel.Advance(expire_start);
+	const auto expire_end = Clock::now();
+
+	printf("%9zu entries, TimingWheel:     add %7.1f ns, refresh %7.1f ns, reschedule refreshed %7.1f ns, expire %7.1f ns (per entry)\n",
+		n,NsPer(add_start,added,n),NsPer(refresh_start,refreshed,n),NsPer(catchup_start,catchup_end,n),NsPer(expire_start,expire_end,n));
+
+	if(early != 0 || expired != n || cache.Keys().size() != 0 || wheel.Size() != 0)
+	{
+		printf("Error: expected %zu entries to expire (and none early), got %zu early, %zu in total, %zu left\n",n,early,expired,cache.Keys().size());
+		return false;
+	}
+	return true;
+}
+
+static bool BenchTimers(const size_t n, const size_t timeout_ms)
+{
+	asio::io_context IOC;
+	asio::io_context::strand strand(IOC);
+	size_t expired = 0;
+	std::list<asio::steady_timer> timers;
+
+	const auto start = Clock::now();
+	for(size_t i=0; i<n; i++)
+	{
+		auto& timer = timers.emplace_back(IOC,std::chrono::milliseconds(timeout_ms));
+		timer.async_wait(asio::bind_executor(strand,[&expired](asio::error_code err){if(!err) expired++;}));
+	}
+	const auto added = Clock::now();
+
+	std::this_thread::sleep_until(added+std::chrono::milliseconds(timeout_ms+2));
+	const auto expire_start = Clock::now();
+	IOC.run();
+	const auto expire_end = Clock::now();
+
+	printf("%9zu entries, timer per entry: add %7.1f ns,                                              expire %7.1f ns (per entry)\n",
+		n,NsPer(start,added,n),NsPer(expire_start,expire_end,n));
+
+	if(expired != n)
+	{
+		printf("Error: expected %zu timers to expire, got %zu\n",n,expired);
+		return false;
+	}
+	return true;
+}
+
+//Queue a send to every branch but the sender - what Forward() does per datagram
+template<typename T> static size_t FanOut(const T& branches, const asio::ip::udp::endpoint& sender, std::vector<asio::ip::udp::endpoint>& tx_q)
+{
+	tx_q.clear();
+	for(const auto& endpoint : branches)
+		if(endpoint != sender)
+			tx_q.push_back(endpoint);
+	return tx_q.size();
+}
+
+static void BenchFanOut(const size_t n)
+{
+	asio::io_context IOC;
+	asio::io_context::strand strand(IOC);
+	TimingWheel wheel(strand);
+	TimeoutCache<asio::ip::udp::endpoint> cache(wheel,60000);
+	std::list<asio::ip::udp::endpoint> list;
+	std::unordered_map<asio::ip::udp::endpoint,Clock::time_point> map;
+	for(size_t i=0; i<n; i++)
+	{
+		cache.Add(Endpoint(i));
+		list.push_back(Endpoint(i));
+		map.emplace(Endpoint(i),Clock::now());
+	}
+
+	std::vector<asio::ip::udp::endpoint> tx_q;
+	tx_q.reserve(n);
+	const size_t rounds = std::max<size_t>(1,10000000/n);
+	size_t sent = 0;
+
+	auto start = Clock::now();
+	for(size_t r=0; r<rounds; r++)
+		sent += FanOut(cache.Keys(),Endpoint(r%n),tx_q);
+	const auto dense_end = Clock::now();
+	const auto dense = NsPer(start,dense_end,rounds*n);
+
+	start = Clock::now();
+	for(size_t r=0; r<rounds; r++)
+		sent += FanOut(list,Endpoint(r%n),tx_q);
+	const auto list_ns = NsPer(start,Clock::now(),rounds*n);
+
+	printf("%9zu branches, fan-out: TimeoutCache keys %5.2f ns, linked list %5.2f ns (per branch, %zu sends)\n",n,dense,list_ns,sent);
+}
+
+static bool BenchChurn(const size_t capacity, const FullPolicy policy)
+{
+	asio::io_context IOC;
+	asio::io_context::strand strand(IOC);
+	TimingWheel wheel(strand);
+	TimeoutCache<asio::ip::udp::endpoint> cache(wheel,60000);
+	cache.SetMaxSize(capacity,policy);
+
+	//stale: fill the cache, and never come back
+	size_t next = 0;
+	for(size_t i=0; i<capacity; i++)
+		cache.Add(Endpoint(next++));
+
+	//hot: half the capacity, back every round. cold: a few one-offs every round
+	const size_t hot = capacity/2, cold = std::max<size_t>(1,capacity/10), rounds = 100;
+	const size_t hot_base = next;
+	next += hot;
+	size_t hits = 0, adds = 0;
+	const auto start = Clock::now();
+	for(size_t r=0; r<rounds; r++)
+	{
+		for(size_t i=0; i<hot; i++, adds++)
+			hits += cache.Add(Endpoint(hot_base+i)) == AddResult::REFRESHED;
+		for(size_t i=0; i<cold; i++, adds++)
+			cache.Add(Endpoint(next++));
+	}
+	const auto end = Clock::now();
+
+	//(the first round can't hit)
+	const auto hit_rate = 100.0*hits/(hot*(rounds-1));
+	printf("%9zu capacity, churn: %s policy, hot set hit rate %5.1f%%, evictions %zu, drops %zu, %5.1f ns per add\n",
+		capacity,policy == FullPolicy::LRU ? "LRU " : "drop",hit_rate,cache.Evictions(),cache.Drops(),NsPer(start,end,adds));
+
+	if(policy == FullPolicy::LRU && hit_rate < 99.9)
+	{
+		printf("Error: expected the LRU cache to hold the hot set\n");
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	const size_t timeout_ms = argc > 1 ? std::strtoul(argv[1],nullptr,10) : 1000;
+	bool ok = true;
+	for(const size_t n : {1000, 100000, 1000000})
+	{
+		ok = BenchWheel(n,timeout_ms) && ok;
+		ok = BenchTimers(n,timeout_ms) && ok;
+	}
+	for(const size_t n : {10, 1000, 100000})
+		BenchFanOut(n);
+	for(const size_t n : {1000, 100000})
+		for(const auto policy : {FullPolicy::DROP, FullPolicy::LRU})
+			ok = BenchChurn(n,policy) && ok;
+	return ok ? 0 : 1;
+}
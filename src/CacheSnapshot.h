@@ -0,0 +1,255 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef CACHESNAPSHOT_H
+#define CACHESNAPSHOT_H
+
+#include <asio.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//The learned branches and switch mode addresses, with their remaining TTLs - so a restart doesn't have to learn them
+//	all again (which, in Switch mode, means flooding every datagram until it has)
+//	Compact binary, little endian: a header with the wall clock time it was written (so the TTLs can be aged by the time
+//	since), then fixed size branch and address records
+class CacheSnapshot
+{
+public:
+	using endpoint_t = asio::ip::udp::endpoint;
+
+	struct BranchRecord
+	{
+		endpoint_t ep;
+		std::chrono::milliseconds remaining;
+	};
+	struct AddressRecord
+	{
+		uint64_t addr;
+		endpoint_t ep; //(an address's branches are in order - the active one first)
+		std::chrono::milliseconds remaining;
+	};
+
+	std::vector<BranchRecord> Branches;
+	std::vector<AddressRecord> Addresses;
+
+	//Put the addresses in the order to restore them in: least recently refreshed first (by each one's freshest branch),
+	//	keeping each address's branches together and in order
+	void OrderAddresses()
+	{
+		std::vector<std::pair<std::chrono::milliseconds,size_t>> groups; //freshest branch, first record
+		for(size_t i=0; i<Addresses.size(); i++)
+		{
+			if(i == 0 || Addresses[i].addr != Addresses[i-1].addr)
+				groups.push_back({Addresses[i].remaining,i});
+			else
+				groups.back().first = std::max(groups.back().first,Addresses[i].remaining);
+		}
+		std::stable_sort(groups.begin(),groups.end(),[](const auto& a, const auto& b){ return a.first < b.first; });
+		std::vector<AddressRecord> ordered;
+		ordered.reserve(Addresses.size());
+		for(const auto& group : groups)
+			for(auto i = group.second; i<Addresses.size() && Addresses[i].addr == Addresses[group.second].addr; i++)
+				ordered.push_back(Addresses[i]);
+		std::swap(Addresses,ordered);
+	}
+
+	//Written to a temporary file first, synced to disk, and renamed over the old one (then the directory's synced too)
+	//	- so even after a crash or power cut, there's always a whole snapshot: the old one or the new one
+	//	throws std::runtime_error
+	void Write(const std::string& path) const
+	{
+		std::vector<uint8_t> out;
+		out.reserve(HeaderSize+Branches.size()*BranchSize+Addresses.size()*AddressSize);
+		out.insert(out.end(),Magic.begin(),Magic.end());
+		Put(out,Version,1);
+		Put(out,static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()),8);
+		Put(out,Branches.size(),4);
+		Put(out,Addresses.size(),4);
+		for(const auto& b : Branches)
+		{
+			PutEndpoint(out,b.ep);
+			Put(out,TTL(b.remaining),4);
+		}
+		for(const auto& a : Addresses)
+		{
+			Put(out,a.addr,8);
+			PutEndpoint(out,a.ep);
+			Put(out,TTL(a.remaining),4);
+		}
+
+		const auto tmp_path = path+".tmp";
+		auto file = std::fopen(tmp_path.c_str(),"wb");
+		if(!file)
+			throw std::runtime_error("Failed to open "+tmp_path);
+		const bool written = std::fwrite(out.data(),1,out.size(),file) == out.size() && std::fflush(file) == 0 && Sync(file);
+		if(std::fclose(file) != 0 || !written)
+			throw std::runtime_error("Failed to write "+tmp_path);
+		Replace(tmp_path,path);
+	}
+
+	//The remaining TTLs are reduced by the time since it was written, and anything that's expired since is left out
+	//	returns false if there's no file, throws std::runtime_error if it isn't a valid snapshot
+	bool Read(const std::string& path)
+	{
+		std::ifstream file(path,std::ios::binary);
+		if(!file)
+			return false;
+		const std::vector<uint8_t> in((std::istreambuf_iterator<char>(file)),std::istreambuf_iterator<char>());
+		const auto not_snapshot = std::runtime_error("Not a MiniPlex cache snapshot (version "+std::to_string(Version)+"): "+path);
+		if(in.size() < HeaderSize || !std::equal(Magic.begin(),Magic.end(),in.begin()) || Get(in,Magic.size(),1) != Version)
+			throw not_snapshot;
+		//(bounded, so the time since can't overflow)
+		if(Get(in,5,8) > MaxWritten)
+			throw not_snapshot;
+		const auto written = std::chrono::milliseconds(Get(in,5,8));
+		const auto num_branches = Get(in,13,4);
+		const auto num_addresses = Get(in,17,4);
+		if(in.size() != HeaderSize+num_branches*BranchSize+num_addresses*AddressSize)
+			throw std::runtime_error("Truncated cache snapshot: "+path);
+
+		const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+		//(if the clock's gone backwards, don't extend anything)
+		const auto elapsed = std::max(now-written,std::chrono::milliseconds::zero());
+		Branches.clear();
+		Addresses.clear();
+		size_t pos = HeaderSize;
+		for(size_t i=0; i<num_branches; i++, pos += BranchSize)
+		{
+			if(!ValidFamily(in,pos))
+				throw not_snapshot;
+			const auto remaining = std::chrono::milliseconds(Get(in,pos+EndpointSize,4))-elapsed;
+			if(remaining > std::chrono::milliseconds::zero())
+				Branches.push_back({GetEndpoint(in,pos),remaining});
+		}
+		for(size_t i=0; i<num_addresses; i++, pos += AddressSize)
+		{
+			if(!ValidFamily(in,pos+8))
+				throw not_snapshot;
+			const auto remaining = std::chrono::milliseconds(Get(in,pos+8+EndpointSize,4))-elapsed;
+			if(remaining > std::chrono::milliseconds::zero())
+				Addresses.push_back({Get(in,pos,8),GetEndpoint(in,pos+8),remaining});
+		}
+		return true;
+	}
+
+private:
+	static bool Sync(std::FILE* file)
+	{
+#ifdef _WIN32
+		return _commit(_fileno(file)) == 0;
+#else
+		return fsync(fileno(file)) == 0;
+#endif
+	}
+	//Rename over the old file, and make sure the rename itself is on disk
+	static void Replace(const std::string& from, const std::string& to)
+	{
+#ifdef _WIN32
+		if(!MoveFileExA(from.c_str(),to.c_str(),MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
+			throw std::runtime_error("Failed to rename "+from+" to "+to);
+#else
+		if(std::rename(from.c_str(),to.c_str()) != 0)
+			throw std::runtime_error("Failed to rename "+from+" to "+to);
+		const auto slash = to.find_last_of('/');
+		const auto dir = slash == std::string::npos ? std::string(".") : to.substr(0,std::max<size_t>(slash,1));
+		const auto fd = ::open(dir.c_str(),O_RDONLY);
+		const bool synced = fd >= 0 && fsync(fd) == 0;
+		if(fd >= 0)
+			::close(fd);
+		if(!synced)
+			throw std::runtime_error("Failed to sync directory "+dir);
+#endif
+	}
+
+	static constexpr std::array<uint8_t,4> Magic = {'M','P','C','S'};
+	static constexpr uint64_t Version = 1;
+	static constexpr size_t HeaderSize = 4+1+8+4+4;
+	static constexpr uint64_t MaxWritten = 253402300800000; //ms since the epoch - the year 10000
+	//family (4 or 6), IPv6 sized address, port
+	static constexpr size_t EndpointSize = 1+16+2;
+	static constexpr size_t BranchSize = EndpointSize+4;
+	static constexpr size_t AddressSize = 8+EndpointSize+4;
+
+	static uint64_t TTL(const std::chrono::milliseconds remaining)
+	{
+		return static_cast<uint64_t>(std::clamp<int64_t>(remaining.count(),0,UINT32_MAX));
+	}
+	static void Put(std::vector<uint8_t>& out, const uint64_t val, const size_t bytes)
+	{
+		for(size_t i=0; i<bytes; i++)
+			out.push_back(static_cast<uint8_t>(val >> (8*i)));
+	}
+	static uint64_t Get(const std::vector<uint8_t>& in, const size_t pos, const size_t bytes)
+	{
+		uint64_t val = 0;
+		for(size_t i=0; i<bytes; i++)
+			val |= static_cast<uint64_t>(in[pos+i]) << (8*i);
+		return val;
+	}
+	static void PutEndpoint(std::vector<uint8_t>& out, const endpoint_t& ep)
+	{
+		std::array<uint8_t,16> addr = {};
+		if(ep.address().is_v6())
+		{
+			const auto bytes = ep.address().to_v6().to_bytes();
+			std::copy(bytes.begin(),bytes.end(),addr.begin());
+		}
+		else
+		{
+			const auto bytes = ep.address().to_v4().to_bytes();
+			std::copy(bytes.begin(),bytes.end(),addr.begin());
+		}
+		Put(out,ep.address().is_v6() ? 6 : 4,1);
+		out.insert(out.end(),addr.begin(),addr.end());
+		Put(out,ep.port(),2);
+	}
+	static bool ValidFamily(const std::vector<uint8_t>& in, const size_t pos)
+	{
+		return in[pos] == 4 || in[pos] == 6;
+	}
+	static endpoint_t GetEndpoint(const std::vector<uint8_t>& in, const size_t pos)
+	{
+		const auto port = static_cast<uint16_t>(Get(in,pos+17,2));
+		if(in[pos] == 6)
+		{
+			asio::ip::address_v6::bytes_type bytes;
+			std::copy(in.begin()+pos+1,in.begin()+pos+17,bytes.begin());
+			return endpoint_t(asio::ip::address_v6(bytes),port);
+		}
+		asio::ip::address_v4::bytes_type bytes;
+		std::copy(in.begin()+pos+1,in.begin()+pos+5,bytes.begin());
+		return endpoint_t(asio::ip::address_v4(bytes),port);
+	}
+};
+
+#endif // CACHESNAPSHOT_H
@@ -34,18 +34,46 @@ struct CmdArgs
 		LocalAddr("l", "local", "Local ip address. Defaults to 0.0.0.0 for all ipv4 interfaces.", false, "0.0.0.0", "localaddr"),
 		LocalPort("p", "port", "Local port to listen/receive on.", true, 0, "port"),
 		SoRcvBuf("Z", "so_rcvbuf", "Datagram socket receive buffer size.", false, 512L*1024, "rcv buf size"),
-		MaxProcessQ("Y", "max_process_q", "Maximun number of datagram buffers to allocate. If this limit is reached, reading the socket is delayed until processing catches up",
+		MaxProcessQ("Y", "max_process_q", "Maximun number of datagram buffers to allocate. If this limit is reached, reading the socket is delayed until processing catches up. They're allocated (per shard) at startup",
 				false, 1024, "queue size"),
+		RcvBatch("R", "rcv_batch", "Maximum number of datagrams to drain from the socket per read readiness event (using recvmmsg on Linux). Defaults to 1: one receive call per datagram.",
+				false, 1, "batch size"),
+		SndBatch("W", "snd_batch", "Maximum number of datagrams to send per system call (using sendmmsg on Linux). Forwarded datagrams are queued per processing batch. Defaults to 1: one send call per datagram.",
+				false, 1, "batch size"),
+		Shards("K", "shards", "Number of sockets to listen on using SO_REUSEPORT (Linux only). The kernel spreads incoming datagrams across them, and each has its own receive loop, buffer pool and thread pinned to a core. Defaults to 1.",
+				false, 1, "num sockets"),
+		IOBackend("I", "io_backend", "Datagram I/O backend: asio (socket readiness reactor), or uring (Linux io_uring: multishot receive into kernel provided buffers, and submitting sends in batches). Default asio.",
+				false, "asio", "backend"),
+		GRO("G", "gro", "Enable UDP generic receive offload (Linux). The kernel can coalesce a burst of same sized datagrams from a sender into one receive, which is split back into datagrams without copying."),
+		GSOMaxSegment("g", "gso", "Enable UDP generic segmentation offload (Linux) for datagrams up to this size. Consecutive same sized datagrams to the same endpoint are sent as one, for the kernel to segment. Should be no bigger than the path MTU less the IP and UDP headers. Defaults to 0: disabled.",
+				false, 0, "max segment size"),
+		PipelineRing("q", "pipeline_ring", "Run the socket side of each shard and the datagram processing on dedicated threads that hand datagrams and buffers to each other through lock-free rings of this many entries (Linux only), instead of posting to the asio thread pool. Defaults to 0: disabled.",
+				false, 0, "ring size"),
+		RunToCompletion("L", "run_to_completion", "Low latency mode (Linux only): a dedicated thread per socket receives, routes and sends each batch of datagrams itself, with no hand-offs. It busy-polls the socket up to this many times before blocking to wait for it. Defaults to 0: disabled.",
+				false, 0, "spin budget"),
+		Routers("w", "routers", "Number of routers: the branch caches are partitioned by sender (and the Switch mode address table by address), so this many threads can route datagrams at once. Not supported in pipeline mode. Defaults to 1.",
+				false, 1, "num routers"),
 		CacheTimeout("o", "timeout", "Milliseconds to keep an idle endpoint cached",false,10000,"timeout"),
-		MaxBranchCache("O", "branch_cache_max", "Max number of entries in the active branch cache",false,0,"branch cache max"),
-		MaxSwitchCache("n", "switch_cache_max", "Max number of branches to cache for each switch mode address",false,0,"switch cache max"),
+		MaxBranchCache("O", "branch_cache_max", "Max number of entries in the active branch cache (split evenly between the routers - see -w)",false,0,"branch cache max"),
+		MaxSwitchCache("n", "switch_cache_max", "Max number of branches to cache for each switch mode address. Defaults to 0: unlimited. Up to 4 are kept inline in the address table - more than that spill into an overflow store.",false,0,"switch cache max"),
+		CacheFullPolicy("e", "cache_full", "What to do with a new branch when the branch cache (see -O), or a switch mode address's branches (see -n), are full: drop (ignore the new branch until an entry times out), or lru (evict the least recently refreshed entry to make room). Default drop.",false,"drop","policy"),
+		MaxSwitchAddrs("a", "switch_addr_max", "Max number of addresses in the switch mode address table (allocated up front, and split evenly between the routers - see -w). When it's full, the least recently used address is evicted. Defaults to 16384.",false,16384,"switch addr max"),
+		ACLFile("i", "acl", "File of source prefix rules, one per line: allow|deny <address>[/<length>] ('#' starts a comment). Each datagram's sender is matched by longest prefix: denied datagrams are dropped before anything else (they're never cached or forwarded), and ones no rule matches are allowed. Hit counts for each rule are logged with the stats (see -s). Defaults to none: everything is allowed.",false,"","acl file"),
+		AdmitRate("A", "admit_rate", "Max number of new cache entries (branches, and switch mode address associations) to admit per second, with up to a second's worth in a burst. Split evenly between the routers (see -w). A new sender that isn't admitted is still forwarded, like one that doesn't fit in a full cache - except in Switch mode, where its datagrams are dropped. Defaults to 0: unlimited.",false,0,"entries per second"),
+		AdmitPrefixRate("U", "admit_prefix_rate", "Like -A, but for each source prefix (see -k), so one sender network can't crowd out the others. Defaults to 0: unlimited.",false,0,"entries per second"),
+		AdmitPrefixLen("k", "admit_prefix_len", "IPv4 source prefix length for -U (IPv6 sources are limited per /64). Defaults to 24.",false,24,"prefix length"),
+		CacheSnapshotFile("d", "cache_snapshot", "File to save the learned branches and switch mode addresses to (with their remaining timeouts), periodically (see -D) and on shutdown. It's loaded at startup, leaving out anything that's timed out since. Defaults to none: the caches start empty.",false,"","snapshot file"),
+		CacheSnapshotPeriod("D", "cache_snapshot_period", "Number of milliseconds between saving cache snapshots (see -d). Defaults to 60000. 0: only on shutdown.",false,60000,"milliseconds"),
 		TrunkAddr("r", "trunk_ip", "Remote trunk ip address.", false, "", "trunk host"),
 		TrunkPort("t", "trunk_port", "Remote trunk port.", false, 0, "trunk port"),
 		BranchAddrs("B", "branch_ip", "Remote endpoint addresses to permanently cache. Use -b to provide respective ports in the same order.", false, "branch host"),
 		BranchPorts("b", "branch_port", "Remote endpoint port to permanently cache. Use -B to provide respective addresses in the same order.", false, "branch port"),
 		ByteCodeFile("C", "byte_code", "RV64IM RISC-V byte code file. Switch mode code for extracting src and dst addrs from packet data.\n"
-							 "Pre-conditions: a0=&buf, a1=buf_size, a2=&src, a3=&dst. Post-execution: result = a0 (success result==0, src/dst have been written).",
+							 "Pre-conditions: a0=&buf, a1=buf_size, a2=&src, a3=&dst, a4=&shared, a5=shared_size (see -V). Post-execution: result = a0 (success result==0, src/dst have been written).",
 				 false, "switch.bin", "switchmode bytecode file"),
+		JIT("J", "jit", "Translate the switch mode byte code (see -C) to native code when it's loaded, instead of interpreting it for every datagram (x86-64 only). Anything that can't be translated is still interpreted."),
+		VMShared("V", "vm_shared", "Size of the switch mode shared state region (see -C), for byte code that keeps state between datagrams (eg. sessions). Every router's VM (see -w) maps the same region. Defaults to 0: none - byte code that uses it (reads a4/a5) won't load.",false,0,"bytes"),
+		ExtractorFile("E", "extractor", "Switch mode address extractor spec file: offset/type/mask/compare rules, for protocols where checks and fixed fields are enough. Used instead of the byte code (see -C), without the VM.",false,"","extractor spec file"),
 		ConsoleLevel("c", "console_logging", "Console log level: off, critical, error, warn, info, debug, or trace. Default critical.", false, "critical", "console log level"),
 		FileLevel("f", "file_logging", "File log level: off, critical, error, warn, info, debug, or trace. Default error.", false, "error", "file log level"),
 		LogFile("F", "log_file", "Log filename. Defaults to ./MiniPlex.log", false, "MiniPlex.log", "log filename"),
@@ -53,8 +81,12 @@ struct CmdArgs
 		LogNum("N", "log_num", "Keep this many log files when rolling the log. Defaults to 3", false, 3, "number of files"),
 		ConcurrencyHint("x", "concurrency", "A hint for the number of threads in thread pool. Defaults to detected hardware concurrency.",false,std::thread::hardware_concurrency(),"num threads"),
 		Benchmark("M", "benchmark", "Run a loopback test for fixed duration (see -m) and exit."),
-		BenchDuration("m", "benchmark_duration", "Number of milliseconds to run the loopback benchmark test. Defaults to 10000.",false,10000,"milliseconds")
+		BenchDuration("m", "benchmark_duration", "Number of milliseconds to run the loopback benchmark test. Defaults to 10000.",false,10000,"milliseconds"),
+		BenchBranches("j", "benchmark_branches", "Number of branch sockets the loopback benchmark test sends from (so in Hub mode, the fan-out). Defaults to 100.",false,100,"num branches"),
+		StatsPeriod("s", "stats_period", "Number of milliseconds between logging performance counters (at info level), including ingress to egress latency percentiles. Defaults to 0: disabled.",false,0,"milliseconds")
 	{
+		cmd.add(StatsPeriod);
+		cmd.add(BenchBranches);
 		cmd.add(BenchDuration);
 		cmd.add(Benchmark);
 		cmd.add(ConcurrencyHint);
@@ -63,14 +95,34 @@ struct CmdArgs
 		cmd.add(LogFile);
 		cmd.add(FileLevel);
 		cmd.add(ConsoleLevel);
+		cmd.add(ExtractorFile);
+		cmd.add(VMShared);
+		cmd.add(JIT);
 		cmd.add(ByteCodeFile);
 		cmd.add(BranchPorts);
 		cmd.add(BranchAddrs);
 		cmd.add(TrunkPort);
 		cmd.add(TrunkAddr);
+		cmd.add(CacheSnapshotPeriod);
+		cmd.add(CacheSnapshotFile);
+		cmd.add(AdmitPrefixLen);
+		cmd.add(AdmitPrefixRate);
+		cmd.add(AdmitRate);
+		cmd.add(ACLFile);
+		cmd.add(MaxSwitchAddrs);
+		cmd.add(CacheFullPolicy);
 		cmd.add(MaxSwitchCache);
 		cmd.add(MaxBranchCache);
 		cmd.add(CacheTimeout);
+		cmd.add(Routers);
+		cmd.add(RunToCompletion);
+		cmd.add(PipelineRing);
+		cmd.add(GSOMaxSegment);
+		cmd.add(GRO);
+		cmd.add(IOBackend);
+		cmd.add(Shards);
+		cmd.add(SndBatch);
+		cmd.add(RcvBatch);
 		cmd.add(MaxProcessQ);
 		cmd.add(SoRcvBuf);
 		cmd.add(LocalAddr);
@@ -101,6 +153,21 @@ struct CmdArgs
 		}
 		if(BranchAddrs.getValue().size() != BranchPorts.getValue().size())
 			throw std::invalid_argument("Please provide the same number of branch IPs and branch ports. They will be paired.");
+
+		if(RcvBatch.getValue() == 0)
+			throw std::invalid_argument("Receive batch size must be at least 1.");
+		if(SndBatch.getValue() == 0)
+			throw std::invalid_argument("Send batch size must be at least 1.");
+		if(Shards.getValue() == 0)
+			throw std::invalid_argument("Number of shards must be at least 1.");
+		if(Routers.getValue() == 0)
+			throw std::invalid_argument("Number of routers must be at least 1.");
+		if(IOBackend.getValue() != "asio" && IOBackend.getValue() != "uring")
+			throw std::invalid_argument("Invalid I/O backend: "+IOBackend.getValue());
+		if(CacheFullPolicy.getValue() != "drop" && CacheFullPolicy.getValue() != "lru")
+			throw std::invalid_argument("Invalid cache full policy: "+CacheFullPolicy.getValue());
+		if(AdmitPrefixLen.getValue() > 32)
+			throw std::invalid_argument("Admission prefix length must be 0-32.");
 	}
 	TCLAP::CmdLine cmd;
 	TCLAP::SwitchArg Hub;
@@ -111,14 +178,34 @@ struct CmdArgs
 	TCLAP::ValueArg<uint16_t> LocalPort;
 	TCLAP::ValueArg<size_t> SoRcvBuf;
 	TCLAP::ValueArg<size_t> MaxProcessQ;
+	TCLAP::ValueArg<size_t> RcvBatch;
+	TCLAP::ValueArg<size_t> SndBatch;
+	TCLAP::ValueArg<size_t> Shards;
+	TCLAP::ValueArg<std::string> IOBackend;
+	TCLAP::SwitchArg GRO;
+	TCLAP::ValueArg<size_t> GSOMaxSegment;
+	TCLAP::ValueArg<size_t> PipelineRing;
+	TCLAP::ValueArg<size_t> RunToCompletion;
+	TCLAP::ValueArg<size_t> Routers;
 	TCLAP::ValueArg<size_t> CacheTimeout;
 	TCLAP::ValueArg<size_t>MaxBranchCache;
 	TCLAP::ValueArg<size_t>MaxSwitchCache;
+	TCLAP::ValueArg<std::string> CacheFullPolicy;
+	TCLAP::ValueArg<size_t> MaxSwitchAddrs;
+	TCLAP::ValueArg<std::string> ACLFile;
+	TCLAP::ValueArg<size_t> AdmitRate;
+	TCLAP::ValueArg<size_t> AdmitPrefixRate;
+	TCLAP::ValueArg<size_t> AdmitPrefixLen;
+	TCLAP::ValueArg<std::string> CacheSnapshotFile;
+	TCLAP::ValueArg<size_t> CacheSnapshotPeriod;
 	TCLAP::ValueArg<std::string> TrunkAddr;
 	TCLAP::ValueArg<uint16_t> TrunkPort;
 	TCLAP::MultiArg<std::string> BranchAddrs;
 	TCLAP::MultiArg<uint16_t> BranchPorts;
 	TCLAP::ValueArg<std::string> ByteCodeFile;
+	TCLAP::SwitchArg JIT;
+	TCLAP::ValueArg<size_t> VMShared;
+	TCLAP::ValueArg<std::string> ExtractorFile;
 	TCLAP::ValueArg<std::string> ConsoleLevel;
 	TCLAP::ValueArg<std::string> FileLevel;
 	TCLAP::ValueArg<std::string> LogFile;
@@ -127,6 +214,8 @@ struct CmdArgs
 	TCLAP::ValueArg<int> ConcurrencyHint;
 	TCLAP::SwitchArg Benchmark;
 	TCLAP::ValueArg<size_t> BenchDuration;
+	TCLAP::ValueArg<size_t> BenchBranches;
+	TCLAP::ValueArg<size_t> StatsPeriod;
 };
 
 #endif // CMDARGS_H
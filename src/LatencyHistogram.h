@@ -0,0 +1,97 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+
+//Log-linear histogram of latencies in nanoseconds
+//	each power of 2 range is split into SubBuckets linear buckets, so a percentile is within 1/SubBuckets of the real value
+//	Record() can be called from any thread (relaxed atomic counts), and it never allocates
+class LatencyHistogram
+{
+public:
+	static constexpr size_t SubBits = 4;
+	static constexpr size_t SubBuckets = size_t(1) << SubBits;
+	static constexpr size_t BucketCount = (64-SubBits+1)*SubBuckets;
+
+	void Record(const uint64_t ns)
+	{
+		counts[Index(ns)].fetch_add(1,std::memory_order_relaxed);
+	}
+	void Reset()
+	{
+		for(auto& count : counts)
+			count.store(0,std::memory_order_relaxed);
+	}
+
+	//A consistent enough copy of the counts to take percentiles from (Record() may carry on meanwhile)
+	struct Snapshot
+	{
+		std::array<uint64_t,BucketCount> counts = {};
+		uint64_t total = 0;
+
+		//the upper bound of the bucket holding the p'th percentile (p in 0-100), or 0 if it's empty
+		uint64_t Percentile(const double p) const
+		{
+			if(total == 0)
+				return 0;
+			const auto rank = std::max<uint64_t>(1,static_cast<uint64_t>(p/100*total+0.5));
+			uint64_t seen = 0;
+			for(size_t i=0; i<BucketCount; i++)
+				if((seen += counts[i]) >= rank)
+					return UpperBound(i);
+			return UpperBound(BucketCount-1);
+		}
+		uint64_t Max() const { return Percentile(100); }
+	};
+	Snapshot Take() const
+	{
+		Snapshot snap;
+		for(size_t i=0; i<BucketCount; i++)
+			snap.total += (snap.counts[i] = counts[i].load(std::memory_order_relaxed));
+		return snap;
+	}
+
+	//values below SubBuckets get a bucket each, then each power of 2 gets SubBuckets
+	static constexpr size_t Index(const uint64_t v)
+	{
+		if(v < SubBuckets)
+			return v;
+		const size_t shift = std::bit_width(v)-1-SubBits;
+		return (shift+1)*SubBuckets + ((v >> shift) - SubBuckets);
+	}
+	static constexpr uint64_t UpperBound(const size_t i)
+	{
+		if(i < SubBuckets)
+			return i;
+		const size_t shift = i/SubBuckets-1;
+		const uint64_t lower = uint64_t(i%SubBuckets + SubBuckets) << shift;
+		return lower + ((uint64_t(1) << shift)-1);
+	}
+
+private:
+	std::array<std::atomic<uint64_t>,BucketCount> counts = {};
+};
+
+#endif // LATENCYHISTOGRAM_H
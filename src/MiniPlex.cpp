@@ -17,354 +17,2197 @@
 
 #include "MiniPlex.h"
 #include "CmdArgs.h"
+#include "Platform.h"
+#include "AllocCount.h"
 #include <asio.hpp>
 #include <spdlog/spdlog.h>
+#include <algorithm>
 #include <memory>
+#include <set>
+#include <cstring>
 #include <csignal>
+#ifdef HAVE_IO_URING
+#include <unistd.h>
+#endif
+
+//(pipeline mode) the shard this thread is the socket stage for, if any
+static thread_local const void* socket_stage = nullptr;
+
+//Pipeline stages that run out of work spin for a while, then yield for a while, then park in their io_context
+static constexpr size_t SpinIdle = 256;
+static constexpr size_t YieldIdle = 64;
+//they're woken by a doorbell (or an I/O event or timer) - the timeout is just a backstop
+static constexpr auto ParkTimeout = std::chrono::milliseconds(10);
+
+//Wake a pipeline stage that's parked in its io_context, after giving it something to do
+//	the fence pairs with the one in IdleBackoff() - either the stage sees the work, or we see it's parked
+static void Doorbell(asio::io_context& ctx, std::atomic_bool& parked)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(parked.load(std::memory_order_relaxed) && parked.exchange(false))
+		asio::post(ctx,Pooled([](){}));
+}
+
+template<typename HasWork>
+static void IdleBackoff(asio::io_context& ctx, std::atomic_bool& parked, size_t& idle, const HasWork& has_work)
+{
+	if(++idle <= SpinIdle)
+		CpuRelax();
+	else if(idle <= SpinIdle+YieldIdle)
+		std::this_thread::yield();
+	else
+	{
+		parked = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(has_work())
+			std::this_thread::yield();
+		else
+			ctx.run_one_for(ParkTimeout);
+		parked = false;
+	}
+}
+
+//Push to a pipeline ring - if it's full, wake the consumer and wait for room
+//	the consumer never waits on the producer, so this can't deadlock. Returns false if we're stopping
+template<typename T, typename Wake>
+static bool PushOrWait(SPSCRing<T>& ring, T&& item, std::atomic<size_t>& stalls, const std::atomic_bool& stopping, const Wake& wake)
+{
+	if(ring.push(std::move(item))) [[likely]]
+		return true;
+	stalls++;
+	wake();
+	for(size_t spins = 0; !ring.push(std::move(item)); spins++)
+	{
+		if(stopping)
+			return false;
+		if(spins < SpinIdle)
+			CpuRelax();
+		else
+			std::this_thread::yield();
+	}
+	return true;
+}
+
+//Run ready handlers in a pipeline stage's io_context - but not forever
+//	poll() doesn't return while a handler keeps re-queueing itself (eg. Rcv() waiting for buffers)
+static constexpr size_t PollBudget = 64;
+static size_t PollSome(asio::io_context& ctx)
+{
+	size_t count = 0;
+	while(count < PollBudget && ctx.poll_one())
+		count++;
+	return count;
+}
+
+//for single writer high water marks
+static void UpdateMax(std::atomic<size_t>& max, const size_t value)
+{
+	if(value > max.load(std::memory_order_relaxed))
+		max.store(value,std::memory_order_relaxed);
+}
 
 MiniPlex::MiniPlex(const CmdArgs& Args, asio::io_context& IOC):
 	Args(Args),
 	IOC(IOC),
 	local_ep(asio::ip::address::from_string(Args.LocalAddr.getValue()),Args.LocalPort.getValue()),
-	socket(IOC,local_ep),
-	socket_strand(IOC),
-	process_strand(IOC),
-	ActiveBranches(process_strand,Args.CacheTimeout.getValue(),[this](const asio::ip::udp::endpoint& ep)
-	{
-		if(PermaBranches.contains(ep))
-			InactivePermaBranches.insert(ep);
-		auto ep_string = ep.address().to_string()+":"+std::to_string(ep.port());
-		spdlog::get("MiniPlex")->debug("Cache entry for {} timed out.",ep_string);
-	}),
-	AddrVM(4096)
+	acl(Args.ACLFile.getValue().empty() ? PrefixACL() : PrefixACL(Args.ACLFile.getValue())),
+	extractor(Args.Switch && !Args.ExtractorFile.getValue().empty() ? AddrExtractor(Args.ExtractorFile.getValue()) : AddrExtractor()),
+#ifdef HAVE_BATCH_IO
+	pipeline_ring(Args.RunToCompletion.getValue() ? 0 : Args.PipelineRing.getValue()),
+	rtc_spins(Args.RunToCompletion.getValue()),
+#else
+	pipeline_ring(0),
+	rtc_spins(0),
+#endif
+	addr_epoch_timer(IOC),
+	AddrVM(4096),
+	max_bufs(Args.MaxProcessQ.getValue()),
+#ifdef HAVE_BATCH_IO
+	rcv_batch_size(Args.RcvBatch.getValue()),
+	snd_batch_size(Args.SndBatch.getValue()),
+#else
+	rcv_batch_size(1),
+	snd_batch_size(1),
+#endif
+#ifdef HAVE_IO_URING
+	use_uring(Args.IOBackend.getValue() == "uring" && !rtc_spins),
+#else
+	use_uring(false),
+#endif
+#ifdef HAVE_UDP_GRO
+	gro(Args.GRO),
+#else
+	gro(false),
+#endif
+#ifdef HAVE_UDP_GSO
+	gso_max_segment(use_uring ? 0 : Args.GSOMaxSegment.getValue()),
+#else
+	gso_max_segment(0),
+#endif
+	//io_uring has its own (provided) buffers, and they're max size too
+	rcv_class(gro || use_uring ? BufferPool::LargeClass : BufferPool::SlabClass),
+	stats_timer(IOC),
+	snapshot_timer(IOC),
+	rcv_batch_hist(rcv_batch_size+1),
+	measure_latency(Args.StatsPeriod.getValue() || Args.Benchmark)
 {
-	asio::socket_base::receive_buffer_size option(Args.SoRcvBuf.getValue());
-	socket.set_option(option);
+	if(rcv_batch_size != Args.RcvBatch.getValue())
+		spdlog::get("MiniPlex")->warn("Batched receive is not supported on this platform. Reading one datagram at a time.");
+	else if(rcv_batch_size > 1)
+		spdlog::get("MiniPlex")->info("Receiving in batches of up to {} datagrams.",rcv_batch_size);
+	if(snd_batch_size != Args.SndBatch.getValue())
+		spdlog::get("MiniPlex")->warn("Batched send is not supported on this platform. Sending one datagram at a time.");
+	else if(snd_batch_size > 1)
+		spdlog::get("MiniPlex")->info("Sending in batches of up to {} datagrams.",snd_batch_size);
+	if(use_uring)
+		spdlog::get("MiniPlex")->info("Using the io_uring I/O backend.");
+	else if(Args.IOBackend.getValue() == "uring" && rtc_spins)
+		spdlog::get("MiniPlex")->warn("The io_uring I/O backend isn't used in run-to-completion mode. Using the socket directly.");
+	else if(Args.IOBackend.getValue() == "uring")
+		spdlog::get("MiniPlex")->warn("The io_uring I/O backend is not supported by this build. Using asio.");
+	if(gro)
+		spdlog::get("MiniPlex")->info("UDP generic receive offload enabled.");
+	else if(Args.GRO)
+		spdlog::get("MiniPlex")->warn("UDP generic receive offload is not supported on this platform.");
+	if(gso_max_segment)
+		spdlog::get("MiniPlex")->info("UDP generic segmentation offload enabled for datagrams up to {} bytes.",gso_max_segment);
+	else if(Args.GSOMaxSegment.getValue() && use_uring)
+		spdlog::get("MiniPlex")->warn("UDP generic segmentation offload is not supported with the io_uring backend.");
+	else if(Args.GSOMaxSegment.getValue())
+		spdlog::get("MiniPlex")->warn("UDP generic segmentation offload is not supported on this platform.");
+	if(pipeline_ring)
+		spdlog::get("MiniPlex")->info("Pipeline mode: socket and process stages hand off through lock-free rings of {} entries.",pipeline_ring);
+	else if(Args.PipelineRing.getValue() && rtc_spins)
+		spdlog::get("MiniPlex")->warn("Pipeline mode doesn't apply in run-to-completion mode.");
+	else if(Args.PipelineRing.getValue())
+		spdlog::get("MiniPlex")->warn("Pipeline mode is not supported on this platform. Using the asio thread pool.");
+	if(rtc_spins)
+		spdlog::get("MiniPlex")->info("Run-to-completion mode: busy-polling each socket up to {} times before blocking.",rtc_spins);
+	else if(Args.RunToCompletion.getValue())
+		spdlog::get("MiniPlex")->warn("Run-to-completion mode is not supported on this platform. Using the asio thread pool.");
 
 	if(Args.Hub)
 	{
 		spdlog::get("MiniPlex")->info("Operating in Hub mode.");
-		ModeHandler = std::bind(&MiniPlex::Hub,this,std::placeholders::_1,std::placeholders::_2,std::placeholders::_3,std::placeholders::_4);
+		ModeHandler = &MiniPlex::Hub;
 	}
 	else if(Args.Trunk)
 	{
 		spdlog::get("MiniPlex")->info("Operating in Trunk mode.");
-		ModeHandler = std::bind(&MiniPlex::Trunk,this,std::placeholders::_1,std::placeholders::_2,std::placeholders::_3,std::placeholders::_4);
+		ModeHandler = &MiniPlex::Trunk;
 	}
 	else if(Args.Prune)
 	{
 		spdlog::get("MiniPlex")->info("Operating in Prune mode.");
-		ModeHandler = std::bind(&MiniPlex::Prune,this,std::placeholders::_1,std::placeholders::_2,std::placeholders::_3,std::placeholders::_4);
+		ModeHandler = &MiniPlex::Prune;
 	}
 	else if(Args.Switch)
 	{
 		spdlog::get("MiniPlex")->info("Operating in Switch mode.");
-		ModeHandler = std::bind(&MiniPlex::Switch,this,std::placeholders::_1,std::placeholders::_2,std::placeholders::_3,std::placeholders::_4);
-		try
-		{
-			AddrVM.program_load(Args.ByteCodeFile.getValue());
-		}
-		catch (const std::exception& e)
+		ModeHandler = &MiniPlex::Switch;
+		if(!extractor.Empty())
+			spdlog::get("MiniPlex")->info("Switch mode addresses extracted by {} rules from {} - the byte code isn't used.",extractor.Rules().size(),Args.ExtractorFile.getValue());
+		else
 		{
-			spdlog::get("MiniPlex")->critical("Switch mode VM load/validate error: {}",e.what());
-			throw std::exception(e);
+			try
+			{
+				const bool jit = Args.JIT && AddrVM.jit_enable();
+				if(Args.JIT && !jit)
+					spdlog::get("MiniPlex")->warn("Switch mode JIT isn't supported on this platform - interpreting the byte code.");
+				AddrVM.program_load(Args.ByteCodeFile.getValue());
+				if(Args.VMShared.getValue())
+				{
+					vm_shared.resize(Args.VMShared.getValue());
+					vm_shared_addr = AddrVM.map_shared_mem(vm_shared.data(),vm_shared.size());
+					spdlog::get("MiniPlex")->info("Switch mode byte code shared state: {} bytes.",vm_shared.size());
+				}
+				//(a4/a5 are the shared state pointer and size)
+				else if(AddrVM.program_reads_entry(14) || AddrVM.program_reads_entry(15))
+					throw std::invalid_argument("the byte code uses the shared state (a4/a5), but there isn't any - set its size with -V");
+				if(jit && AddrVM.jit_active())
+					spdlog::get("MiniPlex")->info("Switch mode byte code translated to native code.");
+				else if(jit)
+					spdlog::get("MiniPlex")->warn("Switch mode byte code couldn't be translated to native code - interpreting it.");
+				if(AddrVM.verified())
+					spdlog::get("MiniPlex")->info("Switch mode byte code verified - it runs without the instruction budget and bounds checks.");
+				else
+					spdlog::get("MiniPlex")->info("Switch mode byte code not verified ({}) - it runs with the instruction budget and bounds checks.",AddrVM.verify_error());
+			}
+			catch (const std::exception& e)
+			{
+				spdlog::get("MiniPlex")->critical("Switch mode VM load/validate error: {}",e.what());
+				throw std::exception(e);
+			}
 		}
 	}
 	else
 		throw std::runtime_error("Mode error");
 
+	size_t num_routers = Args.Routers.getValue();
+	if(num_routers > 1 && pipeline_ring)
+	{
+		spdlog::get("MiniPlex")->warn("Pipeline mode only supports one router. Routing on one thread.");
+		num_routers = 1;
+	}
+	//(the max cache sizes are shared between the routers)
+	const auto branch_cache_max = Args.MaxBranchCache.getValue();
+	const auto full_policy = Args.CacheFullPolicy.getValue() == "lru" ? FullPolicy::LRU : FullPolicy::DROP;
+	//(the admission limits are split between the routers, and the address shards, like the cache sizes)
+	const double admit_rate = static_cast<double>(Args.AdmitRate.getValue())/static_cast<double>(num_routers);
+	const double admit_prefix_rate = static_cast<double>(Args.AdmitPrefixRate.getValue())/static_cast<double>(num_routers);
+	const auto admit_prefix_len = static_cast<uint8_t>(Args.AdmitPrefixLen.getValue());
+	for(size_t i=0; i<num_routers; i++)
+	{
+		auto& router = *routers.emplace_back(std::make_unique<Router>(IOC,pipeline_ring || rtc_spins,Args.CacheTimeout.getValue(),[this,i](const branch_id_t id)
+		{
+			BranchDropped(*routers[i],id,false);
+		},admit_rate,admit_prefix_rate,admit_prefix_len));
+		router.acl_hits = std::vector<std::atomic<size_t>>(acl.Rules().size()+1);
+		router.extractor_hits = std::vector<std::atomic<size_t>>(extractor.Rules().size()+1);
+		//(a program that might store into its own memory could keep state there, so it stays on the one VM)
+		if(Args.Switch && extractor.Empty() && !AddrVM.program_stores())
+		{
+			router.AddrVM = std::make_unique<TinyRISCV64::VM>(4096);
+			router.AddrVM->program_load(AddrVM);
+		}
+		if(branch_cache_max)
+			router.ActiveBranches.SetMaxSize((branch_cache_max+num_routers-1)/num_routers,full_policy,[this,i](const branch_id_t id)
+			{
+				BranchDropped(*routers[i],id,true);
+			});
+		ReserveTx(router);
+	}
+	if(num_routers > 1)
+		spdlog::get("MiniPlex")->info("Routing on {} routers: branches are partitioned by sender.",num_routers);
+	if(num_routers > 1 && Args.Switch && extractor.Empty() && routers.front()->AddrVM)
+		spdlog::get("MiniPlex")->info("Switch mode byte code runs on a VM per router.");
+	else if(num_routers > 1 && Args.Switch && extractor.Empty())
+		spdlog::get("MiniPlex")->warn("Switch mode byte code might store into its own memory - address extraction is serialized on one VM. Keep state in the shared region (see -V) to run it on a VM per router.");
+	if(!acl.Empty())
+		spdlog::get("MiniPlex")->info("Loaded {} source prefix ACL rules from {}.",acl.Rules().size(),Args.ACLFile.getValue());
+	if(routers.front()->Admission.Enabled())
+		spdlog::get("MiniPlex")->info("Admitting new cache entries at up to {}/s overall, {}/s per source prefix (0: unlimited).",Args.AdmitRate.getValue(),Args.AdmitPrefixRate.getValue());
+
+	//the fixed branches get the first IDs, and they (and the trunk) are never freed
+	std::set<asio::ip::udp::endpoint> fixed_branches;
+	for(size_t i=0; i<Args.BranchAddrs.getValue().size(); i++)
+		fixed_branches.emplace(asio::ip::address::from_string(Args.BranchAddrs.getValue()[i]),Args.BranchPorts.getValue()[i]);
+	for(auto& router : routers)
+		router->InactivePermaBranches.assign(fixed_branches.size(),false);
+	for(const auto& branch : fixed_branches)
+	{
+		//(fresh tables hand out IDs in order, so it's the same ID in every router)
+		for(auto& router : routers)
+			router->BranchIDs.Ref(router->BranchIDs.Intern(branch));
+		PermaBranches.push_back(static_cast<branch_id_t>(PermaBranches.size()));
+		routers[RouterFor(branch)]->InactivePermaBranches[PermaBranches.back()] = true;
+	}
+
 	if(Args.Trunk || Args.Prune)
 	{
-		trunk = asio::ip::udp::endpoint(asio::ip::address::from_string(Args.TrunkAddr.getValue()),Args.TrunkPort.getValue());
+		const asio::ip::udp::endpoint trunk_ep(asio::ip::address::from_string(Args.TrunkAddr.getValue()),Args.TrunkPort.getValue());
+		for(auto& router : routers)
+		{
+			trunk = router->BranchIDs.Intern(trunk_ep);
+			router->BranchIDs.Ref(trunk);
+		}
 		spdlog::get("MiniPlex")->info("Trunking to {}:{}",Args.TrunkAddr.getValue(),Args.TrunkPort.getValue());
 	}
 
-	if(auto sz = Args.MaxBranchCache.getValue())
-		ActiveBranches.SetMaxSize(sz);
+	if(Args.Switch)
+	{
+		//a shard per router - it's the number of threads that might contend for them
+		const auto max_addrs = std::max<size_t>(1,Args.MaxSwitchAddrs.getValue());
+		for(size_t i=0; i<num_routers; i++)
+			addr_shards.emplace_back(std::make_unique<AddrShard>((max_addrs+num_routers-1)/num_routers,Args.MaxSwitchCache.getValue(),full_policy,Args.CacheTimeout.getValue(),
+				[this](AddrShard& shard, const uint64_t addr, const branch_id_t id, const bool evicted)
+			{
+				AddressDropped(shard,addr,id,evicted);
+			},admit_rate,admit_prefix_rate,admit_prefix_len));
+		AddrEpochTimer();
+	}
 
-	for(size_t i=0; i<Args.BranchAddrs.getValue().size(); i++)
+	if(!Args.CacheSnapshotFile.getValue().empty())
+	{
+		LoadCacheSnapshot();
+		if(Args.CacheSnapshotPeriod.getValue())
+			CacheSnapshotTimer();
+	}
+
+	if(num_routers > 1)
+		for(auto& router : routers)
+			PublishBranches(*router);
+
+	if(Args.StatsPeriod.getValue())
+		StatsTimer();
+
+	size_t shard_count = Args.Shards.getValue();
+#ifndef HAVE_REUSEPORT_SHARDS
+	if(shard_count > 1)
+	{
+		spdlog::get("MiniPlex")->warn("SO_REUSEPORT sharding is not supported on this platform. Using one socket.");
+		shard_count = 1;
+	}
+#endif
+	asio::socket_base::receive_buffer_size option(Args.SoRcvBuf.getValue());
+	for(size_t i=0; i<shard_count; i++)
+	{
+		//a single shard shares the main thread pool - otherwise (or in pipeline/run-to-completion mode) each one gets its own context (and thread below)
+		auto& shard_IOC = shard_count == 1 && !pipeline_ring && !rtc_spins ? IOC : *shard_IOCs.emplace_back(std::make_unique<asio::io_context>(1));
+		auto& shard = *shards.emplace_back(std::make_unique<Shard>(shard_IOC,max_bufs,rcv_class,rcv_batch_size,snd_batch_size,gro,gso_max_segment > 0,pipeline_ring,routers.size()));
+		shard.socket.open(local_ep.protocol());
+		if(shard_count > 1)
+			SetReusePort(shard.socket);
+		shard.socket.bind(local_ep);
+		shard.socket.set_option(option);
+		if(gro)
+			SetUDPGRO(shard.socket);
+#ifdef HAVE_IO_URING
+		if(use_uring)
+			UringSetup(shard);
+		else
+#endif
+			PrimeBufs(shard);
+		//(the run-to-completion loop does its own receiving)
+		if(!rtc_spins)
+			shard.socket_strand.post([this,&shard](){Rcv(shard);});
+	}
+	for(size_t i=0; i<shard_IOCs.size(); i++)
 	{
-		auto branch = asio::ip::udp::endpoint(asio::ip::address::from_string(Args.BranchAddrs.getValue()[i]),Args.BranchPorts.getValue()[i]);
-		PermaBranches.insert(branch);
-		InactivePermaBranches.insert(branch);
+#ifdef HAVE_BATCH_IO
+		if(rtc_spins)
+			shard_threads.emplace_back([this,shard{shards[i].get()}](){RunToCompletionLoop(*shard);});
+		else if(pipeline_ring)
+			shard_threads.emplace_back([this,shard{shards[i].get()}](){PipelineSocketLoop(*shard);});
+		else
+#endif
+			shard_threads.emplace_back([ctx{shard_IOCs[i].get()}](){ctx->run();});
+		if(!PinThreadToCore(shard_threads.back(),i))
+			spdlog::get("MiniPlex")->warn("Failed to pin shard {} thread to core {}.",i,i);
+	}
+#ifdef HAVE_BATCH_IO
+	if(pipeline_ring)
+	{
+		//the process stage gets the next core
+		process_thread = std::thread([this](){PipelineProcessLoop();});
+		if(!PinThreadToCore(process_thread,shards.size()))
+			spdlog::get("MiniPlex")->warn("Failed to pin process stage thread to core {}.",shards.size());
 	}
+#endif
+	if(shard_count > 1)
+		spdlog::get("MiniPlex")->info("Sharded {} ways with SO_REUSEPORT.",shard_count);
 
-	socket_strand.post([this](){Rcv();});
 	spdlog::get("MiniPlex")->info("Listening on {}:{}",Args.LocalAddr.getValue(),Args.LocalPort.getValue());
 }
 
-void MiniPlex::Rcv()
+MiniPlex::~MiniPlex()
+{
+	Stop();
+}
+
+void MiniPlex::Stop()
+{
+	if(stopping.exchange(true))
+		return;
+	for(auto& ctx : shard_IOCs)
+		ctx->stop();
+	for(auto& router : routers)
+		if(router->own_IOC)
+			router->own_IOC->stop();
+	for(auto& t : shard_threads)
+		t.join();
+	if(process_thread.joinable())
+		process_thread.join();
+
+	//everything's stopped - no need to go via the routers' strands
+	if(snapshot_thread.joinable())
+		snapshot_thread.join();
+	if(!Args.CacheSnapshotFile.getValue().empty())
+	{
+		CacheSnapshot snap;
+		for(auto& router : routers)
+			CollectBranches(*router,snap);
+		WriteCacheSnapshot(snap);
+	}
+}
+
+//Make sure there are rcv buffers ready - up to 'want' of them, if the limit allows
+//	returns false if there are none available
+bool MiniPlex::TopUpRcvBufs(Shard& shard, const size_t want)
+{
+	const auto allocated = shard.pool.Allocated(rcv_class);
+	const auto available = shard.pool.Reserve(rcv_class,want);
+	if(shard.pool.Allocated(rcv_class) != allocated)
+		spdlog::get("MiniPlex")->debug("Rcv(): Allocated {} more datagram buffers.",shard.pool.Allocated(rcv_class)-allocated);
+	return available > 0;
+}
+
+void MiniPlex::Rcv(Shard& shard)
 {
-	spdlog::get("MiniPlex")->trace("Rcv(): {} rcv buffers available.",rcv_buf_q.size());
-	if(rcv_buf_q.empty()) [[unlikely]]
+#ifdef HAVE_IO_URING
+	if(shard.uring)
 	{
-		if(rcv_buf_count < Args.MaxProcessQ.getValue())
+		UringArmRcv(shard);
+		UringSnd(shard);
+		UringRcv(shard);
+		return;
+	}
+#endif
+	spdlog::get("MiniPlex")->trace("Rcv(): {} rcv buffers available.",shard.pool.Available(rcv_class));
+	if(!TopUpRcvBufs(shard,rcv_batch_size)) [[unlikely]]
+	{
+		spdlog::get("MiniPlex")->debug("Rcv(): Max datagram buffers allocated. Delaying read.");
+		//the pipeline socket stage picks it up again when buffers are recycled
+		if(pipeline_ring)
 		{
-			spdlog::get("MiniPlex")->debug("Rcv(): Allocating another datagram buffer.");
-			rcv_buf_q.push_back(MakeSharedBuf());
-			rcv_buf_count++;
+			shard.rcv_delayed = true;
+			return;
 		}
-		else [[unlikely]]
+		//the process strand should be posting writes - so wait for write availabiltiy as a way to delay
+		shard.socket.async_wait(asio::ip::udp::socket::wait_write,asio::bind_executor(shard.socket_strand,Pooled([this,&shard](asio::error_code)
 		{
-			spdlog::get("MiniPlex")->debug("Rcv(): Max datagram buffers allocated. Delaying read.");
-			//the process strand should be posting writes - so wait for write availabiltiy as a way to delay
-			socket.async_wait(asio::ip::udp::socket::wait_write,socket_strand.wrap([this](asio::error_code)
+			Rcv(shard);
+		})));
+		return;
+	}
+
+#ifdef HAVE_BATCH_IO
+	//GRO needs the control messages - so use the batch path even for batches of 1
+	if(rcv_batch_size > 1 || gro)
+	{
+		BatchRcv(shard);
+		return;
+	}
+#endif
+
+	auto slab = shard.pool.Take(rcv_class);
+	const std::array<asio::mutable_buffer,2> bufs = {
+		asio::buffer(slab,BufferPool::ClassSizes[rcv_class]),
+		asio::buffer(shard.Spill(0),shard.spill ? Shard::SpillSize : 0)};
+
+	shard.socket.async_receive_from(bufs,shard.rcv_sender,asio::bind_executor(shard.socket_strand,Pooled([this,&shard,slab](asio::error_code err, size_t n)
+	{
+		if(err) [[unlikely]]
+		{
+			spdlog::get("MiniPlex")->error("Rcv(): error code {}: '{}'",err.value(),err.message());
+			shard.pool.Give(rcv_class,slab);
+		}
+		else
+		{
+			AddRcvDgram(shard,RcvBuf(shard,slab,shard.Spill(0),n),shard.rcv_sender,n,0,IngressTime());
+			PostRcvBatch(shard);
+		}
+		Rcv(shard);
+	})));
+}
+
+#ifdef HAVE_BATCH_IO
+//Wait for the socket to be readable, then drain as many datagrams as we have buffers for (up to the batch size)
+//	and pass them all to the process strand in one go
+void MiniPlex::BatchRcv(Shard& shard)
+{
+	shard.socket.async_wait(asio::ip::udp::socket::wait_read,asio::bind_executor(shard.socket_strand,Pooled([this,&shard](asio::error_code err)
+	{
+		if(err) [[unlikely]]
+		{
+			spdlog::get("MiniPlex")->error("BatchRcv(): wait error code {}: '{}'",err.value(),err.message());
+			Rcv(shard);
+			return;
+		}
+
+		const auto n = DrainRcvBatch(shard,err);
+		rcv_batch_hist[n]++;
+		spdlog::get("MiniPlex")->trace("BatchRcv(): {} datagrams received.",n);
+
+		if(n > 0)
+			PostRcvBatch(shard);
+		else if(err) [[unlikely]]
+			spdlog::get("MiniPlex")->error("BatchRcv(): error code {}: '{}'",err.value(),err.message());
+
+		Rcv(shard);
+	})));
+}
+
+//Receive (without waiting) as many datagrams as we have buffers for, up to the batch size, into the shard's batch for processing
+//	returns how many were received
+size_t MiniPlex::DrainRcvBatch(Shard& shard, asio::error_code& err)
+{
+	auto& pool = shard.pool;
+	auto& rcv_batch = shard.rcv_batch;
+	const auto count = std::min(pool.Available(rcv_class),rcv_batch_size);
+	for(size_t i=0; i<count; i++)
+		rcv_batch.Prep(i,pool.Take(rcv_class),BufferPool::ClassSizes[rcv_class],shard.Spill(i),shard.spill ? Shard::SpillSize : 0);
+
+	const auto n = rcv_batch.Receive(shard.socket.native_handle(),count,err);
+	const auto ingress = n ? IngressTime() : ingress_t();
+
+	for(size_t i=0; i<n; i++)
+		AddRcvDgram(shard,RcvBuf(shard,rcv_batch.Buf(i),shard.Spill(i),rcv_batch.Size(i)),rcv_batch.Sender(i),rcv_batch.Size(i),rcv_batch.SegmentSize(i),ingress);
+	//slabs that didn't get a datagram
+	for(size_t i=n; i<count; i++)
+		pool.Give(rcv_class,rcv_batch.Buf(i));
+	return n;
+}
+
+//Send everything in tx_q (on the socket strand), up to the batch size per system call
+//	runs of datagrams that can be sent together with GSO take up one batch slot
+//	if the socket buffer fills up, wait until it's writable and resume
+void MiniPlex::BatchSnd(Shard& shard)
+{
+	auto& tx_q = shard.tx_q;
+	auto& snd_batch = shard.snd_batch;
+	while(!tx_q.empty())
+	{
+		size_t count = 0;
+		for(size_t queued = 0; count < snd_batch_size && queued < tx_q.size(); count++)
+		{
+			const auto run = GSORun(tx_q,queued);
+			snd_batch.Prep(count,tx_q[queued].buf.get(),tx_q[queued].n,tx_q[queued].dest);
+			for(size_t i=1; i<run; i++)
+				snd_batch.Append(count,tx_q[queued+i].buf.get(),tx_q[queued+i].n);
+			queued += run;
+		}
+
+		asio::error_code err;
+		const auto n = snd_batch.Send(shard.socket.native_handle(),count,err);
+		tx_syscalls++;
+		size_t sent = 0;
+		for(size_t i=0; i<n; i++)
+		{
+			const auto segments = snd_batch.Count(i);
+			sent += segments;
+			if(segments > 1)
 			{
-				Rcv();
-			}));
+				tx_gso_sends++;
+				tx_gso_segments += segments;
+			}
+		}
+		tx_count += sent;
+		if(measure_latency && sent)
+		{
+			const auto egress = std::chrono::steady_clock::now();
+			for(size_t i=0; i<sent; i++)
+				RecordLatency(tx_q[i].ingress,egress);
+		}
+		tx_q.pop_front(sent);
+
+		if(n == count) [[likely]]
+			continue;
+		if(n > 0)
+			tx_partial++;
+
+		if(err == asio::error::would_block)
+		{
+			tx_eagain++;
+			shard.tx_waiting = true;
+			shard.socket.async_wait(asio::ip::udp::socket::wait_write,asio::bind_executor(shard.socket_strand,Pooled([this,&shard](asio::error_code)
+			{
+				shard.tx_waiting = false;
+				BatchSnd(shard);
+			})));
 			return;
 		}
+		if(err)
+		{
+			const auto& ep = tx_q.front().dest;
+			if(const auto segments = snd_batch.Count(n); segments > 1)
+			{
+				//the kernel wouldn't segment them (eg. bigger than the MTU) - try them one at a time
+				tx_gso_fallbacks++;
+				for(size_t i=0; i<segments; i++)
+					tx_q[i].no_gso = true;
+				if(spdlog::get("MiniPlex")->should_log(spdlog::level::debug))
+				{
+					auto ep_string = ep.address().to_string()+":"+std::to_string(ep.port());
+					spdlog::get("MiniPlex")->debug("BatchSnd(): GSO error code {}: '{}', sending to {}. Sending individually.",err.value(),err.message(),ep_string);
+				}
+				continue;
+			}
+			//the datagram at the front can't be sent - drop it and carry on
+			tx_errors++;
+			if(spdlog::get("MiniPlex")->should_log(spdlog::level::debug))
+			{
+				auto ep_string = ep.address().to_string()+":"+std::to_string(ep.port());
+				spdlog::get("MiniPlex")->debug("BatchSnd(): error code {}: '{}', sending to {}.",err.value(),err.message(),ep_string);
+			}
+			tx_q.pop_front();
+		}
+	}
+}
+
+//How many datagrams, starting at tx_q[start], can go in one GSO send
+//	consecutive, to the same endpoint, and the same size (except the last can be smaller)
+size_t MiniPlex::GSORun(const RecycledQueue<snd_dgram_t>& tx_q, const size_t start) const
+{
+	const auto& first = tx_q[start];
+	if(first.n > gso_max_segment || first.no_gso)
+		return 1;
+
+	size_t run = 1;
+	size_t bytes = first.n;
+	while(start+run < tx_q.size() && run < SndBatch::MaxSegments)
+	{
+		const auto& next = tx_q[start+run];
+		if(next.dest != first.dest || next.n > first.n || next.no_gso || bytes+next.n > SndBatch::MaxGSOBytes)
+			break;
+		bytes += next.n;
+		run++;
+		//a smaller datagram has to be the last segment
+		if(next.n < first.n)
+			break;
+	}
+	return run;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+//Set up an io_uring for the shard socket: provided buffers for a multishot receive, and a slot for each in-flight send
+void MiniPlex::UringSetup(Shard& shard)
+{
+	try
+	{
+		const auto max_bufs = Args.MaxProcessQ.getValue();
+		shard.uring = std::make_unique<UringIO>(max_bufs,BufferPool::LargeSize,max_bufs,gro);
+		//start with a batch worth of buffers - more get added if the kernel runs out
+		while(shard.uring->BufCount() < std::min(rcv_batch_size,max_bufs) && shard.uring->AddBuf())
+			spdlog::get("MiniPlex")->debug("UringSetup(): Allocating another datagram buffer.");
+
+		//asio owns (closes) the descriptor it waits on - so give it a duplicate
+		auto fd = dup(shard.uring->Fd());
+		if(fd < 0)
+			throw std::runtime_error("Failed to duplicate io_uring file descriptor");
+		shard.uring_fd = std::make_unique<asio::posix::stream_descriptor>(shard.socket.get_executor(),fd);
 	}
+	catch(const std::exception& e)
+	{
+		spdlog::get("MiniPlex")->critical("io_uring setup error: {}",e.what());
+		throw;
+	}
+	shard.uring_sends.resize(shard.uring->SendSlots());
+	for(auto slot = shard.uring->SendSlots(); slot > 0; slot--)
+		shard.uring_free_slots.push_back(slot-1);
+}
+
+//Wait for the ring to have completions (on the socket strand)
+void MiniPlex::UringRcv(Shard& shard)
+{
+	shard.uring_fd->async_wait(asio::posix::stream_descriptor::wait_read,asio::bind_executor(shard.socket_strand,Pooled([this,&shard](asio::error_code err)
+	{
+		if(err) [[unlikely]]
+		{
+			if(err == asio::error::operation_aborted)
+				return;
+			spdlog::get("MiniPlex")->error("UringRcv(): wait error code {}: '{}'",err.value(),err.message());
+		}
+		UringReap(shard);
+		UringRcv(shard);
+	})));
+}
+
+//Drain the completion queue: received datagrams go to the process strand in batches (up to the receive batch size)
+//	and completed sends free up their slot. Then submit anything that's been queued - in one system call
+void MiniPlex::UringReap(Shard& shard)
+{
+	size_t batch_count = 0; //received datagrams in the batch (before any GRO split)
+	size_t rcv_count = 0;
+	const auto ingress = IngressTime();
+	while(auto cqe = shard.uring->NextCQE())
+	{
+		if(cqe->user_data == UringIO::RecvTag)
+			batch_count += UringRcvCompletion(shard,*cqe,ingress);
+		else
+			UringSndCompletion(shard,*cqe);
+		shard.uring->SeenCQE();
 
-	auto pBuf = rcv_buf_q.front();
-	rcv_buf_q.pop_front();
+		if(batch_count == rcv_batch_size)
+		{
+			rcv_count += batch_count;
+			rcv_batch_hist[batch_count]++;
+			PostRcvBatch(shard);
+			batch_count = 0;
+		}
+	}
+	if(batch_count > 0 || rcv_count == 0)
+	{
+		rcv_batch_hist[batch_count]++;
+		if(batch_count > 0)
+			PostRcvBatch(shard);
+	}
+	UringSnd(shard);
+}
+
+//returns true if a datagram was received
+bool MiniPlex::UringRcvCompletion(Shard& shard, const io_uring_cqe& cqe, const ingress_t& ingress)
+{
+	//the multishot receive stays armed until the kernel says otherwise
+	if(!UringIO::MoreRecvs(cqe))
+		shard.uring_recv_armed = false;
+
+	if(cqe.res < 0) [[unlikely]]
+	{
+		if(cqe.res == -ENOBUFS)
+		{
+			//the kernel has used all the buffers we've given it - add more, if the limit allows
+			auto& uring = *shard.uring;
+			const auto want = std::min(uring.BufCount()*2,Args.MaxProcessQ.getValue());
+			if(uring.BufCount() >= want && uring.BufsAvailable() == 0)
+			{
+				//the recycler re-arms when processing catches up
+				spdlog::get("MiniPlex")->debug("UringRcvCompletion(): Max datagram buffers allocated. Delaying read.");
+				return false;
+			}
+			while(uring.BufCount() < want && uring.AddBuf())
+				spdlog::get("MiniPlex")->debug("UringRcvCompletion(): Allocating another datagram buffer.");
+		}
+		else
+		{
+			auto err = asio::error_code(-cqe.res,asio::error::get_system_category());
+			spdlog::get("MiniPlex")->error("UringRcvCompletion(): error code {}: '{}'",err.value(),err.message());
+		}
+		if(!shard.uring_recv_armed)
+			UringArmRcv(shard);
+		return false;
+	}
+
+	uint8_t* payload;
+	size_t n;
+	asio::ip::udp::endpoint sender;
+	bool truncated;
+	size_t segment_size;
+	const auto bid = shard.uring->ParseRecv(cqe,payload,n,sender,truncated,segment_size);
+	if(bid < 0) [[unlikely]]
+	{
+		spdlog::get("MiniPlex")->error("UringRcvCompletion(): receive completion without a buffer.");
+		return false;
+	}
+	if(truncated) [[unlikely]]
+		spdlog::get("MiniPlex")->warn("UringRcvCompletion(): datagram truncated to {} bytes.",n);
+
+	AddRcvDgram(shard,UringSharedBuf(shard,bid,payload),sender,n,segment_size,ingress);
+
+	if(!shard.uring_recv_armed) [[unlikely]]
+		UringArmRcv(shard);
+	return true;
+}
+
+void MiniPlex::UringSndCompletion(Shard& shard, const io_uring_cqe& cqe)
+{
+	const auto slot = cqe.user_data;
+	auto& dgram = shard.uring_sends[slot];
+	if(cqe.res < 0) [[unlikely]]
+	{
+		tx_errors++;
+		if(spdlog::get("MiniPlex")->should_log(spdlog::level::debug))
+		{
+			auto err = asio::error_code(-cqe.res,asio::error::get_system_category());
+			auto ep_string = dgram.dest.address().to_string()+":"+std::to_string(dgram.dest.port());
+			spdlog::get("MiniPlex")->debug("UringSndCompletion(): error code {}: '{}', sending to {}.",err.value(),err.message(),ep_string);
+		}
+	}
+	else
+	{
+		tx_count++;
+		if(measure_latency)
+			RecordLatency(dgram.ingress,std::chrono::steady_clock::now());
+	}
+	dgram.buf.reset();
+	shard.uring_free_slots.push_back(slot);
+}
+
+//Queue the multishot receive (submitted with the next UringSnd)
+void MiniPlex::UringArmRcv(Shard& shard)
+{
+	if(!shard.uring->PrepRecv(shard.socket.native_handle())) [[unlikely]]
+	{
+		spdlog::get("MiniPlex")->error("UringArmRcv(): submission queue full.");
+		return;
+	}
+	shard.uring_recv_armed = true;
+}
+
+//Queue a send for as much of tx_q as there are free slots, and submit (along with anything else queued) in one go
+void MiniPlex::UringSnd(Shard& shard)
+{
+	auto& tx_q = shard.tx_q;
+	auto& free_slots = shard.uring_free_slots;
+	size_t count = 0;
+	while(!tx_q.empty() && !free_slots.empty())
+	{
+		const auto slot = free_slots.back();
+		auto& dgram = tx_q.front();
+		if(!shard.uring->PrepSend(shard.socket.native_handle(),slot,dgram.buf.get(),dgram.n,dgram.dest)) [[unlikely]]
+			break;
+		free_slots.pop_back();
+		shard.uring_sends[slot] = std::move(dgram);
+		tx_q.pop_front();
+		count++;
+	}
+	//the rest waits for send completions to free up slots
+	if(!tx_q.empty())
+		tx_eagain++;
+
+	asio::error_code err;
+	shard.uring->Submit(err);
+	if(count)
+		tx_syscalls++;
+	if(err && err != asio::error::would_block) [[unlikely]]
+		spdlog::get("MiniPlex")->error("UringSnd(): submit error code {}: '{}'",err.value(),err.message());
+}
+
+p_rbuf_t MiniPlex::UringSharedBuf(Shard& shard, const uint16_t bid, uint8_t* const payload)
+{
+	//the datagram sits after the recvmsg header in the provided buffer - which belongs to the ring
+	return p_rbuf_t(payload,[this,&shard,bid](uint8_t*)
+	{
+		ReleaseBuf(shard,{nullptr,bid});
+	},PoolAllocator<uint8_t>());
+}
+#endif
+
+//Add a received datagram to the shard's batch for processing
+//	a GRO coalesced datagram gets split back into its segments - views into the same buffer, no copying
+void MiniPlex::AddRcvDgram(Shard& shard, p_rbuf_t&& buf, const asio::ip::udp::endpoint& sender, const size_t n, const size_t segment_size, const ingress_t& ingress)
+{
+	auto& batch = shard.rx_new;
+	if(segment_size == 0 || segment_size >= n) [[likely]]
+	{
+		rx_count++;
+		batch.push_back({std::move(buf),sender,n,ingress});
+		return;
+	}
+	rx_gro_count++;
+	for(size_t offset = 0; offset < n; offset += segment_size)
+	{
+		rx_count++;
+		rx_gro_segments++;
+		batch.push_back({SubBuf(buf,offset),sender,std::min(segment_size,n-offset),ingress});
+	}
+}
+
+//Stamp received datagrams with the time, if we're measuring latency
+ingress_t MiniPlex::IngressTime() const
+{
+	return measure_latency ? std::chrono::steady_clock::now() : ingress_t();
+}
+
+void MiniPlex::RecordLatency(const ingress_t& ingress, const ingress_t& egress)
+{
+	latency_hist.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(egress-ingress).count());
+}
+
+//Hand the shard's batch of received datagrams to the routers - each datagram goes to the one that owns its sender
+//	if a router hasn't picked up the last batch yet, this one just gets added to it (no extra post)
+void MiniPlex::PostRcvBatch(Shard& shard)
+{
+#ifdef HAVE_BATCH_IO
+	if(pipeline_ring)
+	{
+		PipelineRcvHandoff(shard);
+		return;
+	}
+#endif
+	const bool steer = routers.size() > 1;
+	if(steer)
+	{
+		shard.rx_steer.clear();
+		for(const auto& dgram : shard.rx_new)
+			shard.rx_steer.push_back(RouterFor(dgram.sender));
+	}
+	shard.rx_post.clear();
+	{
+		std::lock_guard<std::mutex> lock(shard.handoff_mtx);
+		if(!steer)
+		{
+			auto& route = shard.rx_routes[0];
+			if(route.handoff.empty())
+				std::swap(route.handoff,shard.rx_new);
+			else
+				route.handoff.insert(route.handoff.end(),std::make_move_iterator(shard.rx_new.begin()),std::make_move_iterator(shard.rx_new.end()));
+		}
+		else for(size_t i=0; i<shard.rx_new.size(); i++)
+			shard.rx_routes[shard.rx_steer[i]].handoff.push_back(std::move(shard.rx_new[i]));
+		for(size_t r=0; r<shard.rx_routes.size(); r++)
+			if(!shard.rx_routes[r].handoff.empty() && !std::exchange(shard.rx_routes[r].posted,true))
+				shard.rx_post.push_back(r);
+	}
+	shard.rx_new.clear();
+	for(const auto r : shard.rx_post)
+		routers[r]->strand.post(Pooled([this,&shard,r](){ProcessRcvBatch(shard,r);}));
+}
+
+//(router strand) Route everything handed off to the router by PostRcvBatch()
+void MiniPlex::ProcessRcvBatch(Shard& shard, const size_t router_index)
+{
+	auto& router = *routers[router_index];
+	auto& route = shard.rx_routes[router_index];
+	{
+		std::lock_guard<std::mutex> lock(shard.handoff_mtx);
+		std::swap(route.processing,route.handoff);
+		route.posted = false;
+	}
+	router.tx_shard = &shard;
+	for(const auto& dgram : route.processing)
+	{
+		router.tx_ingress = dgram.ingress;
+		RcvHandler(router,dgram.buf,dgram.sender,dgram.n);
+	}
+	route.processing.clear();
+	FlushTx(router);
+}
+
+//Hand the datagrams queued by Forward() to the socket strand to be sent as a batch
+void MiniPlex::FlushTx(Router& router)
+{
+#ifdef HAVE_BATCH_IO
+	auto& tx_pending = router.tx_pending;
+	if(tx_pending.empty())
+		return;
+	auto& shard = *router.tx_shard;
+	if(pipeline_ring)
+	{
+		//the socket stage gets the doorbell at the end of the process stage batch
+		for(auto& dgram : tx_pending)
+			if(!PushOrWait(shard.tx_ring,std::move(dgram),shard.tx_ring_stalls,stopping,[this,&shard](){Doorbell(shard.IOC,shard.parked);}))
+				break;
+		tx_pending.clear();
+		return;
+	}
+	bool post;
+	{
+		std::lock_guard<std::mutex> lock(shard.handoff_mtx);
+		shard.tx_reserve = std::max(shard.tx_reserve,router.tx_reserve);
+		if(shard.tx_handoff.empty())
+			std::swap(shard.tx_handoff,tx_pending);
+		else
+		{
+			shard.tx_handoff.reserve(shard.tx_reserve);
+			shard.tx_handoff.insert(shard.tx_handoff.end(),std::make_move_iterator(tx_pending.begin()),std::make_move_iterator(tx_pending.end()));
+		}
+		post = !std::exchange(shard.tx_posted,true);
+	}
+	tx_pending.clear();
+	//it's got what was the hand-off, and it's kept whatever storage that had - top it up
+	tx_pending.reserve(router.tx_reserve);
+	if(post)
+		shard.socket_strand.post(Pooled([this,&shard](){SndHandoff(shard);}));
+#endif
+}
+
+#ifdef HAVE_BATCH_IO
+//(socket strand) Queue everything handed off by FlushTx(), and send
+void MiniPlex::SndHandoff(Shard& shard)
+{
+	size_t tx_reserve;
+	{
+		std::lock_guard<std::mutex> lock(shard.handoff_mtx);
+		std::swap(shard.tx_new,shard.tx_handoff);
+		shard.tx_handoff.reserve(shard.tx_reserve);
+		shard.tx_posted = false;
+		tx_reserve = shard.tx_reserve;
+	}
+	shard.tx_q.reserve(tx_reserve);
+	shard.tx_q.append(shard.tx_new);
+	shard.tx_new.reserve(tx_reserve);
+	SndQueue(shard);
+}
+
+//(socket strand) Send what's in tx_q - unless it's already waiting for the socket (or io_uring send slots)
+void MiniPlex::SndQueue(Shard& shard)
+{
+#ifdef HAVE_IO_URING
+	if(shard.uring)
+	{
+		UringSnd(shard);
+		return;
+	}
+#endif
+	if(!shard.tx_waiting)
+		BatchSnd(shard);
+}
+
+//(socket stage thread) Pipeline mode: run the shard's socket I/O and service its side of the rings
+void MiniPlex::PipelineSocketLoop(Shard& shard)
+{
+	socket_stage = &shard;
+	auto work = asio::make_work_guard(shard.IOC);
+	size_t idle = 0;
+	while(!stopping && !shard.IOC.stopped())
+	{
+		if(PollSome(shard.IOC) + PipelineSocketStage(shard) > 0)
+		{
+			idle = 0;
+			continue;
+		}
+		IdleBackoff(shard.IOC,shard.parked,idle,[this,&shard]()
+		{
+			return !shard.recycle_ring.empty() || !shard.tx_ring.empty() || shard.rx_stalled
+				|| (shard.rcv_delayed && shard.pool.Available(rcv_class));
+		});
+	}
+}
+
+//(socket stage) Take back buffers and datagrams to send from the process stage, and retry a stalled receive hand-off
+//	returns how many things it did
+size_t MiniPlex::PipelineSocketStage(Shard& shard)
+{
+	size_t recycled = 0;
+	UpdateMax(shard.recycle_ring_max,shard.recycle_ring.size());
+	recycled_buf_t buf;
+	while(shard.recycle_ring.pop(buf))
+	{
+		RecycleBuf(shard,buf);
+		recycled++;
+	}
+
+	size_t queued = 0;
+	UpdateMax(shard.tx_ring_max,shard.tx_ring.size());
+	snd_dgram_t dgram;
+	while(shard.tx_ring.pop(dgram))
+	{
+		shard.tx_q.push_back(std::move(dgram));
+		queued++;
+	}
+	if(queued)
+		SndQueue(shard);
+
+	const auto handed_off = shard.rx_stalled ? PipelineRcvHandoff(shard) : 0;
+
+	const bool resume_rcv = shard.rcv_delayed && shard.pool.Available(rcv_class);
+	if(resume_rcv)
+	{
+		shard.rcv_delayed = false;
+		Rcv(shard);
+	}
+	return recycled+queued+handed_off+resume_rcv;
+}
+
+//(socket stage) Pipeline mode PostRcvBatch(): move the batch into the rx ring
+//	if the ring is full, the rest stays in rx_new and the socket stage loop retries it
+//	(meanwhile the buffer pool limit holds back receiving)
+size_t MiniPlex::PipelineRcvHandoff(Shard& shard)
+{
+	auto& batch = shard.rx_new;
+	size_t pushed = 0;
+	while(pushed < batch.size() && shard.rx_ring.push(std::move(batch[pushed])))
+		pushed++;
+	if(pushed == batch.size()) [[likely]]
+	{
+		batch.clear();
+		shard.rx_stalled = false;
+	}
+	else
+	{
+		if(!shard.rx_stalled)
+			shard.rx_ring_stalls++;
+		shard.rx_stalled = true;
+		batch.erase(batch.begin(),batch.begin()+pushed);
+	}
+	if(pushed)
+		Doorbell(*routers[0]->own_IOC,process_parked);
+	return pushed;
+}
+
+//(process stage thread) Pipeline mode: run the router strand (cache timers) and route what comes in on the rx rings
+void MiniPlex::PipelineProcessLoop()
+{
+	auto& process_IOC = routers[0]->own_IOC;
+	auto work = asio::make_work_guard(*process_IOC);
+	size_t idle = 0;
+	while(!stopping && !process_IOC->stopped())
+	{
+		auto done = PollSome(*process_IOC);
+		for(auto& shard : shards)
+			done += PipelineProcessStage(*shard);
+		if(done)
+		{
+			idle = 0;
+			continue;
+		}
+		IdleBackoff(*process_IOC,process_parked,idle,[this]()
+		{
+			for(const auto& shard : shards)
+				if(!shard->rx_ring.empty())
+					return true;
+			return false;
+		});
+	}
+}
+
+//(process stage) Route what's in a shard's rx ring - up to a ring's worth, so a busy shard can't starve the others
+//	returns how many datagrams it routed
+size_t MiniPlex::PipelineProcessStage(Shard& shard)
+{
+	auto& router = *routers[0];
+	router.tx_shard = &shard;
+	UpdateMax(shard.rx_ring_max,shard.rx_ring.size());
+	size_t count = 0;
+	rcv_dgram_t dgram;
+	while(count < pipeline_ring && shard.rx_ring.pop(dgram))
+	{
+		router.tx_ingress = dgram.ingress;
+		RcvHandler(router,dgram.buf,dgram.sender,dgram.n);
+		//drop our reference now, so if it's the last one the buffer goes back with this batch
+		dgram.buf.reset();
+		count++;
+	}
+	if(count == 0)
+		return 0;
+	FlushTx(router);
+	Doorbell(shard.IOC,shard.parked);
+	return count;
+}
+
+//(shard thread) Run-to-completion mode: receive, route and send each batch right here - no strands, no hand-offs
+//	busy-poll the socket up to the spin budget, then block in the reactor (epoll) until it's readable
+void MiniPlex::RunToCompletionLoop(Shard& shard)
+{
+	socket_stage = &shard;
+	auto work = asio::make_work_guard(shard.IOC);
+	std::vector<asio::executor_work_guard<asio::io_context::executor_type>> timers_work;
+	for(auto& router : routers)
+		timers_work.push_back(asio::make_work_guard(*router->own_IOC));
+	size_t spins = 0;
+	while(!stopping && !shard.IOC.stopped())
+	{
+		//a send that found the socket buffer full resumes from the reactor
+		if(shard.tx_waiting)
+			PollSome(shard.IOC);
+		if(RunToCompletionBatch(shard) > 0)
+		{
+			spins = 0;
+			continue;
+		}
+		if(++spins < rtc_spins)
+		{
+			CpuRelax();
+			continue;
+		}
+		spins = 0;
+		const auto now = std::chrono::steady_clock::now();
+		for(auto& router : routers)
+		{
+			std::lock_guard<std::mutex> lock(router->mtx);
+			RunToCompletionTimers(*router,now);
+		}
+		if(!shard.rtc_waiting)
+		{
+			shard.rtc_waiting = true;
+			shard.socket.async_wait(asio::ip::udp::socket::wait_read,Pooled([&shard](asio::error_code)
+			{
+				shard.rtc_waiting = false;
+			}));
+		}
+		//the timeout is a backstop for the cache timers, in case all the sockets are quiet
+		shard.IOC.run_one_for(ParkTimeout);
+	}
+}
 
-	auto pRcvSender = std::make_shared<asio::ip::udp::endpoint>();
-	socket.async_receive_from(asio::buffer(pBuf->data(),pBuf->size()),*pRcvSender,socket_strand.wrap([this,pBuf,pRcvSender](asio::error_code err, size_t n)
+//(shard thread) Run-to-completion mode: receive a batch, route it, and send what it forwards
+//	returns how many datagrams it received
+size_t MiniPlex::RunToCompletionBatch(Shard& shard)
+{
+	//if there aren't any buffers, they're all waiting to be sent
+	if(!TopUpRcvBufs(shard,rcv_batch_size)) [[unlikely]]
+		return 0;
+	asio::error_code err;
+	const auto n = DrainRcvBatch(shard,err);
+	if(n == 0)
 	{
-		rx_count++;
-		process_strand.post([this,err,pBuf,pRcvSender,n]()
+		if(err) [[unlikely]]
+			spdlog::get("MiniPlex")->error("RunToCompletionBatch(): error code {}: '{}'",err.value(),err.message());
+		return 0;
+	}
+	rcv_batch_hist[n]++;
+	spdlog::get("MiniPlex")->trace("RunToCompletionBatch(): {} datagrams received.",n);
+	const auto now = std::chrono::steady_clock::now();
+	const bool steer = routers.size() > 1;
+	if(steer)
+	{
+		shard.rx_steer.clear();
+		for(const auto& dgram : shard.rx_new)
+			shard.rx_steer.push_back(RouterFor(dgram.sender));
+	}
+	for(size_t r=0; r<routers.size(); r++)
+	{
+		//the routing state is shared by the shards - a router at a time
+		//	one with nothing from this batch still gets its timers run, if it's free
+		auto& router = *routers[r];
+		const bool routed = !steer || std::find(shard.rx_steer.begin(),shard.rx_steer.end(),r) != shard.rx_steer.end();
+		std::unique_lock<std::mutex> lock(router.mtx,std::defer_lock);
+		if(routed)
+			lock.lock();
+		else if(!lock.try_lock())
+			continue;
+		RunToCompletionTimers(router,now);
+		if(!routed)
+			continue;
+		router.tx_shard = &shard;
+		for(size_t i=0; i<shard.rx_new.size(); i++)
 		{
-			RcvHandler(err,pBuf,*pRcvSender,n);
-		});
-		Rcv();
-	}));
+			if(steer && shard.rx_steer[i] != r)
+				continue;
+			const auto& dgram = shard.rx_new[i];
+			router.tx_ingress = dgram.ingress;
+			RcvHandler(router,dgram.buf,dgram.sender,dgram.n);
+		}
+		shard.tx_q.reserve(router.tx_reserve);
+		shard.tx_q.append(router.tx_pending);
+		router.tx_pending.reserve(router.tx_reserve);
+	}
+	shard.rx_new.clear();
+	SndQueue(shard);
+	return n;
 }
 
-void MiniPlex::RcvHandler(const asio::error_code err, p_rbuf_t buf, const asio::ip::udp::endpoint& rcv_sender, const size_t n)
+//(run-to-completion mode, holding the router's mtx) Run any of the router's cache timers that are due
+//	they don't need to be precise, so only check every millisecond - it costs a system call
+void MiniPlex::RunToCompletionTimers(Router& router, const std::chrono::steady_clock::time_point& now)
 {
-	if(err) [[unlikely]]
-	{
-		spdlog::get("MiniPlex")->error("RcvHandler(): error code {}: '{}'",err.value(),err.message());
+	if(now < router.next_timer_poll)
 		return;
-	}
+	router.next_timer_poll = now+std::chrono::milliseconds(1);
+	router.own_IOC->poll();
+}
+#endif
+
+void MiniPlex::RcvHandler(Router& router, const p_rbuf_t& buf, const asio::ip::udp::endpoint& rcv_sender, const size_t n)
+{
 	if(spdlog::get("MiniPlex")->should_log(spdlog::level::trace)) [[unlikely]]
+		spdlog::get("MiniPlex")->trace("RcvHandler(): {} bytes from {}",n,EndpointString(rcv_sender));
+
+	if(!acl.Empty())
 	{
-		auto sender_string = rcv_sender.address().to_string()+":"+std::to_string(rcv_sender.port());
-		spdlog::get("MiniPlex")->trace("RcvHandler(): {} bytes from {}",n,sender_string);
+		const auto rule = acl.Match(rcv_sender.address());
+		router.acl_hits[rule == PrefixACL::NoRule ? acl.Rules().size() : rule].fetch_add(1,std::memory_order_relaxed);
+		if(acl.Denied(rule)) [[unlikely]]
+		{
+			if(spdlog::get("MiniPlex")->should_log(spdlog::level::trace))
+				spdlog::get("MiniPlex")->trace("RcvHandler(): dropped datagram from {} - denied by ACL rule {}",EndpointString(rcv_sender),acl.Rules()[rule].prefix);
+			return;
+		}
 	}
 
-	const auto& branches = Branches(rcv_sender);
-	ModeHandler(branches,rcv_sender,buf,n);
+	//the sender is resolved once, here - the rest is in IDs
+	//	(held while the datagram is processed, even if nothing else wants it)
+	const auto sender = router.BranchIDs.Intern(rcv_sender);
+	router.BranchIDs.Ref(sender);
+	const auto& branches = Branches(router,sender);
+	(this->*ModeHandler)(router,branches,sender,buf,n);
+	router.BranchIDs.Unref(sender);
 }
 
-void MiniPlex::Hub(const std::list<asio::ip::udp::endpoint>& branches, const asio::ip::udp::endpoint& rcv_sender, p_rbuf_t buf, const size_t n)
+void MiniPlex::Hub(Router& router, const std::vector<branch_id_t>&, const branch_id_t rcv_sender, const p_rbuf_t& buf, const size_t n)
 {
-	Forward(buf,n,rcv_sender,branches,"active branches");
-	Forward(buf,n,rcv_sender,InactivePermaBranches,"inactive fixed branches");
+	ForwardFanOut(router,buf,n,rcv_sender);
 }
 
-void MiniPlex::Trunk(const std::list<asio::ip::udp::endpoint>& branches, const asio::ip::udp::endpoint& rcv_sender, p_rbuf_t buf, const size_t n)
+void MiniPlex::Trunk(Router& router, const std::vector<branch_id_t>&, const branch_id_t rcv_sender, const p_rbuf_t& buf, const size_t n)
 {
 	if(rcv_sender == trunk)
-	{
-		Forward(buf,n,rcv_sender,branches,"active branches");
-		Forward(buf,n,rcv_sender,InactivePermaBranches,"inactive fixed branches");
-	}
+		ForwardFanOut(router,buf,n,rcv_sender);
 	else
-		Forward(buf,n,rcv_sender,std::list{trunk},"trunk");
+		Forward(router,buf,n,rcv_sender,std::array{trunk},"trunk");
 }
 
-void MiniPlex::Prune(const std::list<asio::ip::udp::endpoint>& branches, const asio::ip::udp::endpoint& rcv_sender, p_rbuf_t buf, const size_t n)
+//The prune branch is the one that's been cached the longest - by any router
+void MiniPlex::Prune(Router& router, const std::vector<branch_id_t>& branches, const branch_id_t rcv_sender, const p_rbuf_t& buf, const size_t n)
 {
-	if(rcv_sender != trunk && !branches.empty() && rcv_sender != *branches.begin()) [[unlikely]]
+	const auto own_first = branches.empty() ? NoBranch : branches.front();
+	bool remote_first = false;
+	if(routers.size() > 1)
+	{
+		RemoteBranches(router);
+		remote_first = router.remote_first_seq < (own_first == NoBranch ? NoSeq : router.added_seq[own_first]);
+	}
+	const bool any_first = own_first != NoBranch || remote_first;
+
+	if(rcv_sender != trunk && any_first && (remote_first || rcv_sender != own_first)) [[unlikely]]
 	{
-		auto sender_string = rcv_sender.address().to_string()+":"+std::to_string(rcv_sender.port());
-		spdlog::get("MiniPlex")->debug("Prune(): pruned packet from branch {}",sender_string);
+		spdlog::get("MiniPlex")->debug("Prune(): pruned packet from branch {}",EndpointString(router.BranchIDs.Endpoint(rcv_sender)));
 		return;
 	}
 	if(rcv_sender == trunk)
 	{
-		if(branches.empty())
-			Forward(buf,n,rcv_sender,PermaBranches,"fixed branches");
+		if(!any_first)
+			Forward(router,buf,n,rcv_sender,PermaBranches,"fixed branches");
+		else if(remote_first)
+		{
+			spdlog::get("MiniPlex")->trace("Prune(): sending to active prune branch (on another router)");
+			QueueSend(router,buf,n,router.remote_first);
+		}
 		else
-			Forward(buf,n,rcv_sender,std::list{*branches.begin()},"active prune branch");
+			Forward(router,buf,n,rcv_sender,std::array{own_first},"active prune branch");
 	}
 	else
-		Forward(buf,n,rcv_sender,std::list{trunk},"trunk");
+		Forward(router,buf,n,rcv_sender,std::array{trunk},"trunk");
 }
 
-void MiniPlex::Switch(const std::list<asio::ip::udp::endpoint>& branches, const asio::ip::udp::endpoint& rcv_sender, p_rbuf_t buf, const size_t n)
+void MiniPlex::Switch(Router& router, const std::vector<branch_id_t>&, const branch_id_t rcv_sender, const p_rbuf_t& buf, const size_t n)
 {
-	auto [success,src,dst] = GetSrcDst(buf,n);
+	const auto& sender_ep = router.BranchIDs.Endpoint(rcv_sender);
+	auto [success,src,dst] = GetSrcDst(router,buf,n);
 	if(!success) [[unlikely]]
 	{
-		auto sender_string = rcv_sender.address().to_string()+":"+std::to_string(rcv_sender.port());
-		spdlog::get("MiniPlex")->error("Switch(): Failed to get packet addresses. Branch {}.",sender_string);
+		spdlog::get("MiniPlex")->error("Switch(): Failed to get packet addresses. Branch {}.",EndpointString(sender_ep));
 		return;
 	}
 
-	//Get any active branches for src and dst
-	// and make sure the sender branch is associated with src addr
-	const auto& src_branches = AddressBranches(rcv_sender,src,true);
-	const auto& dst_branches = AddressBranches(rcv_sender,dst);
-
-	//Only accept packets for a src address if it's on the active branch for that addr
-	const auto& active_src_branch = *src_branches.begin();
-	if(active_src_branch != rcv_sender) [[unlikely]]
+	//Make sure the sender branch is associated with src addr
+	// and only accept packets for a src address if it's on the active branch for that addr
+	asio::ip::udp::endpoint active_src_branch;
+	if(!AddressBranch(sender_ep,src,active_src_branch,true)) [[unlikely]]
+	{
+		spdlog::get("MiniPlex")->debug("Switch(): dropped packet from branch {} - src addr ({:#x}) not learned.",EndpointString(sender_ep),src);
+		return;
+	}
+	if(active_src_branch != sender_ep) [[unlikely]]
 	{
-		auto sender_string = rcv_sender.address().to_string()+":"+std::to_string(rcv_sender.port());
-		auto active_string = active_src_branch.address().to_string()+":"+std::to_string(active_src_branch.port());
-		spdlog::get("MiniPlex")->debug("Switch(): dropped packet from branch {} - src addr ({:#x}) already active on branch {}.",sender_string,src,active_string);
+		spdlog::get("MiniPlex")->debug("Switch(): dropped packet from branch {} - src addr ({:#x}) already active on branch {}.",EndpointString(sender_ep),src,EndpointString(active_src_branch));
 		return;
 	}
 
 	//Check if there's an active branch for the dst addr
-	if(dst_branches.empty()) [[unlikely]]
+	asio::ip::udp::endpoint dst_branch;
+	if(!AddressBranch(sender_ep,dst,dst_branch)) [[unlikely]]
 	{
 		//No active branch for that addr - broadcast it to all
-		Forward(buf,n,rcv_sender,branches,"active branches");
-		Forward(buf,n,rcv_sender,InactivePermaBranches,"inactive fixed branches");
+		ForwardFanOut(router,buf,n,rcv_sender);
 		return;
 	}
 	//Otherwise just send it to the active associated branch
-	Forward(buf,n,rcv_sender,std::list{*dst_branches.begin()},"active address branch");
+	spdlog::get("MiniPlex")->trace("Forward(): sending to 1 active address branch");
+	if(dst_branch != sender_ep)
+		QueueSend(router,buf,n,dst_branch);
 }
 
 //returns: success, src, dst
-std::tuple<bool,uint64_t,uint64_t> MiniPlex::GetSrcDst(p_rbuf_t buf, const size_t n)
+std::tuple<bool,uint64_t,uint64_t> MiniPlex::GetSrcDst(Router& router, const p_rbuf_t& buf, const size_t n)
 {
+	if(!extractor.Empty())
+	{
+		uint64_t src = 0, dst = 0;
+		const auto rule = extractor.Extract(buf.get(),n,src,dst);
+		router.extractor_hits[rule == AddrExtractor::Extracted ? extractor.Rules().size() : rule].fetch_add(1,std::memory_order_relaxed);
+		return {rule == AddrExtractor::Extracted,src,dst};
+	}
+	auto& vm = router.AddrVM ? *router.AddrVM : AddrVM;
+	std::unique_lock<std::mutex> lock(vm_mtx,std::defer_lock);
+	if(!router.AddrVM)
+		lock.lock();
 	try
 	{
-		auto virt_buf = AddrVM.map_data_mem(buf->data(),n);
-		auto src_addr = AddrVM.stack_push<uint64_t>(0);
-		auto dst_addr = AddrVM.stack_push<uint64_t>(0);
-		AddrVM.register_set(10,virt_buf); //a0=&buf;
-		AddrVM.register_set(11,n);        //a1=n;
-		AddrVM.register_set(12,src_addr); //a2=&src;
-		AddrVM.register_set(13,dst_addr); //a3=&dst;
-		AddrVM.execute_program();
-		auto res = AddrVM.register_get(10);
-		auto dst = AddrVM.stack_pop<uint64_t>();
-		auto src = AddrVM.stack_pop<uint64_t>();
+		auto virt_buf = vm.map_data_mem(buf.get(),n);
+		auto src_addr = vm.stack_push<uint64_t>(0);
+		auto dst_addr = vm.stack_push<uint64_t>(0);
+		vm.register_set(10,virt_buf); //a0=&buf;
+		vm.register_set(11,n);        //a1=n;
+		vm.register_set(12,src_addr); //a2=&src;
+		vm.register_set(13,dst_addr); //a3=&dst;
+		vm.register_set(14,vm_shared_addr);   //a4=&shared;
+		vm.register_set(15,vm_shared.size()); //a5=shared_size;
+		vm.execute_program();
+		auto res = vm.register_get(10);
+		auto dst = vm.stack_pop<uint64_t>();
+		auto src = vm.stack_pop<uint64_t>();
 		return {res==0,src,dst};
 	}
 	catch(const std::exception& e) { spdlog::get("MiniPlex")->error("GetSrcDst(): VM execution error: {}",e.what()); }
 	return {false,0,0};
 }
 
-p_rbuf_t MiniPlex::MakeSharedBuf(rbuf_t* buf)
+//Wrap up a received datagram for processing
+//	one that overflowed the slab into the spill area gets copied into a buffer of the right size class,
+//	and the slab goes straight back to the pool
+p_rbuf_t MiniPlex::RcvBuf(Shard& shard, uint8_t* const slab, const uint8_t* const spill, const size_t n)
 {
-	auto recycler = socket_strand.wrap([this](rbuf_t* p)
+	const auto slab_size = BufferPool::ClassSizes[rcv_class];
+	if(n <= slab_size) [[likely]]
+		return MakeSharedBuf(shard,rcv_class,slab);
+
+	rx_spills++;
+	const auto size_class = BufferPool::ClassFor(n);
+	auto buf = shard.pool.Take(size_class);
+	std::memcpy(buf,slab,slab_size);
+	std::memcpy(buf+slab_size,spill,n-slab_size);
+	shard.pool.Give(rcv_class,slab);
+	return MakeSharedBuf(shard,size_class,buf);
+}
+
+//Share a pool buffer - it goes back to the pool (on the socket strand) when the last reference is dropped
+//	and the shared_ptr control block comes from the block pool, so it doesn't cost a heap allocation either
+p_rbuf_t MiniPlex::MakeSharedBuf(Shard& shard, const size_t size_class, uint8_t* const buf)
+{
+	return p_rbuf_t(buf,BufReleaser{this,&shard,size_class},PoolAllocator<uint8_t>());
+}
+
+//Fill the shard's receive buffers up to the limit (-Y), and the block pool with a control block to share each one
+//	up front, rather than as the traffic first peaks - so once it's running, receiving doesn't allocate
+void MiniPlex::PrimeBufs(Shard& shard)
+{
+	shard.pool.Reserve(rcv_class,max_bufs);
+	std::vector<p_rbuf_t> blocks;
+	blocks.reserve(max_bufs+rcv_batch_size);
+	for(size_t i=0; i<max_bufs+rcv_batch_size; i++)
+		blocks.emplace_back(nullptr,BufReleaser{this,nullptr,rcv_class},PoolAllocator<uint8_t>());
+}
+
+//Give a buffer back to the shard it came from - from any thread
+void MiniPlex::ReleaseBuf(Shard& shard, const recycled_buf_t& buf)
+{
+	//pipeline/run-to-completion mode, on the shard's own thread already
+	if(socket_stage == &shard)
+	{
+		if(!stopping) [[likely]]
+			RecycleBuf(shard,buf);
+		else
+			delete[] buf.p;
+		return;
+	}
+	//pipeline mode: otherwise it's on the process stage (the recycle ring producer)
+	if(pipeline_ring)
+	{
+		if(stopping || !PushOrWait(shard.recycle_ring,recycled_buf_t(buf),shard.recycle_ring_stalls,stopping,[this,&shard](){Doorbell(shard.IOC,shard.parked);}))
+			delete[] buf.p;
+		return;
+	}
+	shard.socket_strand.dispatch(Pooled([this,&shard,buf]()
 	{
 		if(!stopping)
-			rcv_buf_q.push_back(MakeSharedBuf(p));
+			RecycleBuf(shard,buf);
 		else
-			delete p;
-	});
-	return p_rbuf_t(buf ? buf : new rbuf_t, recycler);
+			delete[] buf.p;
+	}));
+}
+
+//(socket strand/stage) Put a buffer back where it came from
+void MiniPlex::RecycleBuf(Shard& shard, const recycled_buf_t& buf)
+{
+#ifdef HAVE_IO_URING
+	if(shard.uring)
+	{
+		shard.uring->ReturnBuf(buf.id);
+		if(!shard.uring_recv_armed)
+		{
+			UringArmRcv(shard);
+			UringSnd(shard);
+		}
+		return;
+	}
+#endif
+	shard.pool.Give(buf.id,buf.p);
 }
 
 template<typename T> void MiniPlex::Forward(
+	Router& router,
 	const p_rbuf_t& pBuf,
 	const size_t size,
-	const asio::ip::udp::endpoint& sender,
+	const branch_id_t sender,
 	const T& branches,
 	const char* desc)
 {
 	spdlog::get("MiniPlex")->trace("Forward(): sending to {} {}",branches.size(),desc);
-	for(const auto& endpoint : branches)
-		if(endpoint != sender)
-			socket_strand.post([this,pBuf,size,ep{endpoint}]()
-			{
-				socket.async_send_to(asio::buffer(pBuf.get(),size),ep,[pBuf](asio::error_code,size_t){});
-				tx_count++;
-			});
+	for(const auto id : branches)
+		if(id != sender)
+			QueueSend(router,pBuf,size,router.BranchIDs.Endpoint(id));
 }
 
-//Cache or refresh given branch endpoint, and return the list
-const std::list<asio::ip::udp::endpoint>& MiniPlex::Branches(const asio::ip::udp::endpoint& ep)
+//Forward to all the branches (active, then inactive fixed) except the sender
+//	a straight run over the ready-made FanOut() list - the sender is skipped by position, not by comparing IDs
+//	then the branches the other routers own, from their last snapshots (the sender is never one of those)
+void MiniPlex::ForwardFanOut(Router& router, const p_rbuf_t& pBuf, const size_t size, const branch_id_t sender)
 {
-	if(ep != trunk)
+	const auto& dests = FanOut(router);
+	auto skip = router.rcv_sender_pos;
+	if(skip == NotCached)
 	{
-		auto res = ActiveBranches.Add(ep);
-		if(res == AddResult::ADDED)
+		//not an active branch (eg. the trunk, or the cache is full), but it could be an inactive fixed one
+		const auto inactive = dests.begin()+router.ActiveBranches.Keys().size();
+		skip = std::find(inactive,dests.end(),sender)-dests.begin();
+	}
+	const auto end = dests.size();
+	if(routers.size() > 1)
+		RemoteBranches(router);
+	spdlog::get("MiniPlex")->trace("ForwardFanOut(): sending to {} branches",end-(skip < end)+router.remote_fanout.size());
+	for(size_t i=0; i<skip && i<end; i++)
+		QueueSend(router,pBuf,size,router.BranchIDs.Endpoint(dests[i]));
+	for(size_t i=skip+1; i<end; i++)
+		QueueSend(router,pBuf,size,router.BranchIDs.Endpoint(dests[i]));
+	for(const auto& ep : router.remote_fanout)
+		QueueSend(router,pBuf,size,ep);
+}
+
+//The destinations for a datagram from a branch: the active branches, then the inactive fixed branches
+//	(only rebuilt when a branch is added, expires, or moves between those)
+const std::vector<branch_id_t>& MiniPlex::FanOut(Router& router)
+{
+	if(router.fanout_stale) [[unlikely]]
+	{
+		const auto& active = router.ActiveBranches.Keys();
+		router.fanout.assign(active.begin(),active.end());
+		for(const auto id : PermaBranches)
+			if(router.InactivePermaBranches[id])
+				router.fanout.push_back(id);
+		router.fanout_stale = false;
+		ReserveTx(router);
+	}
+	return router.fanout;
+}
+
+//Grow the router's tx hand-off to a send to every destination for every buffer a shard can have out
+//	when the fan out grows, rather than a datagram at a time - the shard's hand-offs follow suit in FlushTx() and SndHandoff()
+void MiniPlex::ReserveTx(Router& router)
+{
+	const auto dests = std::max<size_t>(1,router.fanout.size()+router.remote_fanout.size());
+	router.tx_reserve = std::max(router.tx_reserve,(max_bufs+rcv_batch_size)*dests);
+	router.tx_pending.reserve(router.tx_reserve);
+}
+
+//Refresh the router's view of the other routers' branches - only when one of them has published since last time
+void MiniPlex::RemoteBranches(Router& router)
+{
+	const auto generation = branch_generation.load(std::memory_order_acquire);
+	if(generation == router.remote_generation) [[likely]]
+		return;
+	router.remote_generation = generation;
+	router.remote_fanout.clear();
+	router.remote_first_seq = NoSeq;
+	for(const auto& other : routers)
+	{
+		if(other.get() == &router)
+			continue;
+		const auto snap = other->snapshot.load();
+		if(!snap)
+			continue;
+		router.remote_fanout.insert(router.remote_fanout.end(),snap->branches.begin(),snap->branches.end());
+		if(snap->first_seq < router.remote_first_seq)
 		{
-			InactivePermaBranches.erase(ep);
-			auto ep_string = ep.address().to_string()+":"+std::to_string(ep.port());
-			spdlog::get("MiniPlex")->debug("Branches(): New cache entry for {}",ep_string);
+			router.remote_first_seq = snap->first_seq;
+			router.remote_first = snap->first;
 		}
-		else if(res == AddResult::DROPPED)
+	}
+	ReserveTx(router);
+}
+
+//The router's branches have changed - rebuild its fan out list, and (once the current batch is done) its snapshot
+void MiniPlex::BranchesChanged(Router& router)
+{
+	router.fanout_stale = true;
+	if(routers.size() > 1 && !router.publish_pending)
+	{
+		router.publish_pending = true;
+		router.strand.post(Pooled([this,&router]()
+		{
+			router.publish_pending = false;
+			PublishBranches(router);
+		}));
+	}
+}
+
+void MiniPlex::PublishBranches(Router& router)
+{
+	auto snap = std::make_shared<BranchSnapshot>();
+	for(const auto id : FanOut(router))
+		snap->branches.push_back(router.BranchIDs.Endpoint(id));
+	const auto& active = router.ActiveBranches.Keys();
+	if(!active.empty())
+	{
+		snap->first_seq = router.added_seq[active.front()];
+		snap->first = router.BranchIDs.Endpoint(active.front());
+	}
+	router.snapshot.store(std::move(snap));
+	branch_generation.fetch_add(1,std::memory_order_release);
+}
+
+inline void MiniPlex::QueueSend(Router& router, const p_rbuf_t& pBuf, const size_t size, const asio::ip::udp::endpoint& endpoint)
+{
+#ifdef HAVE_BATCH_IO
+	//queue for the socket strand to send in batches (of 1 by default) - see FlushTx()
+	router.tx_pending.push_back({pBuf,size,endpoint,router.tx_ingress});
+#else
+	router.tx_shard->socket_strand.post([this,shard{router.tx_shard},pBuf,size,ep{endpoint},ingress{router.tx_ingress}]()
+	{
+		shard->socket.async_send_to(asio::buffer(pBuf.get(),size),ep,[this,pBuf,ingress](asio::error_code err,size_t)
+		{
+			if(!err && measure_latency)
+				RecordLatency(ingress,std::chrono::steady_clock::now());
+		});
+		tx_count++;
+	});
+#endif
+}
+
+//Cache or refresh given branch, and return the list
+//	a new branch is only cached if it's admitted (see -A and -U) - otherwise it's treated like one that didn't fit
+const std::vector<branch_id_t>& MiniPlex::Branches(Router& router, const branch_id_t id)
+{
+	router.rcv_sender_pos = NotCached;
+	if(id != trunk)
+	{
+		auto res = router.ActiveBranches.Add(id,&router.rcv_sender_pos,[&router,id]()
+		{
+			return !router.Admission.Enabled() || router.Admission.Admit(router.BranchIDs.Endpoint(id));
+		});
+		if(res == AddResult::ADDED)
 		{
-			auto ep_string = ep.address().to_string()+":"+std::to_string(ep.port());
-			spdlog::get("MiniPlex")->debug("Branches(): Max cache entries - {} not cached.",ep_string);
+			BranchAdded(router,id);
+			spdlog::get("MiniPlex")->debug("Branches(): New cache entry for {}",EndpointString(router.BranchIDs.Endpoint(id)));
 		}
+		else if(res == AddResult::DROPPED)
+			spdlog::get("MiniPlex")->debug("Branches(): Max cache entries - {} not cached.",EndpointString(router.BranchIDs.Endpoint(id)));
+		else if(res == AddResult::REJECTED)
+			spdlog::get("MiniPlex")->debug("Branches(): New branch {} not admitted - rate limited.",EndpointString(router.BranchIDs.Endpoint(id)));
 		else if(spdlog::get("MiniPlex")->should_log(spdlog::level::trace))
+			spdlog::get("MiniPlex")->trace("Branches(): Refreshed cache entry for {}",EndpointString(router.BranchIDs.Endpoint(id)));
+	}
+	return router.ActiveBranches.Keys();
+}
+
+//A branch has been added to the router's cache - it holds a reference until it times out
+void MiniPlex::BranchAdded(Router& router, const branch_id_t id)
+{
+	router.BranchIDs.Ref(id);
+	if(id >= router.added_seq.size())
+		router.added_seq.resize(id+1);
+	router.added_seq[id] = branch_add_seq++;
+	if(id < PermaBranches.size())
+		router.InactivePermaBranches[id] = false;
+	BranchesChanged(router);
+}
+
+//A branch has timed out, or been evicted to make room for another (see -e)
+void MiniPlex::BranchDropped(Router& router, const branch_id_t id, const bool evicted)
+{
+	if(id < PermaBranches.size())
+		router.InactivePermaBranches[id] = true;
+	BranchesChanged(router);
+	if(evicted)
+		spdlog::get("MiniPlex")->debug("Cache entry for {} evicted - cache full.",EndpointString(router.BranchIDs.Endpoint(id)));
+	else
+		spdlog::get("MiniPlex")->debug("Cache entry for {} timed out.",EndpointString(router.BranchIDs.Endpoint(id)));
+	router.BranchIDs.Unref(id);
+}
+
+//The router that owns a branch (and routes all its datagrams)
+size_t MiniPlex::RouterFor(const asio::ip::udp::endpoint& ep) const
+{
+	if(routers.size() == 1)
+		return 0;
+	const uint64_t hash = static_cast<uint64_t>(std::hash<asio::ip::udp::endpoint>()(ep))*0x9E3779B97F4A7C15ull;
+	return static_cast<size_t>(((hash >> 32)*routers.size()) >> 32);
+}
+
+MiniPlex::AddrShard& MiniPlex::AddrShardFor(const uint64_t addr)
+{
+	const uint64_t hash = addr*0xC2B2AE3D27D4EB4Full;
+	return *addr_shards[((hash >> 32)*addr_shards.size()) >> 32];
+}
+
+//Optionally associate the branch with the address, and get the active branch for the address
+//	returns false if there isn't one (a new association is only made if it's admitted - see -A and -U)
+bool MiniPlex::AddressBranch(const asio::ip::udp::endpoint& ep, const uint64_t addr, asio::ip::udp::endpoint& active, const bool associate)
+{
+	auto& shard = AddrShardFor(addr);
+	std::lock_guard<std::mutex> lock(shard.mtx);
+	if(!associate)
+	{
+		const auto id = shard.Table.Active(addr);
+		if(id == NoBranch)
+			return false;
+		active = shard.BranchIDs.Endpoint(id);
+		return true;
+	}
+
+	//hold the ID while associating, in case it isn't kept
+	const auto id = shard.BranchIDs.Intern(ep);
+	shard.BranchIDs.Ref(id);
+	const auto [res,active_id] = shard.Table.Associate(addr,id,[&shard,&ep]()
+	{
+		return !shard.Admission.Enabled() || shard.Admission.Admit(ep);
+	});
+	if(res == AddResult::ADDED)
+	{
+		shard.BranchIDs.Ref(id);
+		spdlog::get("MiniPlex")->debug("AddressBranch(): New branch ({}) for address {:#x}", EndpointString(ep), addr);
+	}
+	else if(res == AddResult::DROPPED)
+		spdlog::get("MiniPlex")->debug("AddressBranch(): Ignored branch ({}) for address {:#x}", EndpointString(ep), addr);
+	else if(res == AddResult::REJECTED)
+		spdlog::get("MiniPlex")->debug("AddressBranch(): New branch ({}) for address {:#x} not admitted - rate limited.", EndpointString(ep), addr);
+	else if(spdlog::get("MiniPlex")->should_log(spdlog::level::trace))
+		spdlog::get("MiniPlex")->trace("AddressBranch(): Refreshed branch ({}) for address {:#x}", EndpointString(ep), addr);
+	const bool found = active_id != NoBranch;
+	if(found)
+		active = shard.BranchIDs.Endpoint(active_id);
+	shard.BranchIDs.Unref(id);
+	return found;
+}
+
+//(called with the shard locked)
+void MiniPlex::AddressDropped(AddrShard& shard, const uint64_t addr, const branch_id_t id, const bool evicted)
+{
+	if(evicted)
+		spdlog::get("MiniPlex")->debug("AddressBranch(): Evicted branch {} for address {:#x} - table or address full.",EndpointString(shard.BranchIDs.Endpoint(id)),addr);
+	else
+		spdlog::get("MiniPlex")->debug("AddressBranch(): Address {:#x} branch {} cache timeout.",addr,EndpointString(shard.BranchIDs.Endpoint(id)));
+	shard.BranchIDs.Unref(id);
+}
+
+//Ages the address table shards
+void MiniPlex::AddrEpochTimer()
+{
+	addr_epoch_timer.expires_after(addr_shards.front()->Table.EpochPeriod());
+	addr_epoch_timer.async_wait([this](asio::error_code err)
+	{
+		if(err)
+			return;
+		for(auto& shard : addr_shards)
 		{
-			auto ep_string = ep.address().to_string()+":"+std::to_string(ep.port());
-			spdlog::get("MiniPlex")->trace("Branches(): Refreshed cache entry for {}",ep_string);
+			std::lock_guard<std::mutex> lock(shard->mtx);
+			shard->Table.Tick();
 		}
-	}
-	return ActiveBranches.Keys();
+		AddrEpochTimer();
+	});
 }
 
-//Cache or refresh given branch endpoint, and return the list
-const std::list<asio::ip::udp::endpoint>& MiniPlex::AddressBranches(const asio::ip::udp::endpoint& ep, const uint64_t addr, const bool associate)
+std::string MiniPlex::EndpointString(const asio::ip::udp::endpoint& ep)
 {
-	//Add cache for address if it doesn't already exist
-	if(!AddrBranches.contains(addr)) [[unlikely]]
+	return ep.address().to_string()+":"+std::to_string(ep.port());
+}
+
+//Restore the learned branches and switch mode addresses from the last snapshot (see -d)
+//	(at startup - nothing's running yet)
+void MiniPlex::LoadCacheSnapshot()
+{
+	const auto& path = Args.CacheSnapshotFile.getValue();
+	CacheSnapshot snap;
+	try
 	{
-		AddrBranches.emplace(addr,TimeoutCache<asio::ip::udp::endpoint>(process_strand,Args.CacheTimeout.getValue(),[addr](const asio::ip::udp::endpoint& cache_ep)
+		if(!snap.Read(path))
 		{
-			auto ep_string = cache_ep.address().to_string()+":"+std::to_string(cache_ep.port());
-			spdlog::get("MiniPlex")->debug("Address ({:#x}) cache timeout for branch {}.",addr,ep_string);
-		}));
-		if(auto sz = Args.MaxSwitchCache.getValue())
-			AddrBranches.at(addr).SetMaxSize(sz);
+			spdlog::get("MiniPlex")->info("No cache snapshot to load from {}.",path);
+			return;
+		}
+	}
+	catch(const std::exception& e)
+	{
+		spdlog::get("MiniPlex")->warn("Ignoring cache snapshot: {}",e.what());
+		return;
 	}
 
-	//optionally associate the branch with the address
-	if(associate)
+	size_t branches = 0, addresses = 0;
+	//(leaving out any the ACL denies now)
+	for(const auto& b : snap.Branches)
 	{
-		auto res = AddrBranches.at(addr).Add(ep);
-		if(res == AddResult::ADDED)
+		if(acl.Denied(acl.Match(b.ep.address())))
+			continue;
+		auto& router = *routers[RouterFor(b.ep)];
+		//(held while restoring, so it's freed again if it isn't kept)
+		const auto id = router.BranchIDs.Intern(b.ep);
+		router.BranchIDs.Ref(id);
+		if(id != trunk && router.ActiveBranches.Restore(id,b.remaining) == AddResult::ADDED)
 		{
-			auto ep_string = ep.address().to_string()+":"+std::to_string(ep.port());
-			spdlog::get("MiniPlex")->debug("AddressBranches(): New branch ({}) for address {:#x}", ep_string, addr);
+			BranchAdded(router,id);
+			branches++;
 		}
-		else if(res == AddResult::DROPPED)
+		router.BranchIDs.Unref(id);
+	}
+	if(Args.Switch)
+		for(const auto& a : snap.Addresses)
 		{
-			auto ep_string = ep.address().to_string()+":"+std::to_string(ep.port());
-			spdlog::get("MiniPlex")->debug("AddressBranches(): Ignored branch ({}) for address {:#x}", ep_string, addr);
+			if(acl.Denied(acl.Match(a.ep.address())))
+				continue;
+			auto& shard = AddrShardFor(a.addr);
+			std::lock_guard<std::mutex> lock(shard.mtx);
+			const auto id = shard.BranchIDs.Intern(a.ep);
+			shard.BranchIDs.Ref(id);
+			if(shard.Table.Restore(a.addr,id,a.remaining) == AddResult::ADDED)
+			{
+				shard.BranchIDs.Ref(id);
+				addresses++;
+			}
+			shard.BranchIDs.Unref(id);
 		}
-		else if(spdlog::get("MiniPlex")->should_log(spdlog::level::trace))
+	spdlog::get("MiniPlex")->info("Loaded {} branches and {} switch mode address associations from cache snapshot {}.",branches,addresses,path);
+}
+
+void MiniPlex::CacheSnapshotTimer()
+{
+	snapshot_timer.expires_after(std::chrono::milliseconds(Args.CacheSnapshotPeriod.getValue()));
+	snapshot_timer.async_wait([this](asio::error_code err)
+	{
+		if(err)
+			return;
+		SaveCacheSnapshot();
+		CacheSnapshotTimer();
+	});
+}
+
+//Each router collects its branches on its own strand, and the last one to finish hands them to the snapshot thread to write
+void MiniPlex::SaveCacheSnapshot()
+{
+	if(snapshot_busy.exchange(true))
+	{
+		spdlog::get("MiniPlex")->warn("The last cache snapshot is still being written - skipping this one.");
+		return;
+	}
+	struct Collection
+	{
+		std::mutex mtx;
+		CacheSnapshot snap;
+		size_t pending;
+	};
+	auto collection = std::make_shared<Collection>();
+	collection->pending = routers.size();
+	for(auto& router : routers)
+	{
+		router->strand.post([this,collection,router{router.get()}]()
+		{
+			std::unique_lock<std::mutex> lock(collection->mtx);
+			CollectBranches(*router,collection->snap);
+			if(--collection->pending)
+				return;
+			lock.unlock();
+			//(the last one's finished - it cleared snapshot_busy on its way out)
+			if(snapshot_thread.joinable())
+				snapshot_thread.join();
+			snapshot_thread = std::thread([this,collection]()
+			{
+				WriteCacheSnapshot(collection->snap);
+				snapshot_busy = false;
+			});
+		});
+	}
+}
+
+//(on the router's strand)
+void MiniPlex::CollectBranches(Router& router, CacheSnapshot& snap) const
+{
+	const auto& keys = router.ActiveBranches.Keys();
+	for(size_t i=0; i<keys.size(); i++)
+		snap.Branches.push_back({router.BranchIDs.Endpoint(keys[i]),router.ActiveBranches.Remaining(i)});
+}
+
+//Add the switch mode addresses to the branches, and write it all out
+//	the address tables are copied a chunk at a time, so the routers only ever wait for a chunk's worth
+void MiniPlex::WriteCacheSnapshot(CacheSnapshot& snap)
+{
+	for(auto& shard : addr_shards)
+		for(size_t pos = 0; pos < shard->Table.Capacity();)
+		{
+			std::lock_guard<std::mutex> lock(shard->mtx);
+			pos = shard->Table.ForEach(pos,SnapshotChunk,[&](const uint64_t addr, const branch_id_t id, const std::chrono::milliseconds remaining)
+			{
+				snap.Addresses.push_back({addr,shard->BranchIDs.Endpoint(id),remaining});
+			});
+		}
+	snap.OrderAddresses();
+	try
+	{
+		snap.Write(Args.CacheSnapshotFile.getValue());
+		spdlog::get("MiniPlex")->debug("Saved {} branches and {} switch mode address associations to cache snapshot {}.",
+			snap.Branches.size(),snap.Addresses.size(),Args.CacheSnapshotFile.getValue());
+	}
+	catch(const std::exception& e)
+	{
+		spdlog::get("MiniPlex")->error("Failed to save cache snapshot: {}",e.what());
+	}
+}
+
+void MiniPlex::StatsTimer()
+{
+	stats_timer.expires_after(std::chrono::milliseconds(Args.StatsPeriod.getValue()));
+	stats_timer.async_wait([this](asio::error_code err)
+	{
+		if(err)
+			return;
+		LogStats();
+		StatsTimer();
+	});
+}
+
+void MiniPlex::LogStats()
+{
+	spdlog::get("MiniPlex")->info("Stats: RX/TX count {}/{}.",rx_count.load(),tx_count.load());
+	if(rcv_batch_size > 1 || use_uring)
+		spdlog::get("MiniPlex")->info("Stats: Datagrams per receive wakeup (datagrams:wakeups): {}",RcvBatchSummary());
+	if(snd_batch_size > 1 || use_uring)
+		spdlog::get("MiniPlex")->info("Stats: Batch send {}",SndBatchSummary());
+	if(gro)
+		spdlog::get("MiniPlex")->info("Stats: GRO {} datagrams in {} coalesced receives.",rx_gro_segments.load(),rx_gro_count.load());
+	if(gso_max_segment)
+		spdlog::get("MiniPlex")->info("Stats: GSO {}.",GSOSummary());
+	if(!use_uring)
+		spdlog::get("MiniPlex")->info("Stats: Buffer pool {}.",PoolSummary());
+	if(pipeline_ring)
+		spdlog::get("MiniPlex")->info("Stats: Pipeline rings {}.",PipelineSummary());
+	if(Args.Switch)
+		spdlog::get("MiniPlex")->info("Stats: Switch address table {}.",AddrTableSummary());
+	size_t interned = 0;
+	for(const auto& router : routers)
+		interned += router->BranchIDs.Size();
+	spdlog::get("MiniPlex")->info("Stats: {} branch endpoints interned.",interned);
+	if(Args.MaxBranchCache.getValue())
+		spdlog::get("MiniPlex")->info("Stats: Branch cache {}.",BranchCacheSummary());
+	if(routers.front()->Admission.Enabled())
+		spdlog::get("MiniPlex")->info("Stats: Admission {}.",AdmissionSummary());
+	if(!acl.Empty())
+		spdlog::get("MiniPlex")->info("Stats: ACL hits {}.",ACLSummary());
+	if(!extractor.Empty())
+		spdlog::get("MiniPlex")->info("Stats: Extractor rejects {}.",ExtractorSummary());
+	spdlog::get("MiniPlex")->info("Stats: Latency (ingress to egress) {}.",LatencySummary());
+}
+
+std::string MiniPlex::RcvBatchSummary() const
+{
+	std::string summary;
+	for(size_t i=0; i<rcv_batch_hist.size(); i++)
+		if(auto count = rcv_batch_hist[i].load())
+			summary += (summary.empty() ? "" : " ")+std::to_string(i)+":"+std::to_string(count);
+	return summary;
+}
+
+std::string MiniPlex::SndBatchSummary() const
+{
+	return "system calls "+std::to_string(tx_syscalls.load())
+		+", partial sends "+std::to_string(tx_partial.load())
+		+", would-block "+std::to_string(tx_eagain.load())
+		+", errors "+std::to_string(tx_errors.load());
+}
+
+//Buffers in use/allocated for each size class, over all shards
+std::string MiniPlex::PoolSummary() const
+{
+	std::string summary = "(in use/allocated)";
+	for(size_t c=0; c<BufferPool::ClassSizes.size(); c++)
+	{
+		size_t in_use = 0, allocated = 0;
+		for(const auto& shard : shards)
 		{
-			auto ep_string = ep.address().to_string()+":"+std::to_string(ep.port());
-			spdlog::get("MiniPlex")->trace("AddressBranches(): Refreshed branch ({}) for address {:#x}", ep_string, addr);
+			in_use += shard->pool.InUse(c);
+			allocated += shard->pool.Allocated(c);
 		}
+		summary += (c ? ", " : " ")+BufferPool::ClassName(c)+": "+std::to_string(in_use)+"/"+std::to_string(allocated);
+	}
+	return summary+", spilled datagrams "+std::to_string(rx_spills.load());
+}
+
+//Addresses in use/capacity, over all the address table shards
+std::string MiniPlex::AddrTableSummary() const
+{
+	size_t size = 0, capacity = 0, overflowed = 0, evictions = 0, branch_evictions = 0, branch_drops = 0;
+	for(const auto& shard : addr_shards)
+	{
+		size += shard->Table.Size();
+		capacity += shard->Table.Capacity();
+		overflowed += shard->Table.Overflowed();
+		evictions += shard->Table.Evictions();
+		branch_evictions += shard->Table.BranchEvictions();
+		branch_drops += shard->Table.BranchDrops();
+	}
+	return std::to_string(size)+"/"+std::to_string(capacity)+" addresses"
+		+", "+std::to_string(addr_shards.front()->Table.BytesPerAddress())+" bytes per address"
+		+" ("+std::to_string(overflowed)+" with more than "+std::to_string(AddressTable::InlineBranches)+" branches overflowed)"
+		+", "+std::to_string(evictions)+" evictions"
+		+", branches per address full: "+std::to_string(branch_evictions)+" evicted/"+std::to_string(branch_drops)+" dropped";
+}
+
+//What happened to new branches when the cache was full (over all the routers)
+std::string MiniPlex::BranchCacheSummary() const
+{
+	size_t evictions = 0, drops = 0;
+	for(const auto& router : routers)
+	{
+		evictions += router->ActiveBranches.Evictions();
+		drops += router->ActiveBranches.Drops();
+	}
+	return "full: "+std::to_string(evictions)+" evicted/"+std::to_string(drops)+" dropped";
+}
+
+//New cache entries refused by the admission limits (see -A and -U), over all the routers and address table shards
+std::string MiniPlex::AdmissionSummary() const
+{
+	size_t branch_global = 0, branch_prefix = 0, addr_global = 0, addr_prefix = 0;
+	for(const auto& router : routers)
+	{
+		branch_global += router->Admission.RejectedGlobal();
+		branch_prefix += router->Admission.RejectedPrefix();
+	}
+	for(const auto& shard : addr_shards)
+	{
+		addr_global += shard->Admission.RejectedGlobal();
+		addr_prefix += shard->Admission.RejectedPrefix();
+	}
+	auto summary = "branches rejected: "+std::to_string(branch_global)+" overall limit/"+std::to_string(branch_prefix)+" prefix limit";
+	if(!addr_shards.empty())
+		summary += ", address associations rejected: "+std::to_string(addr_global)+" overall limit/"+std::to_string(addr_prefix)+" prefix limit";
+	return summary;
+}
+
+//Datagrams matched by each ACL rule (over all the routers)
+std::string MiniPlex::ACLSummary() const
+{
+	std::string summary;
+	for(size_t rule=0; rule<=acl.Rules().size(); rule++)
+	{
+		size_t hits = 0;
+		for(const auto& router : routers)
+			hits += router->acl_hits[rule].load(std::memory_order_relaxed);
+		summary += (rule ? ", " : "");
+		if(rule < acl.Rules().size())
+			summary += (acl.Rules()[rule].action == PrefixACL::Action::ALLOW ? "allow " : "deny ")+acl.Rules()[rule].prefix;
+		else
+			summary += "unmatched";
+		summary += ": "+std::to_string(hits);
+	}
+	return summary;
+}
+
+//Datagrams rejected by each extractor rule, and the ones that got through (over all the routers)
+std::string MiniPlex::ExtractorSummary() const
+{
+	std::string summary;
+	for(size_t rule=0; rule<=extractor.Rules().size(); rule++)
+	{
+		size_t hits = 0;
+		for(const auto& router : routers)
+			hits += router->extractor_hits[rule].load(std::memory_order_relaxed);
+		summary += (rule ? ", " : "");
+		summary += rule < extractor.Rules().size() ? extractor.Rules()[rule].text : "extracted";
+		summary += ": "+std::to_string(hits);
 	}
+	return summary;
+}
+
+//Depth of each kind of ring (now/max, over all shards), and how many times a producer found one full
+std::string MiniPlex::PipelineSummary() const
+{
+	auto ring_summary = [this](const char* name, auto ring, auto max, auto stalls)
+	{
+		size_t depth = 0, max_depth = 0, stall_count = 0;
+		for(const auto& shard : shards)
+		{
+			depth += ((*shard).*ring).size();
+			max_depth = std::max(max_depth,((*shard).*max).load());
+			stall_count += ((*shard).*stalls).load();
+		}
+		return std::string(name)+" "+std::to_string(depth)+"/"+std::to_string(max_depth)+" stalls "+std::to_string(stall_count);
+	};
+	return "(depth now/max) "+ring_summary("rx",&Shard::rx_ring,&Shard::rx_ring_max,&Shard::rx_ring_stalls)
+		+", "+ring_summary("tx",&Shard::tx_ring,&Shard::tx_ring_max,&Shard::tx_ring_stalls)
+		+", "+ring_summary("recycle",&Shard::recycle_ring,&Shard::recycle_ring_max,&Shard::recycle_ring_stalls);
+}
+
+//Percentiles of the ingress to egress latency of the datagrams sent since last time
+std::string MiniPlex::LatencySummary()
+{
+	const auto snap = latency_hist.Take();
+	latency_hist.Reset();
+	//microseconds to one decimal place
+	auto us = [](const uint64_t ns)
+	{
+		const auto us_x10 = (ns+50)/100;
+		return std::to_string(us_x10/10)+"."+std::to_string(us_x10%10)+"us";
+	};
+	return "p50 "+us(snap.Percentile(50))+", p90 "+us(snap.Percentile(90))+", p99 "+us(snap.Percentile(99))
+		+", p99.9 "+us(snap.Percentile(99.9))+", max "+us(snap.Max())+" over "+std::to_string(snap.total)+" datagrams";
+}
 
-	return AddrBranches.at(addr).Keys();
+std::string MiniPlex::GSOSummary() const
+{
+	const auto sends = tx_gso_sends.load();
+	const auto segments = tx_gso_segments.load();
+	//aggregation ratio to one decimal place
+	const auto ratio_x10 = sends ? (segments*10+sends/2)/sends : 0;
+	return std::to_string(segments)+" datagrams in "+std::to_string(sends)+" sends ("
+		+std::to_string(ratio_x10/10)+"."+std::to_string(ratio_x10%10)+" per send), fallbacks "
+		+std::to_string(tx_gso_fallbacks.load());
 }
 
 void MiniPlex::Benchmark()
 {
-	const size_t sock_pool_count = 100;
+	const size_t sock_pool_count = std::max<size_t>(1,Args.BenchBranches.getValue());
 	std::vector<asio::ip::udp::socket> sock_pool;
 	for(size_t i=0; i<sock_pool_count; i++)
 	{
 		sock_pool.emplace_back(IOC);
 		sock_pool.back().open(asio::ip::udp::v4());
+		sock_pool.back().non_blocking(true);
+	}
+	//a payload per socket, made up front - so the load generator itself doesn't allocate per datagram
+	//	each starts with a DNP3 link header from the socket's address (its index) to the next socket's,
+	//	so Switch mode (eg. with Examples/SwitchBytecode/SwitchDNP3_FAST.bin) learns and switches between them
+	std::vector<std::array<uint8_t,500>> bench_dgrams(sock_pool_count);
+	for(size_t i=0; i<sock_pool_count; i++)
+	{
+		const auto src = static_cast<uint16_t>(i), dst = static_cast<uint16_t>((i+1)%sock_pool_count);
+		auto& dgram = bench_dgrams[i];
+		dgram.fill(0);
+		dgram[0] = 0x05; dgram[1] = 0x64; dgram[2] = 0x05; dgram[3] = 0xC0;
+		dgram[4] = dst & 0xFF; dgram[5] = dst >> 8;
+		dgram[6] = src & 0xFF; dgram[7] = src >> 8;
 	}
 	const auto duration = std::chrono::milliseconds(Args.BenchDuration.getValue());
 	const auto start_time = std::chrono::steady_clock::now();
 	size_t spoof_count = 0;
 	auto elapsed = std::chrono::milliseconds::zero();
+#ifdef MP_ALLOC_COUNT
+	//steady state: skip the first half of the run, while the buffer pools, caches and handler memory fill up
+	bool warmed_up = false;
+	size_t alloc_start = 0, rx_start = 0;
+#endif
 	do
 	{
 		if(spoof_count < rx_count+50) //assume os can buffer 50 packets
 		{
-			auto pSock = &sock_pool[spoof_count++%sock_pool_count];
-			IOC.post([ep{local_ep},pSock]()
-			{
-				auto pForwardBuf = std::shared_ptr<uint8_t>(new uint8_t[500],[](uint8_t* p){delete[] p;});
-				pSock->async_send_to(asio::buffer(pForwardBuf.get(),500),ep,[pForwardBuf](asio::error_code,size_t){});
-			});
+			asio::error_code err;
+			const auto i = spoof_count%sock_pool_count;
+			sock_pool[i].send_to(asio::buffer(bench_dgrams[i]),local_ep,0,err);
+			if(!err)
+				spoof_count++;
 		}
-		else
-			IOC.poll_one();
+		else if(!IOC.poll_one())
+			std::this_thread::yield(); //let the pipeline (or shard) threads have the core, if they're sharing
 		elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time);
+#ifdef MP_ALLOC_COUNT
+		if(!warmed_up && elapsed > duration/2)
+		{
+			warmed_up = true;
+			alloc_start = AllocCount();
+			rx_start = rx_count;
+		}
+#endif
 	}while(elapsed < duration && !IOC.stopped());
+#ifdef MP_ALLOC_COUNT
+	const auto allocs = AllocCount()-alloc_start;
+	const auto rx_steady = rx_count-rx_start;
+#endif
 	spdlog::get("MiniPlex")->critical("Benchmark(): RX/TX count {}/{} over {}ms.",rx_count.load(),tx_count.load(),elapsed.count());
+	if(rcv_batch_size > 1 || use_uring)
+		spdlog::get("MiniPlex")->critical("Benchmark(): Datagrams per receive wakeup (datagrams:wakeups): {}",RcvBatchSummary());
+	if(snd_batch_size > 1 || use_uring)
+		spdlog::get("MiniPlex")->critical("Benchmark(): Batch send {}",SndBatchSummary());
+	if(gro)
+		spdlog::get("MiniPlex")->critical("Benchmark(): GRO {} datagrams in {} coalesced receives.",rx_gro_segments.load(),rx_gro_count.load());
+	if(gso_max_segment)
+		spdlog::get("MiniPlex")->critical("Benchmark(): GSO {}.",GSOSummary());
+	if(!use_uring)
+		spdlog::get("MiniPlex")->critical("Benchmark(): Buffer pool {}.",PoolSummary());
+	if(pipeline_ring)
+		spdlog::get("MiniPlex")->critical("Benchmark(): Pipeline rings {}.",PipelineSummary());
+	if(Args.Switch)
+		spdlog::get("MiniPlex")->critical("Benchmark(): Switch address table {}.",AddrTableSummary());
+	if(Args.MaxBranchCache.getValue())
+		spdlog::get("MiniPlex")->critical("Benchmark(): Branch cache {}.",BranchCacheSummary());
+	if(routers.front()->Admission.Enabled())
+		spdlog::get("MiniPlex")->critical("Benchmark(): Admission {}.",AdmissionSummary());
+	if(!acl.Empty())
+		spdlog::get("MiniPlex")->critical("Benchmark(): ACL hits {}.",ACLSummary());
+	if(!extractor.Empty())
+		spdlog::get("MiniPlex")->critical("Benchmark(): Extractor rejects {}.",ExtractorSummary());
+	spdlog::get("MiniPlex")->critical("Benchmark(): Latency (ingress to egress) {}.",LatencySummary());
+#ifdef MP_ALLOC_COUNT
+	spdlog::get("MiniPlex")->critical("Benchmark(): Steady state heap allocations {} for {} datagrams received ({:.3f} per datagram).",
+		allocs,rx_steady,rx_steady ? double(allocs)/rx_steady : double(allocs));
+#endif
 	std::raise(SIGINT);
 }
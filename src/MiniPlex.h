@@ -19,17 +19,127 @@
 #define MINIPLEX_H
 
 #include "TimeoutCache.h"
+#include "BranchTable.h"
+#include "AddressTable.h"
+#include "AdmissionLimiter.h"
+#include "PrefixACL.h"
+#include "AddrExtractor.h"
+#include "CacheSnapshot.h"
 #include "TinyRISCV64.h"
+#include "BufferPool.h"
+#include "PoolAllocator.h"
+#include "SPSCRing.h"
+#include "LatencyHistogram.h"
+#include "BatchIO.h"
+#include "UringIO.h"
 #include <asio.hpp>
 #include <atomic>
-#include <deque>
-#include <list>
-#include <set>
-#include <tuple>
+#include <chrono>
 #include <functional>
+#include <limits>
+#include <tuple>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+//when a datagram was received - only stamped if latency is being measured (-s or -M)
+using ingress_t = std::chrono::steady_clock::time_point;
+
+struct rcv_dgram_t
+{
+	p_rbuf_t buf;
+	asio::ip::udp::endpoint sender;
+	size_t n;
+	ingress_t ingress;
+};
+
+struct snd_dgram_t
+{
+	p_rbuf_t buf;
+	size_t n;
+	asio::ip::udp::endpoint dest;
+	ingress_t ingress; //of the datagram it's forwarding
+	bool no_gso = false; //the kernel refused it as part of a GSO send - send it on its own
+};
+
+//A buffer on its way back to the shard it was received on
+//	either a buffer pool buffer (id is the size class), or an io_uring provided buffer (id is the buffer id, p isn't used)
+struct recycled_buf_t
+{
+	uint8_t* p = nullptr;
+	size_t id = 0;
+};
 
-using rbuf_t = std::array<uint8_t, 64L * 1024>;
-using p_rbuf_t = std::shared_ptr<rbuf_t>;
+//A FIFO that keeps its storage - once it's grown to the working set size, pushing and popping don't allocate
+//	(std::deque allocates and frees blocks as it goes)
+template<typename T>
+class RecycledQueue
+{
+public:
+	bool empty() const { return head == items.size(); }
+	size_t size() const { return items.size()-head; }
+	T& front() { return items[head]; }
+	T& operator[](const size_t i) { return items[head+i]; }
+	const T& operator[](const size_t i) const { return items[head+i]; }
+	void push_back(T&& item) { items.push_back(std::move(item)); }
+	//room for count queued items without growing - popped ones keep their slots until the front is compacted, so that's twice as many
+	void reserve(const size_t count) { items.reserve(2*count); }
+	//move everything from a batch to the back of the queue
+	void append(std::vector<T>& batch)
+	{
+		if(items.empty())
+			std::swap(items,batch);
+		else
+			items.insert(items.end(),std::make_move_iterator(batch.begin()),std::make_move_iterator(batch.end()));
+		batch.clear();
+	}
+	void pop_front(const size_t count = 1)
+	{
+		for(size_t i=0; i<count; i++)
+			items[head++] = T();
+		if(head == items.size())
+		{
+			items.clear();
+			head = 0;
+		}
+		else if(head > items.size()/2)
+		{
+			//only ever moves less than it's popped
+			items.erase(items.begin(),items.begin()+head);
+			head = 0;
+		}
+	}
+
+private:
+	std::vector<T> items;
+	size_t head = 0;
+};
+
+//A shared_ptr that one thread replaces and others take copies of - the lock's only held while the pointer's copied
+//	(std::atomic<std::shared_ptr> isn't in libc++, and the std::atomic_load/std::atomic_store overloads are deprecated)
+template<typename T>
+class LockedSharedPtr
+{
+public:
+	std::shared_ptr<T> load() const
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		return ptr;
+	}
+	void store(std::shared_ptr<T> next)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			std::swap(ptr,next);
+		}
+		//(the old one's released here, outside the lock)
+	}
+
+private:
+	mutable std::mutex mtx;
+	std::shared_ptr<T> ptr;
+};
 
 struct CmdArgs;
 
@@ -37,50 +147,341 @@ class MiniPlex
 {
 public:
 	MiniPlex(const CmdArgs& Args, asio::io_context &IOC);
+	~MiniPlex();
 	void Benchmark();
+	//Stop the dedicated threads, and save the cache snapshot (see -d) - once the thread pool has stopped
+	void Stop();
 
 private:
+	//The socket side of the pipeline (everything up to the process strand)
+	//	there's one per listening socket - more than one with SO_REUSEPORT sharding
+	struct Shard
+	{
+		//the spill area is big enough for the part of a max sized datagram that doesn't fit in a slab
+		static constexpr size_t SpillSize = BufferPool::LargeSize - BufferPool::SlabSize;
+
+		//ring_size: for the pipeline rings (zero if the pipeline isn't used)
+		Shard(asio::io_context& IOC, const size_t max_bufs, const size_t rcv_class, const size_t rcv_batch_size, const size_t snd_batch_size, const bool gro, const bool gso, const size_t ring_size, const size_t num_routers):
+			IOC(IOC),
+			socket(IOC),
+			socket_strand(IOC),
+			pool(max_bufs,rcv_class,rcv_batch_size),
+			//only ever touched (made resident) by datagrams that don't fit in a slab
+			spill(rcv_class == BufferPool::SlabClass ? new uint8_t[rcv_batch_size*SpillSize] : nullptr),
+			rx_routes(num_routers),
+			rx_ring(ring_size),
+			tx_ring(ring_size),
+			//room for every buffer the shard can have out, so returning one hardly ever waits
+			recycle_ring(ring_size ? max_bufs+rcv_batch_size : 0)
+#ifdef HAVE_BATCH_IO
+			,rcv_batch(rcv_batch_size,gro)
+			,snd_batch(snd_batch_size,gso)
+#endif
+		{
+			//every buffer the shard can have out - the hand-offs are swapped around, so they'd each grow to that a datagram at a time
+			rx_new.reserve(max_bufs+rcv_batch_size);
+			rx_steer.reserve(max_bufs+rcv_batch_size);
+			rx_post.reserve(num_routers);
+			for(auto& route : rx_routes)
+			{
+				route.handoff.reserve(max_bufs+rcv_batch_size);
+				route.processing.reserve(max_bufs+rcv_batch_size);
+			}
+		}
+		asio::io_context& IOC;
+		asio::ip::udp::socket socket;
+		asio::io_context::strand socket_strand;
+		BufferPool pool;
+		std::unique_ptr<uint8_t[]> spill; //one SpillSize area per receive batch slot
+		uint8_t* Spill(const size_t i) const { return spill ? spill.get()+i*SpillSize : nullptr; }
+		asio::ip::udp::endpoint rcv_sender; //for the (one at a time) non-batch receive
 
-	void Rcv();
-	void RcvHandler(const asio::error_code err, p_rbuf_t buf, const asio::ip::udp::endpoint& rcv_sender, const size_t n);
-	p_rbuf_t MakeSharedBuf(rbuf_t* buf = nullptr);
+		//Hand-offs between the socket strand and the routers (process strands)
+		//	the vectors are swapped rather than moved, so they all keep their storage
+		std::vector<rcv_dgram_t> rx_new;        //(socket strand) received, not yet handed off
+		std::vector<size_t> rx_steer;           //(socket strand) the router for each datagram in rx_new (more than one router)
+		std::vector<size_t> rx_post;            //(socket strand) routers to post to
+		std::vector<snd_dgram_t> tx_new;        //(socket strand) handed off, not yet queued
+		std::mutex handoff_mtx;
+		struct RxRoute
+		{
+			std::vector<rcv_dgram_t> handoff;
+			std::vector<rcv_dgram_t> processing; //(router strand) being processed
+			bool posted = false; //the router has been asked to pick up handoff
+		};
+		std::vector<RxRoute> rx_routes; //by router
+		std::vector<snd_dgram_t> tx_handoff;
+		size_t tx_reserve = 0; //(handoff_mtx) the most the routers reckon can be in flight to send - see ReserveTx()
+		bool tx_posted = false; //the socket strand has been asked to pick up tx_handoff
+
+		//Pipeline mode hand-offs instead (see -q): the socket stage thread and the process stage thread are the only producer/consumer
+		SPSCRing<rcv_dgram_t> rx_ring;         //received datagrams to process
+		SPSCRing<snd_dgram_t> tx_ring;         //datagrams to send
+		SPSCRing<recycled_buf_t> recycle_ring; //buffers finished with on the process stage
+		std::atomic_bool parked = false;       //the socket stage is waiting in its io_context - ring the doorbell
+		bool rx_stalled = false;               //(socket stage) rx_ring was full - rx_new is waiting for room
+		bool rcv_delayed = false;              //(socket stage) Rcv() is waiting for buffers to come back
+		bool rtc_waiting = false;              //(run-to-completion mode) waiting in the reactor for the socket to be readable
+		//how deep the rings have got, and how many times a producer found one full
+		std::atomic<size_t> rx_ring_max = 0;
+		std::atomic<size_t> tx_ring_max = 0;
+		std::atomic<size_t> recycle_ring_max = 0;
+		std::atomic<size_t> rx_ring_stalls = 0;
+		std::atomic<size_t> tx_ring_stalls = 0;
+		std::atomic<size_t> recycle_ring_stalls = 0;
+#ifdef HAVE_BATCH_IO
+		RcvBatch rcv_batch;
+		SndBatch snd_batch;
+#endif
+		RecycledQueue<snd_dgram_t> tx_q; //datagrams waiting to be sent on the socket strand
+		bool tx_waiting = false;      //tx_q is waiting for the socket to be writable
+#ifdef HAVE_IO_URING
+		//io_uring backend (replaces the rcv buffer queue and the socket reactor)
+		std::unique_ptr<UringIO> uring;
+		std::unique_ptr<asio::posix::stream_descriptor> uring_fd; //for waiting on completions
+		bool uring_recv_armed = false;
+		std::vector<snd_dgram_t> uring_sends; //in flight, by send slot
+		std::vector<uint32_t> uring_free_slots;
+#endif
+	};
+
+	static constexpr size_t NotCached = std::numeric_limits<size_t>::max();
+	static constexpr uint64_t NoSeq = std::numeric_limits<uint64_t>::max();
+	static constexpr size_t SnapshotChunk = 1024; //switch mode address table entries copied per lock (see WriteCacheSnapshot())
+
+	//A router's branches, published for the other routers to fan out to (read-copy-update: replaced, never modified)
+	struct BranchSnapshot
+	{
+		std::vector<asio::ip::udp::endpoint> branches; //active, then inactive fixed
+		uint64_t first_seq = NoSeq;     //when the router's first (longest cached) branch was added - see Prune()
+		asio::ip::udp::endpoint first;
+	};
+
+	//The routing side (everything after the socket strands) - there's one per router (see -w)
+	//	each router owns the branches whose endpoints hash to it (see RouterFor()), and only it routes their datagrams,
+	//	so the routers don't share any branch state. They each publish a BranchSnapshot for the others instead
+	struct Router
+	{
+		//own_context: for pipeline/run-to-completion mode - otherwise the strand is on the main thread pool
+		Router(asio::io_context& IOC, const bool own_context, const size_t timeout_ms, std::function<void(const branch_id_t)> timeout_handler,
+			const double admit_rate, const double admit_prefix_rate, const uint8_t admit_prefix_len):
+			own_IOC(own_context ? std::make_unique<asio::io_context>(1) : nullptr),
+			strand(own_IOC ? *own_IOC : IOC),
+			cache_wheel(strand),
+			ActiveBranches(cache_wheel,timeout_ms,timeout_handler),
+			Admission(admit_rate,admit_prefix_rate,admit_prefix_len)
+		{}
+		std::unique_ptr<asio::io_context> own_IOC; //(pipeline mode) run by the process stage thread, (run-to-completion mode) polled by the shard threads
+		asio::io_context::strand strand;
+		std::mutex mtx; //(run-to-completion mode) the shard threads take turns at routing, and running the cache timers
+		std::chrono::steady_clock::time_point next_timer_poll; //(run-to-completion mode, mtx)
+		TimingWheel cache_wheel;  //expiry for the branch cache
+		BranchTable BranchIDs;    //everything below is in terms of these IDs
+		TimeoutCache<branch_id_t> ActiveBranches;
+		AdmissionLimiter Admission;              //new branches (see -A and -U)
+		std::vector<std::atomic<size_t>> acl_hits; //by ACL rule (see -i) - the last one counts senders no rule matched
+		std::vector<std::atomic<size_t>> extractor_hits; //datagrams rejected by each extractor rule (see -E) - the last one counts extracted
+		std::unique_ptr<TinyRISCV64::VM> AddrVM; //(switch mode) this router's copy of the byte code VM - null if they all have to use the one
+		std::vector<bool> InactivePermaBranches; //by (fixed branch) ID - only the ones this router owns
+		std::vector<uint64_t> added_seq;         //by ID - when each active branch was added
+		Shard* tx_shard = nullptr;           //the shard to send from - the one that received the datagrams being processed
+		ingress_t tx_ingress;                //when the datagram being processed was received
+		size_t rcv_sender_pos = NotCached;   //where the sender of the datagram being processed is in the active branches
+		std::vector<branch_id_t> fanout;     //see FanOut()
+		bool fanout_stale = true;            //a branch has been added, expired, or moved since fanout was built
+		std::vector<snd_dgram_t> tx_pending; //forwarded datagrams not yet handed to the socket strand - keeps its storage
+		size_t tx_reserve = 0;               //see ReserveTx()
+		//(more than one router)
+		LockedSharedPtr<const BranchSnapshot> snapshot;
+		bool publish_pending = false;        //the branches have changed since the snapshot - a new one has been posted
+		uint64_t remote_generation = NoSeq;  //of the snapshots the fields below were taken from - see RemoteBranches()
+		std::vector<asio::ip::udp::endpoint> remote_fanout; //the other routers' branches
+		uint64_t remote_first_seq = NoSeq;
+		asio::ip::udp::endpoint remote_first;
+	};
+
+	//A share of the Switch mode address table - addresses are spread across the shards by hash (see AddrShardFor())
+	//	any router can use any shard, so each has a lock. The branches are interned separately from the routers' branches
+	struct AddrShard
+	{
+		AddrShard(const size_t max_addrs, const size_t max_branches, const FullPolicy branch_policy, const size_t timeout_ms,
+			std::function<void(AddrShard& shard, const uint64_t addr, const branch_id_t branch, const bool evicted)> drop_handler,
+			const double admit_rate, const double admit_prefix_rate, const uint8_t admit_prefix_len):
+			Table(max_addrs,max_branches,branch_policy,timeout_ms,[this,drop_handler](const uint64_t addr, const branch_id_t branch, const bool evicted)
+			{
+				drop_handler(*this,addr,branch,evicted);
+			}),
+			Admission(admit_rate,admit_prefix_rate,admit_prefix_len)
+		{}
+		std::mutex mtx;
+		BranchTable BranchIDs;
+		AddressTable Table;
+		AdmissionLimiter Admission; //new associations, by the sender's prefix (see -A and -U)
+	};
+
+	void Rcv(Shard& shard);
+	bool TopUpRcvBufs(Shard& shard, const size_t want);
+#ifdef HAVE_BATCH_IO
+	void BatchRcv(Shard& shard);
+	size_t DrainRcvBatch(Shard& shard, asio::error_code& err);
+	void BatchSnd(Shard& shard);
+	size_t GSORun(const RecycledQueue<snd_dgram_t>& tx_q, const size_t start) const;
+#endif
+#ifdef HAVE_IO_URING
+	void UringSetup(Shard& shard);
+	void UringRcv(Shard& shard);
+	void UringReap(Shard& shard);
+	bool UringRcvCompletion(Shard& shard, const io_uring_cqe& cqe, const ingress_t& ingress);
+	void UringSndCompletion(Shard& shard, const io_uring_cqe& cqe);
+	void UringArmRcv(Shard& shard);
+	void UringSnd(Shard& shard);
+	p_rbuf_t UringSharedBuf(Shard& shard, const uint16_t bid, uint8_t* const payload);
+#endif
+	void AddRcvDgram(Shard& shard, p_rbuf_t&& buf, const asio::ip::udp::endpoint& sender, const size_t n, const size_t segment_size, const ingress_t& ingress);
+	ingress_t IngressTime() const;
+	void RecordLatency(const ingress_t& ingress, const ingress_t& egress);
+	void PostRcvBatch(Shard& shard);
+	void ProcessRcvBatch(Shard& shard, const size_t router_index);
+	void FlushTx(Router& router);
+	void SndHandoff(Shard& shard);
+	void SndQueue(Shard& shard);
+	void RcvHandler(Router& router, const p_rbuf_t& buf, const asio::ip::udp::endpoint& rcv_sender, const size_t n);
+	p_rbuf_t RcvBuf(Shard& shard, uint8_t* const slab, const uint8_t* const spill, const size_t n);
+	p_rbuf_t MakeSharedBuf(Shard& shard, const size_t size_class, uint8_t* const buf);
+	void PrimeBufs(Shard& shard);
+	//The deleter for a shared pool buffer - gives it back to the shard it came from
+	struct BufReleaser
+	{
+		MiniPlex* plex;
+		Shard* shard; //null for the ones that only prime the block pool (see PrimeBufs())
+		size_t size_class;
+		void operator()(uint8_t* p) const
+		{
+			if(shard)
+				plex->ReleaseBuf(*shard,{p,size_class});
+		}
+	};
+	void ReleaseBuf(Shard& shard, const recycled_buf_t& buf);
+	void RecycleBuf(Shard& shard, const recycled_buf_t& buf);
+#ifdef HAVE_BATCH_IO
+	void PipelineSocketLoop(Shard& shard);
+	size_t PipelineSocketStage(Shard& shard);
+	size_t PipelineRcvHandoff(Shard& shard);
+	void PipelineProcessLoop();
+	size_t PipelineProcessStage(Shard& shard);
+	void RunToCompletionLoop(Shard& shard);
+	size_t RunToCompletionBatch(Shard& shard);
+	void RunToCompletionTimers(Router& router, const std::chrono::steady_clock::time_point& now);
+#endif
 	template<typename T> void Forward(
+		Router& router,
 		const p_rbuf_t& pBuf,
 		const size_t size,
-		const asio::ip::udp::endpoint& sender,
+		const branch_id_t sender,
 		const T& branches,
 		const char* desc);
-	const std::list<asio::ip::udp::endpoint>& Branches(const asio::ip::udp::endpoint& ep);
-	const std::list<asio::ip::udp::endpoint>& AddressBranches(const asio::ip::udp::endpoint& ep, const uint64_t addr, const bool associate = false);
-	std::tuple<bool,uint64_t,uint64_t> GetSrcDst(p_rbuf_t buf, const size_t n);
+	void ForwardFanOut(Router& router, const p_rbuf_t& pBuf, const size_t size, const branch_id_t sender);
+	const std::vector<branch_id_t>& FanOut(Router& router);
+	void ReserveTx(Router& router);
+	void RemoteBranches(Router& router);
+	void BranchesChanged(Router& router);
+	void PublishBranches(Router& router);
+	void QueueSend(Router& router, const p_rbuf_t& pBuf, const size_t size, const asio::ip::udp::endpoint& endpoint);
+	const std::vector<branch_id_t>& Branches(Router& router, const branch_id_t id);
+	void BranchAdded(Router& router, const branch_id_t id);
+	void BranchDropped(Router& router, const branch_id_t id, const bool evicted);
+	size_t RouterFor(const asio::ip::udp::endpoint& ep) const;
+	bool AddressBranch(const asio::ip::udp::endpoint& ep, const uint64_t addr, asio::ip::udp::endpoint& active, const bool associate = false);
+	void AddressDropped(AddrShard& shard, const uint64_t addr, const branch_id_t id, const bool evicted);
+	AddrShard& AddrShardFor(const uint64_t addr);
+	void AddrEpochTimer();
+	static std::string EndpointString(const asio::ip::udp::endpoint& ep);
+	std::tuple<bool,uint64_t,uint64_t> GetSrcDst(Router& router, const p_rbuf_t& buf, const size_t n);
+	void LoadCacheSnapshot();
+	void CacheSnapshotTimer();
+	void SaveCacheSnapshot();
+	void CollectBranches(Router& router, CacheSnapshot& snap) const;
+	void WriteCacheSnapshot(CacheSnapshot& snap);
+	void StatsTimer();
+	void LogStats();
+	std::string RcvBatchSummary() const;
+	std::string SndBatchSummary() const;
+	std::string GSOSummary() const;
+	std::string PoolSummary() const;
+	std::string PipelineSummary() const;
+	std::string AddrTableSummary() const;
+	std::string BranchCacheSummary() const;
+	std::string AdmissionSummary() const;
+	std::string ACLSummary() const;
+	std::string ExtractorSummary() const;
+	std::string LatencySummary();
 
-	void Hub(const std::list<asio::ip::udp::endpoint>& branches, const asio::ip::udp::endpoint& rcv_sender, p_rbuf_t buf, const size_t n);
-	void Trunk(const std::list<asio::ip::udp::endpoint>& branches, const asio::ip::udp::endpoint& rcv_sender, p_rbuf_t buf, const size_t n);
-	void Prune(const std::list<asio::ip::udp::endpoint>& branches, const asio::ip::udp::endpoint& rcv_sender, p_rbuf_t buf, const size_t n);
-	void Switch(const std::list<asio::ip::udp::endpoint>& branches, const asio::ip::udp::endpoint& rcv_sender, p_rbuf_t buf, const size_t n);
-	std::function<void(const std::list<asio::ip::udp::endpoint>&, const asio::ip::udp::endpoint&, p_rbuf_t, const size_t)> ModeHandler;
+	void Hub(Router& router, const std::vector<branch_id_t>& branches, const branch_id_t rcv_sender, const p_rbuf_t& buf, const size_t n);
+	void Trunk(Router& router, const std::vector<branch_id_t>& branches, const branch_id_t rcv_sender, const p_rbuf_t& buf, const size_t n);
+	void Prune(Router& router, const std::vector<branch_id_t>& branches, const branch_id_t rcv_sender, const p_rbuf_t& buf, const size_t n);
+	void Switch(Router& router, const std::vector<branch_id_t>& branches, const branch_id_t rcv_sender, const p_rbuf_t& buf, const size_t n);
+	void (MiniPlex::*ModeHandler)(Router&, const std::vector<branch_id_t>&, const branch_id_t, const p_rbuf_t&, const size_t) = nullptr;
 
 	std::atomic_bool stopping = false;
 
 	const CmdArgs& Args;
 	asio::io_context& IOC;
 	const asio::ip::udp::endpoint local_ep;
-	asio::ip::udp::socket socket;
-	asio::io_context::strand socket_strand;
-	asio::io_context::strand process_strand;
-	std::set<asio::ip::udp::endpoint> PermaBranches;
-	TimeoutCache<asio::ip::udp::endpoint> ActiveBranches;
-	std::unordered_map<uint64_t,TimeoutCache<asio::ip::udp::endpoint>> AddrBranches;
-	TinyRISCV64::VM AddrVM;
-	std::set<asio::ip::udp::endpoint> InactivePermaBranches;
-	asio::ip::udp::endpoint trunk;
-
-	std::deque<p_rbuf_t> rcv_buf_q;
-	size_t rcv_buf_count = 0; //not Q size - includes 'in flight' bufs
+	const PrefixACL acl; //source prefix allow/deny rules - empty unless there's an ACL file
+	const AddrExtractor extractor; //switch mode address rules - empty unless there's a spec file (then the VM isn't used)
+	const size_t pipeline_ring; //ring size - zero if the pipeline isn't used
+	const size_t rtc_spins; //run-to-completion mode busy-poll budget - zero if it isn't used
+	std::thread process_thread; //(pipeline mode) runs the (one) router
+	std::atomic_bool process_parked = false; //the process stage is waiting in its io_context - ring the doorbell
+	std::vector<std::unique_ptr<Router>> routers;
+	std::atomic<uint64_t> branch_generation = 0; //bumped whenever a router publishes a snapshot
+	std::atomic<uint64_t> branch_add_seq = 0;    //the order branches are added in, across the routers
+	std::vector<branch_id_t> PermaBranches; //interned first by every router, so they're IDs 0 to size-1 in all of them
+	branch_id_t trunk = NoBranch;           //(the same ID in every router too)
+	std::vector<std::unique_ptr<AddrShard>> addr_shards; //switch mode address -> branches
+	asio::steady_timer addr_epoch_timer;
+	std::mutex vm_mtx; //for the one VM, if it has to be used by all the routers - address extraction with it is serialized
+	TinyRISCV64::VM AddrVM; //(the routers' VMs are loaded from this one)
+	std::vector<uint8_t> vm_shared; //switch mode VM shared state (see -V) - mapped into all the VMs
+	uint64_t vm_shared_addr = 0;
+
+	const size_t max_bufs; //per shard (see -Y)
+	const size_t rcv_batch_size;
+	const size_t snd_batch_size;
+	const bool use_uring;
+	const bool gro;
+	const size_t gso_max_segment; //zero if GSO is disabled
+	const size_t rcv_class; //buffer pool class to receive into - a slab, unless GRO needs room for coalesced datagrams
+	std::vector<std::unique_ptr<asio::io_context>> shard_IOCs; //dedicated (per core) contexts if there's more than one shard
+	std::vector<std::unique_ptr<Shard>> shards;
+	std::vector<std::thread> shard_threads;
+	asio::steady_timer stats_timer;
+	asio::steady_timer snapshot_timer;
+	std::thread snapshot_thread;            //writes the periodic cache snapshot - off the routing threads
+	std::atomic_bool snapshot_busy = false; //the last one's still being written
 
 	//atomic rx/tx counts so Benchmark() can access them 'off strand'
 	std::atomic<size_t> rx_count = 0;
 	std::atomic<size_t> tx_count = 0;
+	//histogram of how many datagrams each batch receive wakeup returned (index 0 == spurious wakeup)
+	std::vector<std::atomic<size_t>> rcv_batch_hist;
+	//GRO: coalesced datagrams received, and how many datagrams they were split into
+	std::atomic<size_t> rx_gro_count = 0;
+	std::atomic<size_t> rx_gro_segments = 0;
+	//datagrams that didn't fit in a receive slab, and were copied out of the spill area
+	std::atomic<size_t> rx_spills = 0;
+	//batch send accounting (io_uring submissions count as system calls)
+	std::atomic<size_t> tx_syscalls = 0;
+	std::atomic<size_t> tx_partial = 0;
+	std::atomic<size_t> tx_eagain = 0;
+	std::atomic<size_t> tx_errors = 0;
+	//GSO: sends of more than one datagram, how many datagrams they held, and how many times the kernel refused one
+	std::atomic<size_t> tx_gso_sends = 0;
+	std::atomic<size_t> tx_gso_segments = 0;
+	std::atomic<size_t> tx_gso_fallbacks = 0;
+	//ingress to egress latency of forwarded datagrams (since the last stats log)
+	const bool measure_latency;
+	LatencyHistogram latency_hist;
 };
 
 #endif // MINIPLEX_H
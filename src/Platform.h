@@ -0,0 +1,96 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef PLATFORM_H_
+#define PLATFORM_H_
+
+#include <asio.hpp>
+#include <thread>
+#include <stdexcept>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/// Platform specific socket options and thread placement
+#if defined(__linux__)
+#define HAVE_REUSEPORT_SHARDS
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef UDP_GRO
+#define HAVE_UDP_GRO
+#endif
+
+//Let several sockets bind the same endpoint, and have the kernel load balance datagrams between them
+inline void SetReusePort(asio::ip::udp::socket& udpsocket)
+{
+	int set = 1;
+	if(setsockopt(udpsocket.native_handle(), SOL_SOCKET, SO_REUSEPORT, &set, sizeof(set)) != 0)
+		throw std::runtime_error("Failed to set UDP SO_REUSEPORT");
+}
+
+#ifdef HAVE_UDP_GRO
+//Let the kernel coalesce bursts of same sized datagrams from a flow into one, with a control message for the segment size
+inline void SetUDPGRO(asio::ip::udp::socket& udpsocket)
+{
+	int set = 1;
+	if(setsockopt(udpsocket.native_handle(), SOL_UDP, UDP_GRO, &set, sizeof(set)) != 0)
+		throw std::runtime_error("Failed to set UDP_GRO");
+}
+#endif
+
+inline bool PinThreadToCore(std::thread& thread, const size_t core)
+{
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(core % CPU_SETSIZE, &cpus);
+	return pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus) == 0;
+}
+#else
+inline void SetReusePort(asio::ip::udp::socket&)
+{
+	throw std::runtime_error("UDP SO_REUSEPORT load balancing is not supported on this platform");
+}
+
+inline bool PinThreadToCore(std::thread&, const size_t)
+{
+	return false;
+}
+#endif
+
+#ifndef HAVE_UDP_GRO
+inline void SetUDPGRO(asio::ip::udp::socket&)
+{
+	throw std::runtime_error("UDP_GRO is not supported on this platform");
+}
+#endif
+
+//Tell the CPU we're in a spin-wait loop (saves power, and gives the core to a hyper-thread sibling)
+inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+	_mm_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#else
+	std::this_thread::yield();
+#endif
+}
+
+#endif //PLATFORM_H_
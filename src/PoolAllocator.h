@@ -0,0 +1,131 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef POOLALLOCATOR_H
+#define POOLALLOCATOR_H
+
+#include <array>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include <type_traits>
+#include <cstddef>
+
+//Thread safe recycling of small allocations (asio handler operations, shared_ptr control blocks etc.)
+//	freed blocks go on a free list for their size, instead of back to the heap, so once the working set
+//	has been allocated it's all reused. They can be freed on a different thread to the one that allocated them,
+//	which is what asio's own (thread local) handler memory recycling doesn't cope with
+class BlockPool
+{
+public:
+	static constexpr size_t Granularity = 64;
+	static constexpr size_t MaxBlockSize = 1024; //bigger than this goes straight to the heap
+
+	static void* Allocate(const size_t size)
+	{
+		if(size == 0 || size > MaxBlockSize) [[unlikely]]
+			return ::operator new(size);
+		auto& list = ListFor(size);
+		{
+			std::lock_guard<std::mutex> lock(list.mtx);
+			if(!list.blocks.empty())
+			{
+				auto p = list.blocks.back();
+				list.blocks.pop_back();
+				return p;
+			}
+		}
+		return ::operator new(BlockSize(size));
+	}
+	static void Deallocate(void* const p, const size_t size) noexcept
+	{
+		if(size == 0 || size > MaxBlockSize) [[unlikely]]
+		{
+			::operator delete(p);
+			return;
+		}
+		auto& list = ListFor(size);
+		std::lock_guard<std::mutex> lock(list.mtx);
+		try { list.blocks.push_back(p); }
+		catch(...) { ::operator delete(p); }
+	}
+
+private:
+	struct FreeList
+	{
+		std::mutex mtx;
+		std::vector<void*> blocks;
+	};
+	static constexpr size_t BlockSize(const size_t size) { return (size+Granularity-1)/Granularity*Granularity; }
+	static FreeList& ListFor(const size_t size)
+	{
+		static std::array<FreeList,MaxBlockSize/Granularity> lists;
+		return lists[(size-1)/Granularity];
+	}
+};
+
+//Standard allocator interface to the BlockPool
+template<typename T>
+struct PoolAllocator
+{
+	using value_type = T;
+
+	PoolAllocator() noexcept = default;
+	template<typename U> PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+	T* allocate(const size_t n)
+	{
+		static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "PoolAllocator doesn't do over-aligned types");
+		return static_cast<T*>(BlockPool::Allocate(n*sizeof(T)));
+	}
+	void deallocate(T* const p, const size_t n) noexcept
+	{
+		BlockPool::Deallocate(p,n*sizeof(T));
+	}
+
+	template<typename U> bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+	template<typename U> bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+};
+
+//An asio completion handler, with PoolAllocator as its associated allocator
+//	so the memory for the operation it completes comes from (and goes back to) the BlockPool
+template<typename Handler>
+class PooledHandler
+{
+public:
+	using allocator_type = PoolAllocator<void>;
+
+	explicit PooledHandler(Handler&& h): handler(std::move(h)) {}
+	allocator_type get_allocator() const noexcept { return allocator_type(); }
+
+	template<typename... Args> void operator()(Args&&... args)
+	{
+		handler(std::forward<Args>(args)...);
+	}
+
+private:
+	Handler handler;
+};
+
+template<typename Handler>
+PooledHandler<std::decay_t<Handler>> Pooled(Handler&& h)
+{
+	return PooledHandler<std::decay_t<Handler>>(std::decay_t<Handler>(std::forward<Handler>(h)));
+}
+
+#endif // POOLALLOCATOR_H
@@ -0,0 +1,203 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef PREFIXACL_H
+#define PREFIXACL_H
+
+#include <asio.hpp>
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+//Allow/deny rules for source prefixes (IPv4 and IPv6), matched by longest prefix
+//	Each family is a multibit trie: a 16 bit stride at the root, then 8 bits per level. The rules are leaf-pushed
+//	(shorter prefixes are copied down into the ranges longer ones don't cover), so a lookup is just one array
+//	index per level until it lands on a rule - 2 at most for IPv4
+//	Built once, then read only - so it's safe to match from any thread
+class PrefixACL
+{
+public:
+	enum class Action {ALLOW,DENY};
+	struct Rule
+	{
+		Action action;
+		std::string prefix; //as written (for logging)
+	};
+	static constexpr size_t NoRule = std::numeric_limits<size_t>::max();
+
+	//Empty - matches nothing
+	PrefixACL() = default;
+
+	//A rule per line: allow|deny <address>[/<length>] (without a length it's a single address)
+	//	'#' starts a comment. For the same prefix, the last rule wins
+	//	throws std::invalid_argument
+	explicit PrefixACL(const std::string& path)
+	{
+		std::ifstream file(path);
+		if(!file)
+			throw std::invalid_argument("Failed to open ACL file: "+path);
+		struct Parsed { asio::ip::address addr; uint8_t len; uint32_t rule; };
+		std::vector<Parsed> parsed;
+		std::string line;
+		for(size_t line_num = 1; std::getline(file,line); line_num++)
+		{
+			line = line.substr(0,line.find('#'));
+			std::istringstream words(line);
+			std::string action, prefix, extra;
+			if(!(words >> action))
+				continue;
+			auto invalid = [&](const std::string& why)
+			{
+				return std::invalid_argument("Invalid ACL rule ("+path+" line "+std::to_string(line_num)+"): "+why);
+			};
+			if(!(words >> prefix) || (words >> extra))
+				throw invalid("expected 'allow|deny <prefix>'");
+			if(action != "allow" && action != "deny")
+				throw invalid("unknown action '"+action+"'");
+
+			const auto slash = prefix.find('/');
+			asio::error_code err;
+			const auto addr = asio::ip::make_address(prefix.substr(0,slash),err);
+			if(err)
+				throw invalid("bad address '"+prefix.substr(0,slash)+"'");
+			const size_t max_len = addr.is_v4() ? 32 : 128;
+			size_t len = max_len;
+			if(slash != std::string::npos)
+			{
+				const auto len_str = prefix.substr(slash+1);
+				if(len_str.empty() || len_str.size() > 3 || !std::all_of(len_str.begin(),len_str.end(),[](char c){ return c >= '0' && c <= '9'; })
+					|| (len = std::stoul(len_str)) > max_len)
+					throw invalid("bad prefix length '"+len_str+"'");
+			}
+			parsed.push_back({addr,static_cast<uint8_t>(len),static_cast<uint32_t>(rules.size())});
+			rules.push_back({action == "allow" ? Action::ALLOW : Action::DENY,prefix});
+		}
+
+		//shortest first, so each one only has to overwrite what's already there
+		std::stable_sort(parsed.begin(),parsed.end(),[](const Parsed& a, const Parsed& b){ return a.len < b.len; });
+		for(const auto& p : parsed)
+		{
+			if(p.addr.is_v4())
+				v4.Insert(p.addr.to_v4().to_bytes().data(),p.len,p.rule);
+			else
+				v6.Insert(p.addr.to_v6().to_bytes().data(),p.len,p.rule);
+		}
+	}
+
+	bool Empty() const { return rules.empty(); }
+	const std::vector<Rule>& Rules() const { return rules; }
+
+	//The index of the rule with the longest prefix that matches, or NoRule
+	//	(IPv4-mapped IPv6 addresses are matched as IPv4)
+	size_t Match(const asio::ip::address& addr) const
+	{
+		if(addr.is_v4())
+			return v4.Lookup(addr.to_v4().to_bytes().data());
+		const auto v6_addr = addr.to_v6();
+		if(v6_addr.is_v4_mapped())
+			return v4.Lookup(asio::ip::make_address_v4(asio::ip::v4_mapped,v6_addr).to_bytes().data());
+		return v6.Lookup(v6_addr.to_bytes().data());
+	}
+	bool Denied(const size_t rule) const
+	{
+		return rule != NoRule && rules[rule].action == Action::DENY;
+	}
+
+private:
+	class Trie
+	{
+	public:
+		void Insert(const uint8_t* key, const size_t len, const uint32_t rule)
+		{
+			if(root.empty())
+				root.assign(RootSize,Empty);
+			const uint32_t val = rule+1;
+			if(len <= RootBits)
+			{
+				const size_t span = size_t(1) << (RootBits-len);
+				const size_t start = RootIndex(key) & ~(span-1);
+				for(size_t i=start; i<start+span; i++)
+					Fill(root[i],val);
+				return;
+			}
+			auto node = Child(InRoot,RootIndex(key));
+			size_t byte = RootBits/8, remaining = len-RootBits;
+			for(; remaining > 8; byte++, remaining -= 8)
+				node = Child(node,key[byte]);
+			const size_t span = size_t(1) << (8-remaining);
+			const size_t start = key[byte] & ~(span-1);
+			for(size_t i=start; i<start+span; i++)
+				Fill(nodes[node][i],val);
+		}
+		size_t Lookup(const uint8_t* key) const
+		{
+			if(root.empty())
+				return NoRule;
+			auto entry = root[RootIndex(key)];
+			for(size_t byte = RootBits/8; entry & ChildFlag; byte++)
+				entry = nodes[entry & ~ChildFlag][key[byte]];
+			return entry == Empty ? NoRule : entry-1;
+		}
+
+	private:
+		static constexpr size_t RootBits = 16;
+		static constexpr size_t RootSize = size_t(1) << RootBits;
+		static constexpr uint32_t Empty = 0;
+		static constexpr uint32_t ChildFlag = 0x80000000;
+		static constexpr uint32_t InRoot = std::numeric_limits<uint32_t>::max();
+
+		static size_t RootIndex(const uint8_t* key)
+		{
+			return (size_t(key[0]) << 8) | key[1];
+		}
+		//The node an entry (of the root, or of another node) points to - made if it doesn't already,
+		//	starting out with the entry's rule. By index, because making one can move the others
+		uint32_t Child(const uint32_t parent, const size_t i)
+		{
+			auto entry = parent == InRoot ? root[i] : nodes[parent][i];
+			if(entry & ChildFlag)
+				return entry & ~ChildFlag;
+			const auto index = static_cast<uint32_t>(nodes.size());
+			nodes.emplace_back().fill(entry);
+			(parent == InRoot ? root[i] : nodes[parent][i]) = ChildFlag|index;
+			return index;
+		}
+		void Fill(uint32_t& entry, const uint32_t val)
+		{
+			if(entry & ChildFlag)
+				for(auto& child_entry : nodes[entry & ~ChildFlag])
+					Fill(child_entry,val);
+			else
+				entry = val;
+		}
+
+		std::vector<uint32_t> root;
+		std::vector<std::array<uint32_t,256>> nodes;
+	};
+
+	std::vector<Rule> rules;
+	Trie v4;
+	Trie v6;
+};
+
+#endif // PREFIXACL_H
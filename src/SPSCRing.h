@@ -0,0 +1,95 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <vector>
+#include <cstddef>
+
+//A bounded, lock-free, single producer/single consumer FIFO
+//	exactly one thread may push, and exactly one (other) thread may pop
+//	The slots are allocated up front and items are moved in and out, so it never allocates after construction
+//	Each side caches the other's index, and only reloads it (one cache miss) when the ring looks full/empty
+template<typename T>
+class SPSCRing
+{
+public:
+	//capacity is rounded up to a power of 2
+	explicit SPSCRing(const size_t capacity):
+		mask(std::bit_ceil(std::max<size_t>(capacity,2))-1),
+		slots(mask+1)
+	{}
+	SPSCRing(const SPSCRing&) = delete;
+	SPSCRing& operator=(const SPSCRing&) = delete;
+
+	//(producer) returns false, and leaves item alone, if the ring is full
+	bool push(T&& item)
+	{
+		const auto tail = tail_idx.load(std::memory_order_relaxed);
+		if(tail - head_cache > mask)
+		{
+			head_cache = head_idx.load(std::memory_order_acquire);
+			if(tail - head_cache > mask)
+				return false;
+		}
+		slots[tail & mask] = std::move(item);
+		tail_idx.store(tail+1,std::memory_order_release);
+		return true;
+	}
+
+	//(consumer) returns false if the ring is empty
+	bool pop(T& item)
+	{
+		const auto head = head_idx.load(std::memory_order_relaxed);
+		if(head == tail_cache)
+		{
+			tail_cache = tail_idx.load(std::memory_order_acquire);
+			if(head == tail_cache)
+				return false;
+		}
+		item = std::move(slots[head & mask]);
+		head_idx.store(head+1,std::memory_order_release);
+		return true;
+	}
+
+	//Can be called from anywhere, but it's only a snapshot
+	size_t size() const
+	{
+		const auto head = head_idx.load(std::memory_order_acquire);
+		return tail_idx.load(std::memory_order_acquire) - head;
+	}
+	bool empty() const { return size() == 0; }
+	size_t capacity() const { return mask+1; }
+
+private:
+	static constexpr size_t CacheLine = 64;
+
+	const size_t mask;
+	std::vector<T> slots;
+	//consumer side
+	alignas(CacheLine) std::atomic<size_t> head_idx = 0;
+	size_t tail_cache = 0;
+	//producer side
+	alignas(CacheLine) std::atomic<size_t> tail_idx = 0;
+	size_t head_cache = 0;
+};
+
+#endif // SPSCRING_H
@@ -18,98 +18,317 @@
 #ifndef TIMEOUTCACHE_H
 #define TIMEOUTCACHE_H
 
-#include <asio.hpp>
-#include <unordered_map>
+#include "TimingWheel.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <chrono>
 #include <functional>
-#include <list>
 #include <limits>
+#include <vector>
+#include <cstdint>
 
-enum AddResult {REFRESHED,ADDED,DROPPED};
+//REJECTED: a new key that wasn't admitted (see Add())
+enum AddResult {REFRESHED,ADDED,DROPPED,REJECTED};
+//Admits every new key
+struct AdmitAll
+{
+	bool operator()() const { return true; }
+};
+//What to do with a new key when the cache is full: drop it, or evict the least recently refreshed key to make room
+enum class FullPolicy {DROP,LRU};
 
+//Keys that expire timeout_ms after they were last added
+//	the entries share a TimingWheel, so adding and refreshing are O(1) - a refresh only bumps the access time,
+//	and the wheel catches up with it when the original deadline comes round
+//	The keys are kept in a dense array (for fast iteration), indexed by an open addressing hash table.
+//	Removing one moves the last key into its place, so the order isn't kept - except for the first key:
+//	that's always the one that's been there the longest
+//	With the LRU full policy, the entries are also linked in the order they were refreshed, so the least recently
+//	refreshed one can be evicted in O(1)
 template <typename T>
-class TimeoutCache
+class TimeoutCache : private TimingWheel::Client
 {
 public:
-	TimeoutCache(asio::io_service::strand& Strand, const size_t timeout_ms, std::function<void(const T& key)> timeout_handler = [](const T&){}):
-		Strand(Strand),
+	TimeoutCache(TimingWheel& Wheel, const size_t timeout_ms, std::function<void(const T& key)> timeout_handler = [](const T&){}):
+		Wheel(Wheel),
 		timeout(timeout_ms),
 		timeout_handler(timeout_handler),
 		maxSize(std::numeric_limits<size_t>::max())
 	{}
+	//the wheel holds pointers to the entries
+	TimeoutCache(const TimeoutCache&) = delete;
+	TimeoutCache& operator=(const TimeoutCache&) = delete;
 	void Clear()
 	{
-		Cache.clear();
+		Entries.clear();
 		KeySequence.clear();
+		Newest = Empty;
+		LeastRecent = MostRecent = Empty;
+		std::fill(Table.begin(),Table.end(),Slot());
 	}
-	void SetMaxSize(const size_t max)
+	//evict_handler: (LRU policy) called for each key evicted to make room for a new one
+	void SetMaxSize(const size_t max, const FullPolicy policy = FullPolicy::DROP, std::function<void(const T& key)> evict_handler = [](const T&){})
 	{
 		maxSize = max;
+		lru = policy == FullPolicy::LRU;
+		this->evict_handler = evict_handler;
+	}
+	//index: if not null, set to where the key is in Keys() (unless it's DROPPED or REJECTED)
+	//admit: only called for a new key there's room for (before anything's evicted) - it's REJECTED if it returns false
+	template <typename Admit = AdmitAll>
+	AddResult Add(const T& key, size_t* index = nullptr, Admit admit = Admit())
+	{
+		return AddAt(key,std::chrono::steady_clock::now(),index,admit);
+	}
+	//Add a key that only has 'remaining' left before it expires (eg. from a snapshot) - an existing key is left alone
+	AddResult Restore(const T& key, const std::chrono::milliseconds remaining)
+	{
+		if(FindKey(key,Hash(key)) != NoSlot)
+			return AddResult::REFRESHED;
+		return AddAt(key,std::chrono::steady_clock::now()-timeout+std::min(remaining,timeout));
+	}
+	size_t Evictions() const { return evictions; }
+	size_t Drops() const { return drops; }
+	//Time left before Keys()[index] expires (if it isn't refreshed)
+	std::chrono::milliseconds Remaining(const size_t index) const
+	{
+		const auto left = Entries[index].AccessTime+timeout-std::chrono::steady_clock::now();
+		return std::max(std::chrono::duration_cast<std::chrono::milliseconds>(left),std::chrono::milliseconds::zero());
 	}
-	AddResult Add(const T& key)
+	const std::vector<T>& Keys() const
 	{
-		auto key_entry_it = Cache.find(key);
-		if(key_entry_it != Cache.end())
+		return KeySequence;
+	}
+
+private:
+	template <typename Admit = AdmitAll>
+	AddResult AddAt(const T& key, const std::chrono::steady_clock::time_point& access_time, size_t* index = nullptr, Admit admit = Admit())
+	{
+		const auto hash = Hash(key);
+		const auto slot = FindKey(key,hash);
+		if(slot != NoSlot)
 		{
 			//Just bump the access time of the existing entry and return
-			key_entry_it->second.AccessTime = std::chrono::steady_clock::now();
+			Entries[Table[slot].index].AccessTime = access_time;
+			if(lru)
+				MakeMostRecent(Table[slot].index);
+			if(index)
+				*index = Table[slot].index;
 			return AddResult::REFRESHED;
 		}
 
 		if(KeySequence.size() >= maxSize)
-			return AddResult::DROPPED;
+		{
+			if(!lru || KeySequence.empty())
+			{
+				drops++;
+				return AddResult::DROPPED;
+			}
+			if(!admit())
+				return AddResult::REJECTED;
+			const T evicted = KeySequence[LeastRecent];
+			Remove(LeastRecent);
+			evictions++;
+			evict_handler(evicted);
+		}
+		else if(!admit())
+			return AddResult::REJECTED;
 
 		//Add a new entry
-		KeySequence.emplace_back(key);
-		key_entry_it = Cache.insert({key,CacheEntry(Strand,timeout,--KeySequence.end())}).first;
-		key_entry_it->second.Timer.async_wait(Strand.wrap([this,key](asio::error_code err)
-		{
-			TimerHandler(key,err);
-		}));
+		if((KeySequence.size()+1)*2 > Table.size())
+			Rehash(std::max<size_t>(16,Table.size()*2));
+		const auto new_index = static_cast<uint32_t>(KeySequence.size());
+		KeySequence.push_back(key);
+		auto& entry = Entries.emplace_back(access_time,hash,Newest);
+		if(Newest != Empty)
+			Entries[Newest].newer = new_index;
+		Newest = new_index;
+		if(lru)
+			LinkMostRecent(new_index);
+		Insert(new_index,hash);
+		if(index)
+			*index = new_index;
+		Wheel.Schedule(entry,*this,entry.AccessTime+timeout);
 		return AddResult::ADDED;
 	}
-	const std::list<T>& Keys() const
-	{
-		return KeySequence;
-	}
 
-private:
-	void TimerHandler(const T& key, const asio::error_code& err)
+	struct CacheEntry : TimingWheel::Entry
 	{
-		if(err)
-			return;
+		CacheEntry(const std::chrono::steady_clock::time_point& AccessTime, const uint64_t hash, const uint32_t older):
+			AccessTime(AccessTime), hash(hash), older(older)
+		{}
+		std::chrono::time_point<std::chrono::steady_clock> AccessTime;
+		uint64_t hash;
+		//the order they were added in (indices of the neighbours)
+		uint32_t older;
+		uint32_t newer = Empty;
+		//(LRU policy) the order they were refreshed in
+		uint32_t lru_older = Empty;
+		uint32_t lru_newer = Empty;
+	};
+	//index into KeySequence/Entries, and some of the hash to check before comparing keys
+	struct Slot
+	{
+		uint32_t index = Empty;
+		uint32_t tag = 0;
+	};
+	static constexpr uint32_t Empty = std::numeric_limits<uint32_t>::max();
+	static constexpr size_t NoSlot = std::numeric_limits<size_t>::max();
 
-		auto now = std::chrono::steady_clock::now();
-		auto& entry = Cache.at(key);
-		auto time_to_expiry = (entry.AccessTime+timeout)-now;
-		if(time_to_expiry > std::chrono::steady_clock::duration::zero())
+	//(Fibonacci hashing - spreads out hashes that only differ in a few bits, like endpoint ports)
+	static uint64_t Hash(const T& key)
+	{
+		return static_cast<uint64_t>(std::hash<T>()(key))*0x9E3779B97F4A7C15ull;
+	}
+	size_t Home(const uint64_t hash) const
+	{
+		return static_cast<size_t>(hash >> shift);
+	}
+	size_t FindKey(const T& key, const uint64_t hash) const
+	{
+		if(Table.empty())
+			return NoSlot;
+		for(auto pos = Home(hash); Table[pos].index != Empty; pos = (pos+1) & (Table.size()-1))
+			if(Table[pos].tag == static_cast<uint32_t>(hash) && KeySequence[Table[pos].index] == key)
+				return pos;
+		return NoSlot;
+	}
+	size_t FindIndex(const size_t index) const
+	{
+		auto pos = Home(Entries[index].hash);
+		while(Table[pos].index != index)
+			pos = (pos+1) & (Table.size()-1);
+		return pos;
+	}
+	void Insert(const size_t index, const uint64_t hash)
+	{
+		auto pos = Home(hash);
+		while(Table[pos].index != Empty)
+			pos = (pos+1) & (Table.size()-1);
+		Table[pos] = {static_cast<uint32_t>(index),static_cast<uint32_t>(hash)};
+	}
+	void Rehash(const size_t size)
+	{
+		Table.assign(size,Slot());
+		shift = 64-std::countr_zero(size);
+		for(size_t i=0; i<Entries.size(); i++)
+			Insert(i,Entries[i].hash);
+	}
+	//Empty a slot, and shift back any following slots that would be unreachable otherwise (no tombstones)
+	void EraseSlot(size_t hole)
+	{
+		const auto mask = Table.size()-1;
+		for(auto pos = (hole+1) & mask; Table[pos].index != Empty; pos = (pos+1) & mask)
 		{
-			entry.Timer.expires_from_now(time_to_expiry);
-			entry.Timer.async_wait(Strand.wrap([this,key](asio::error_code err)
+			const auto home = Home(Entries[Table[pos].index].hash);
+			if(((pos-home) & mask) >= ((pos-hole) & mask))
 			{
-				TimerHandler(key,err);
-			}));
+				Table[hole] = Table[pos];
+				hole = pos;
+			}
+		}
+		Table[hole] = Slot();
+	}
+	void Move(const size_t from, const size_t to)
+	{
+		Table[FindIndex(from)].index = static_cast<uint32_t>(to);
+		KeySequence[to] = std::move(KeySequence[from]);
+		auto& entry = Entries[to] = std::move(Entries[from]);
+		if(entry.older != Empty)
+			Entries[entry.older].newer = static_cast<uint32_t>(to);
+		if(entry.newer != Empty)
+			Entries[entry.newer].older = static_cast<uint32_t>(to);
+		else
+			Newest = static_cast<uint32_t>(to);
+		if(lru)
+		{
+			(entry.lru_older != Empty ? Entries[entry.lru_older].lru_newer : LeastRecent) = static_cast<uint32_t>(to);
+			(entry.lru_newer != Empty ? Entries[entry.lru_newer].lru_older : MostRecent) = static_cast<uint32_t>(to);
+		}
+	}
+	void LinkMostRecent(const uint32_t index)
+	{
+		auto& entry = Entries[index];
+		entry.lru_older = MostRecent;
+		entry.lru_newer = Empty;
+		(MostRecent != Empty ? Entries[MostRecent].lru_newer : LeastRecent) = index;
+		MostRecent = index;
+	}
+	void UnlinkRecent(const uint32_t index)
+	{
+		auto& entry = Entries[index];
+		(entry.lru_newer != Empty ? Entries[entry.lru_newer].lru_older : MostRecent) = entry.lru_older;
+		(entry.lru_older != Empty ? Entries[entry.lru_older].lru_newer : LeastRecent) = entry.lru_newer;
+	}
+	void MakeMostRecent(const uint32_t index)
+	{
+		if(index == MostRecent)
 			return;
+		UnlinkRecent(index);
+		LinkMostRecent(index);
+	}
+	void Remove(const size_t index)
+	{
+		EraseSlot(FindIndex(index));
+		if(lru)
+			UnlinkRecent(static_cast<uint32_t>(index));
+		const auto& entry = Entries[index];
+		const auto next_oldest = entry.newer;
+		if(entry.older != Empty)
+			Entries[entry.older].newer = entry.newer;
+		if(entry.newer != Empty)
+			Entries[entry.newer].older = entry.older;
+		else
+			Newest = entry.older;
+
+		const auto last = KeySequence.size()-1;
+		if(index == 0 && last > 0)
+		{
+			//the first one has gone - the next oldest takes its place
+			const size_t oldest = next_oldest;
+			Move(oldest,0);
+			if(oldest != last)
+				Move(last,oldest);
 		}
-		KeySequence.erase(entry.KeySequenceIterator);
-		Cache.erase(key);
-		Strand.context().post([this,key]{timeout_handler(key);});
+		else if(index != last)
+			Move(last,index);
+		KeySequence.pop_back();
+		Entries.pop_back();
 	}
-	struct CacheEntry
+
+	//The wheel calls this for each entry whose deadline has passed, in a batch
+	void Due(TimingWheel::Entry& wheel_entry, const TimingWheel::Clock::time_point& now) override
 	{
-		CacheEntry(asio::io_service::strand& Strand, const std::chrono::milliseconds& timeout, const std::list<T>::iterator& it):
-			Timer(Strand.context(),timeout), AccessTime(std::chrono::steady_clock::now()), KeySequenceIterator(it)
-		{}
-		asio::steady_timer Timer;
-		std::chrono::time_point<std::chrono::steady_clock> AccessTime;
-		const std::list<T>::iterator KeySequenceIterator;
-	};
-	asio::io_service::strand& Strand;
+		auto& entry = static_cast<CacheEntry&>(wheel_entry);
+		const auto expiry = entry.AccessTime+timeout;
+		if(expiry > now)
+		{
+			//refreshed since it was scheduled
+			Wheel.Schedule(entry,*this,expiry);
+			return;
+		}
+		const auto index = static_cast<size_t>(&entry-Entries.data());
+		const T key = KeySequence[index];
+		Remove(index);
+		timeout_handler(key);
+	}
+
+	TimingWheel& Wheel;
 	const std::chrono::milliseconds timeout;
 	std::function<void(const T& key)> timeout_handler;
 	size_t maxSize;
-	std::unordered_map<T,CacheEntry> Cache;
-	std::list<T> KeySequence;
+	bool lru = false;
+	std::function<void(const T& key)> evict_handler;
+	std::atomic<size_t> evictions = 0;
+	std::atomic<size_t> drops = 0;
+	std::vector<T> KeySequence;
+	std::vector<CacheEntry> Entries; //(parallel to KeySequence)
+	std::vector<Slot> Table;
+	int shift = 64;
+	uint32_t Newest = Empty;
+	uint32_t LeastRecent = Empty; //(LRU policy)
+	uint32_t MostRecent = Empty;
 };
 
 #endif // TIMEOUTCACHE_H
@@ -0,0 +1,298 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include "PoolAllocator.h"
+#include <asio.hpp>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+
+//A hierarchical timing wheel: lots of deadlines, one asio timer
+//	Levels of Slots each - a level 0 slot is a tick, and each slot of the next level up spans a whole level below
+//	Scheduling is O(1) (an intrusive list insert), and an entry is only touched again when its slot comes round:
+//	then it's either due, or it drops to a finer level. Occupancy bitmaps find the next slot to process,
+//	so the timer only wakes up when there's something to do
+//	Not thread safe - everything happens on the strand
+class TimingWheel
+{
+public:
+	using Clock = std::chrono::steady_clock;
+	static constexpr size_t SlotBits = 6;
+	static constexpr size_t Slots = size_t(1) << SlotBits;
+	static constexpr size_t Levels = 4; //64^4 ticks - 4.6 hours at 1ms. Anything further out goes round again
+
+	class Entry;
+	//Owner of entries - told when they're due, all together, after the wheel has done its bookkeeping
+	//	it can Schedule() them again (eg. they've been refreshed since), or destroy them
+	class Client
+	{
+	public:
+		virtual void Due(Entry& entry, const Clock::time_point& now) = 0;
+	protected:
+		~Client() = default;
+	};
+
+private:
+	struct Link
+	{
+		Link* prev = nullptr;
+		Link* next = nullptr;
+	};
+
+public:
+	//Something with a deadline - derive from it. It unschedules itself when it's destroyed
+	//	and moving it takes over its place in the wheel (so entries can live in a vector)
+	class Entry : private Link
+	{
+	public:
+		Entry() = default;
+		Entry(const Entry&) = delete;
+		Entry& operator=(const Entry&) = delete;
+		Entry(Entry&& other) noexcept { TakeOver(other); }
+		Entry& operator=(Entry&& other) noexcept
+		{
+			if(this != &other)
+			{
+				Cancel();
+				TakeOver(other);
+			}
+			return *this;
+		}
+		~Entry() { Cancel(); }
+		bool Scheduled() const { return wheel != nullptr; }
+		void Cancel()
+		{
+			if(wheel)
+				wheel->Remove(*this);
+		}
+	private:
+		friend class TimingWheel;
+		void TakeOver(Entry& other)
+		{
+			if(!other.wheel)
+				return;
+			prev = other.prev;
+			next = other.next;
+			prev->next = this;
+			next->prev = this;
+			wheel = other.wheel;
+			client = other.client;
+			deadline = other.deadline;
+			list = other.list;
+			other.prev = other.next = nullptr;
+			other.wheel = nullptr;
+		}
+		TimingWheel* wheel = nullptr;
+		Client* client = nullptr;
+		uint64_t deadline = 0; //tick
+		size_t list = 0;       //slot it's in (or DueList)
+	};
+
+	TimingWheel(asio::io_context::strand& Strand, const Clock::duration resolution = std::chrono::milliseconds(1)):
+		Strand(Strand),
+		timer(Strand.context()),
+		resolution(resolution),
+		epoch(Clock::now())
+	{
+		for(auto& head : lists)
+			head.prev = head.next = &head;
+	}
+	TimingWheel(const TimingWheel&) = delete;
+	TimingWheel& operator=(const TimingWheel&) = delete;
+
+	//(Re)schedule an entry - the client's Due() gets called for it no earlier than deadline (and within a tick or so)
+	void Schedule(Entry& entry, Client& client, const Clock::time_point& deadline)
+	{
+		if(entry.wheel)
+			Remove(entry);
+		//an idle wheel hasn't been keeping up with the time
+		if(count == 0)
+			now_tick = std::max(now_tick,TickAt(Clock::now()));
+		entry.wheel = this;
+		entry.client = &client;
+		entry.deadline = TickFor(deadline);
+		count++;
+		Place(entry);
+		Arm();
+	}
+	size_t Size() const { return count; }
+
+	//Process everything due up to 'now' - the timer does this, but it can be driven directly (eg. benchmarks)
+	void Advance(const Clock::time_point& now)
+	{
+		const auto target = TickAt(now);
+		while(Occupied())
+		{
+			const auto next = NextEvent();
+			if(next > target)
+				break;
+			now_tick = next;
+			//coarse levels first - what drops down might be due at a finer level
+			for(size_t level = Levels; level-- > 0;)
+			{
+				const auto shift = SlotBits*level;
+				if(next & ((uint64_t(1) << shift)-1))
+					continue; //not a slot boundary at this level
+				const auto slot = (next >> shift) & (Slots-1);
+				if(occupied[level] & (uint64_t(1) << slot))
+					Cascade(level*Slots+slot);
+			}
+		}
+		now_tick = std::max(now_tick,target);
+
+		//the whole batch, now the wheel's consistent - clients can schedule and destroy entries as they go
+		auto& due = lists[DueList];
+		while(due.next != &due)
+		{
+			auto& entry = static_cast<Entry&>(*due.next);
+			auto& client = *entry.client;
+			Remove(entry);
+			client.Due(entry,now);
+		}
+	}
+
+private:
+	static constexpr size_t DueList = Levels*Slots;
+	static constexpr uint64_t NotArmed = std::numeric_limits<uint64_t>::max();
+
+	uint64_t TickAt(const Clock::time_point& t) const
+	{
+		return t > epoch ? (t-epoch)/resolution : 0;
+	}
+	//(rounded up - never early)
+	uint64_t TickFor(const Clock::time_point& t) const
+	{
+		return t > epoch ? ((t-epoch)+resolution-Clock::duration(1))/resolution : 0;
+	}
+
+	void LinkTo(Entry& entry, const size_t list)
+	{
+		auto& head = lists[list];
+		entry.list = list;
+		entry.prev = head.prev;
+		entry.next = &head;
+		head.prev->next = &entry;
+		head.prev = &entry;
+		if(list != DueList)
+			occupied[list/Slots] |= uint64_t(1) << (list%Slots);
+	}
+	void Unlink(Entry& entry)
+	{
+		entry.prev->next = entry.next;
+		entry.next->prev = entry.prev;
+		entry.prev = entry.next = nullptr;
+		const auto& head = lists[entry.list];
+		if(entry.list != DueList && head.next == &head)
+			occupied[entry.list/Slots] &= ~(uint64_t(1) << (entry.list%Slots));
+	}
+	void Remove(Entry& entry)
+	{
+		Unlink(entry);
+		entry.wheel = nullptr;
+		count--;
+	}
+
+	//Into the finest level slot whose span reaches the deadline
+	void Place(Entry& entry)
+	{
+		const auto tick = std::max(entry.deadline,now_tick+1);
+		const auto delta = tick-now_tick;
+		size_t level = 0;
+		while(level+1 < Levels && delta >> SlotBits*(level+1))
+			level++;
+		//beyond the top level: park it in the furthest slot, and it'll go round again
+		constexpr auto span = uint64_t(1) << SlotBits*Levels;
+		const auto placed = delta < span ? tick : now_tick+span-1;
+		LinkTo(entry,level*Slots+((placed >> SlotBits*level) & (Slots-1)));
+	}
+
+	//A slot's time has come: what's due goes on the due list, the rest drops down a level (or more)
+	void Cascade(const size_t list)
+	{
+		auto& head = lists[list];
+		while(head.next != &head)
+		{
+			auto& entry = static_cast<Entry&>(*head.next);
+			Unlink(entry);
+			if(entry.deadline <= now_tick)
+				LinkTo(entry,DueList);
+			else
+				Place(entry);
+		}
+	}
+
+	bool Occupied() const
+	{
+		for(const auto bits : occupied)
+			if(bits)
+				return true;
+		return false;
+	}
+	//The first tick (after now) with an occupied slot to process, at any level
+	uint64_t NextEvent() const
+	{
+		auto next = NotArmed;
+		for(size_t level = 0; level < Levels; level++)
+		{
+			if(!occupied[level])
+				continue;
+			const auto shift = SlotBits*level;
+			const auto window = now_tick >> shift;
+			//slots for the next Slots windows, starting with the next one
+			const auto rotated = std::rotr(occupied[level],static_cast<int>((window+1) & (Slots-1)));
+			const auto ahead = uint64_t(std::countr_zero(rotated))+1;
+			next = std::min(next,(window+ahead) << shift);
+		}
+		return next;
+	}
+
+	//Make sure the timer goes off in time for the next event
+	void Arm()
+	{
+		const auto next = NextEvent();
+		if(next == NotArmed || (armed_tick != NotArmed && next >= armed_tick))
+			return;
+		armed_tick = next;
+		timer.expires_at(epoch+next*resolution);
+		timer.async_wait(asio::bind_executor(Strand,Pooled([this](asio::error_code err)
+		{
+			if(err)
+				return;
+			armed_tick = NotArmed;
+			Advance(Clock::now());
+			Arm();
+		})));
+	}
+
+	asio::io_context::strand& Strand;
+	asio::steady_timer timer;
+	const Clock::duration resolution;
+	const Clock::time_point epoch;
+	uint64_t now_tick = 0;    //everything due up to this tick has been processed
+	uint64_t armed_tick = NotArmed;
+	size_t count = 0;
+	std::array<Link,Levels*Slots+1> lists; //slots by level, then the due list
+	std::array<uint64_t,Levels> occupied = {};
+};
+
+#endif // TIMINGWHEEL_H
@@ -44,6 +44,14 @@
 #include <array>
 #include <format>
 #include <atomic>
+#include <algorithm>
+
+// x86-64 JIT (see jit_enable()) - where there's mmap, unless TINYRISCV64_NO_JIT is defined
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)) && !defined(TINYRISCV64_NO_JIT)
+#define TINYRISCV64_JIT 1
+#include <sys/mman.h>
+#include <cstddef>
+#endif
 
 namespace TinyRISCV64
 {
@@ -63,9 +71,10 @@ protected:
 	u64 pc;                         // Program counter
 	u32 inst;                       // Current instruction
 	std::vector<u8> program;        // Program memory
-	std::array<u64,32> x{};         // Registers x0-x31
+	std::array<u64,33> x{};         // Registers x0-x31 (and x32: where pre-decoded writes to x0 go)
 	std::vector<u8> stack;          // Stack memory
 	std::span<u8> data;             // Data memory
+	std::span<u8> shared;           // Shared state memory (see map_shared_mem())
 	std::atomic_bool halted{false}; // Program exited or externally halted
 	const size_t max_prog_size;     // Maximum allowed program image size (bytes)
 
@@ -74,6 +83,9 @@ protected:
 	u64 p_beg = 0;   // Program mem begin
 	u64 p_end;       // Program mem end
 							/* 64 overflow detection addresses */
+	u64 sh_beg;      // Shared mem begin
+	u64 sh_end;      // Shared mem end
+							/* 64 overflow detection addresses (if there's shared mem) */
 	u64 d_beg;       // Data mem begin
 	u64 d_end;       // Data mem end
 							/* 64 overflow detection addresses */
@@ -90,6 +102,7 @@ public:
 	{
 		program = load_program(prog_filename, max_prog_size);
 		reset();
+		decode_program();
 		return p_beg;
 	}
 
@@ -102,9 +115,23 @@ public:
 		program.resize(prog_size);
 		std::memcpy(program.data(), prog, prog_size);
 		reset();
+		decode_program();
 		return p_beg;
 	}
 
+	// Load the same program (and JIT/verification settings, and shared state mapping) as another VM - eg. to run it
+	//   on another thread. Its program memory is a copy - only the shared state is shared
+	//   resets state and invalidates previous virtual addrs
+	u64 program_load(const VM& other)
+	{
+		verify_enabled = other.verify_enabled;
+	#ifdef TINYRISCV64_JIT
+		jit_enabled = other.jit_enabled;
+	#endif
+		shared = other.shared;
+		return program_load(other.program.data(), other.program.size());
+	}
+
 	// Map virtual addresses to the referenced data
 	//   resets state and invalidates previous virtual addrs
 	u64 map_data_mem(u8* const mem, const size_t mem_size)
@@ -114,6 +141,21 @@ public:
 		return d_beg;
 	}
 
+	// Map virtual addresses to memory for state that outlives a run, and that can be mapped into more than one VM
+	//   (program memory is private to each VM - see program_stores()). Its virtual address doesn't depend on the
+	//   data mapped, so it stays the same between runs
+	//   Concurrency: VMs on different threads can run with the same shared memory. Each aligned load or store of
+	//   up to 8 bytes is one host access (so atomic - it never sees half of another VM's store), but there's no
+	//   ordering between them, and no read-modify-write (there's no A extension). So keep each record in one aligned
+	//   word, and design for last-writer-wins
+	//   resets state and invalidates previous virtual addrs
+	u64 map_shared_mem(u8* const mem, const size_t mem_size)
+	{
+		shared = {mem,mem_size};
+		reset();
+		return sh_beg;
+	}
+
 	// Set register value (x0-x31, x0 is always 0)
 	void register_set(const size_t reg, const u64 value)
 	{
@@ -153,30 +195,124 @@ public:
 	}
 
 	// Execute program
+	//   runs the pre-decoded micro-ops (see decode_program()) - an external halt is noticed at the next jump
+	//   (unless the program's verified, and the run can't go on for long anyway - see verify())
 	void execute_program(const u64 entry_point = p_beg, const size_t max_instructions = 100000)
 	{
 		const auto prog_sz = program.size();
-		const auto sentinel_pc = ((prog_sz + 3) & ~3ull);
 
 		pc = entry_point;
 		halted = false;
-		size_t count = 0;
 
 		if(prog_sz < 4)
 			throw std::runtime_error("Program too small (must be at least 4 bytes)");
+		if (ops.size() != ((prog_sz + 3) & ~3ull)/4 + 1) [[unlikely]] // (program changed without a load)
+			decode_program();
+
+	#ifdef TINYRISCV64_JIT
+		if (jit_stale) [[unlikely]]
+			jit_compile();
+		if (jit_code.entry() && !(entry_point & 3) && entry_point/4 < jit_table.size())
+			return run_jit(entry_point/4, max_instructions);
+	#endif
+		if (verified_entry(entry_point, max_instructions))
+			run_decoded<true>(fast_ops.data(), max_instructions);
+		else if (const auto op = target_op(pc)) [[likely]]
+			run_decoded(op, max_instructions);
+		else
+			run_stepwise(max_instructions);
+	}
 
-		while (!halted)
-		{
-			if (pc > prog_sz-4) [[unlikely]]
-				throw std::runtime_error("PC jumped program region");
-			if (++count > max_instructions) [[unlikely]]
-				throw std::runtime_error("Maximum instruction count exceeded");
+	// Translate programs to native code when they're loaded (and from now on, if one already is), instead
+	//   of interpreting them (see jit_compile()). Anything that isn't translated still runs in the interpreter
+	//   returns false if it's enabled where there's no JIT (not x86-64, or TINYRISCV64_NO_JIT)
+	bool jit_enable(const bool enable = true)
+	{
+	#ifdef TINYRISCV64_JIT
+		jit_enabled = enable;
+		jit_compiles = 0;
+		jit_compile();
+		return true;
+	#else
+		return !enable;
+	#endif
+	}
 
-			execute_instruction();
+	// Whether the loaded program is running as native code
+	bool jit_active() const
+	{
+	#ifdef TINYRISCV64_JIT
+		return jit_code.entry() != nullptr;
+	#else
+		return false;
+	#endif
+	}
 
-			if(pc == sentinel_pc) [[unlikely]]
-				halted = true;
+	// Verify programs when they're loaded (the default), so the ones it can prove are safe run without the
+	//   instruction budget or bounds checks (see verify())
+	void verify_enable(const bool enable = true)
+	{
+		verify_enabled = enable;
+		verify();
+	}
+
+	// Whether the loaded program passed verification - and if not, why
+	bool verified() const { return !fast_ops.empty(); }
+	const std::string& verify_error() const { return verify_err; }
+
+	// Whether the loaded program might store into its own memory - only a verified program is known not to.
+	//   If it does, it can't be run on more than one VM and still see all its state (see map_shared_mem())
+	bool program_stores() const { return fast_ops.empty() || verify_prog_stores; }
+
+	// Whether the loaded program might read a register's value from before it started - eg. an argument it takes,
+	//   to tell if it uses it at all. Follows every path from the start (a call carries on after the JAL), so it's
+	//   only false if there's no way to get to a read of the register before a write to it
+	bool program_reads_entry(const u8 reg) const
+	{
+		std::vector<bool> seen(ops.size(), false);
+		std::vector<size_t> todo = {0};
+		while (!todo.empty())
+		{
+			const auto i = todo.back();
+			todo.pop_back();
+			if (i >= ops.size() || seen[i])
+				continue;
+			seen[i] = true;
+			const auto& op = ops[i];
+			const auto code = op.code;
+			if (code == BAD_PC || code == SENTINEL)
+				continue;
+			const bool reads_rs1 = code == JALR || (code >= BEQ && code <= SD) || (code >= ADDI && code <= REMUW);
+			const bool reads_rs2 = (code >= BEQ && code <= BGEU) || (code >= SB && code <= SD) || (code >= ADD && code <= REMUW);
+			if ((reads_rs1 && op.rs1 == reg) || (reads_rs2 && op.rs2 == reg))
+				return true;
+			const bool writes = code == LI || code == JAL || code == JALR || (code >= LB && code <= LWU) || (code >= ADDI && code <= REMUW);
+			if (writes && op.rd == reg)
+				continue;
+			if (code == JALR)
+				continue;
+			if (code == JAL || (code >= BEQ && code <= BGEU))
+			{
+				if (op.target != NoTarget)
+					todo.push_back(op.target);
+				if (code == JAL && op.rd == ZeroSink)
+					continue;
+			}
+			todo.push_back(i+1);
 		}
+		return false;
+	}
+
+	// Execute program one instruction at a time, decoding each as it goes (the reference for the pre-decoded version)
+	void execute_program_stepwise(const u64 entry_point = p_beg, const size_t max_instructions = 100000)
+	{
+		pc = entry_point;
+		halted = false;
+
+		if(program.size() < 4)
+			throw std::runtime_error("Program too small (must be at least 4 bytes)");
+
+		run_stepwise(max_instructions);
 	}
 
 	// Halt the program (if it's running)
@@ -192,18 +328,22 @@ public:
 		for(auto& xn : x) xn=0;
 		//x1 - return address (ra)
 		x[1] = (program.size() + 3) & ~3ull;
-		//x2 - stack pointer (sp)
-		x[2] = program.size()+64+data.size()+64+stack.size();
-		//x8 - frame pointer (s0 / fp)
-		x[8] = x[2];
 
 		p_end = program.size();
 		/* 64 overflow detection addresses */
-		d_beg = program.size()+64;
-		d_end = program.size()+64+data.size();
+		sh_beg = p_end+64;
+		sh_end = sh_beg+shared.size();
+		/* 64 overflow detection addresses (if there's shared mem) */
+		d_beg = shared.empty() ? p_end+64 : sh_end+64;
+		d_end = d_beg+data.size();
 		/* 64 overflow detection addresses */
-		s_beg = program.size()+64+data.size()+64;
-		s_end = program.size()+64+data.size()+64+stack.size();
+		s_beg = d_end+64;
+		s_end = s_beg+stack.size();
+
+		//x2 - stack pointer (sp)
+		x[2] = s_end;
+		//x8 - frame pointer (s0 / fp)
+		x[8] = x[2];
 	}
 
 protected:
@@ -226,24 +366,1472 @@ protected:
 	}
 
 	// Instruction Decoding
-	inline u8 opcode() const { return inst & 0x7f; }
-	inline u8 funct3() const { return (inst >> 12) & 0x7; }
-	inline u8 funct7() const { return (inst >> 25) & 0x7f; }
-	inline u8 rd() const { return (inst >> 7) & 0x1f; }
-	inline u8 rs1() const { return (inst >> 15) & 0x1f; }
-	inline u8 rs2() const { return (inst >> 20) & 0x1f; }
-	inline i64 imm_i() const { return static_cast<i64>(static_cast<i32>(inst) >> 20); }
-	inline i64 imm_s() const { return (imm_i() & ~0x1fLL) | rd(); }
-	inline i64 imm_b() const {
+	static inline u8 opcode(const u32 inst) { return inst & 0x7f; }
+	static inline u8 funct3(const u32 inst) { return (inst >> 12) & 0x7; }
+	static inline u8 funct7(const u32 inst) { return (inst >> 25) & 0x7f; }
+	static inline u8 rd(const u32 inst) { return (inst >> 7) & 0x1f; }
+	static inline u8 rs1(const u32 inst) { return (inst >> 15) & 0x1f; }
+	static inline u8 rs2(const u32 inst) { return (inst >> 20) & 0x1f; }
+	static inline i64 imm_i(const u32 inst) { return static_cast<i64>(static_cast<i32>(inst) >> 20); }
+	static inline i64 imm_s(const u32 inst) { return (imm_i(inst) & ~0x1fLL) | rd(inst); }
+	static inline i64 imm_b(const u32 inst) {
 	    return (static_cast<i64>(static_cast<i32>(inst & 0x80000000)) >> 19) |
 		     ((inst & 0x80) << 4) | ((inst >> 20) & 0x7e0) | ((inst >> 7) & 0x1e);
 	}
-	inline i64 imm_j() const {
+	static inline i64 imm_j(const u32 inst) {
 	    return (static_cast<i64>(static_cast<i32>(inst & 0x80000000)) >> 11) |
 		     (inst & 0xff000) | ((inst >> 9) & 0x800) | ((inst >> 20) & 0x7fe);
 	}
-	inline u64 imm_u() const { return static_cast<u64>(static_cast<i64>(static_cast<i32>(inst & 0xfffff000))); }
+	static inline u64 imm_u(const u32 inst) { return static_cast<u64>(static_cast<i64>(static_cast<i32>(inst & 0xfffff000))); }
+	inline u8 opcode() const { return opcode(inst); }
+	inline u8 funct3() const { return funct3(inst); }
+	inline u8 funct7() const { return funct7(inst); }
+	inline u8 rd() const { return rd(inst); }
+	inline u8 rs1() const { return rs1(inst); }
+	inline u8 rs2() const { return rs2(inst); }
+	inline i64 imm_i() const { return imm_i(inst); }
+	inline i64 imm_s() const { return imm_s(inst); }
+	inline i64 imm_b() const { return imm_b(inst); }
+	inline i64 imm_j() const { return imm_j(inst); }
+	inline u64 imm_u() const { return imm_u(inst); }
+
+
+	// Pre-decoded execution
+	//   program_load() decodes each 4 byte word of the program once, into a micro-op with the operation resolved
+	//   (from opcode/funct3/funct7), register indices extracted, and the immediate sign-extended and pre-computed
+	//   (pc relative values and branch targets resolved to absolute). The run loop then dispatches straight
+	//   from one micro-op to the next - with computed goto (threaded) where the compiler supports it
+	//   (otherwise, or if TINYRISCV64_NO_THREADED_DISPATCH is defined, a switch in a loop).
+	//   Words that aren't instructions (data) just decode to something that's never run, and stores into the
+	//   program region re-decode the words they touch. SYSTEM, and anything that isn't valid, goes the slow
+	//   way (execute_instruction()) - so it behaves (and fails) exactly like it did.
+	//   (the V* loads and stores are only in a verified program's copy of the micro-ops - see verify())
+	#define TINYRISCV64_OPS(X) \
+		X(LI) X(JAL) X(JALR) X(BEQ) X(BNE) X(BLT) X(BGE) X(BLTU) X(BGEU) \
+		X(LB) X(LH) X(LW) X(LD) X(LBU) X(LHU) X(LWU) X(SB) X(SH) X(SW) X(SD) \
+		X(VLB) X(VLH) X(VLW) X(VLD) X(VLBU) X(VLHU) X(VLWU) X(VSB) X(VSH) X(VSW) X(VSD) \
+		X(ADDI) X(SLLI) X(SLTI) X(SLTIU) X(XORI) X(SRLI) X(SRAI) X(ORI) X(ANDI) \
+		X(ADDIW) X(SLLIW) X(SRLIW) X(SRAIW) \
+		X(ADD) X(SUB) X(SLL) X(SLT) X(SLTU) X(XOR) X(SRL) X(SRA) X(OR) X(AND) \
+		X(MUL) X(MULH) X(MULHSU) X(MULHU) X(DIV) X(DIVU) X(REM) X(REMU) \
+		X(ADDW) X(SUBW) X(SLLW) X(SRLW) X(SRAW) X(MULW) X(DIVW) X(DIVUW) X(REMW) X(REMUW) \
+		X(NOP) X(SLOW) X(BAD_PC) X(SENTINEL)
+	#define TINYRISCV64_OP_ENUM(name) name,
+	enum Op : u8 { TINYRISCV64_OPS(TINYRISCV64_OP_ENUM) };
+	#undef TINYRISCV64_OP_ENUM
+
+	struct MicroOp
+	{
+		u8 code = BAD_PC;
+		u8 rd = 0;          // (writes to x0 go to x32 instead - so no need to keep x0 zero)
+		u8 rs1 = 0;
+		u8 rs2 = 0;
+		u32 target = 0;     // branch/JAL: index of the target micro-op (NoTarget if it isn't one), V*: which of verify_delta to add
+		i64 imm = 0;        // LUI/AUIPC: the value, branch/JAL: the target address, shifts: the shift amount
+		bool operator==(const MicroOp&) const = default;
+	};
+	static constexpr u8 ZeroSink = 32;
+	static constexpr u32 NoTarget = 0xFFFFFFFF;
+
+	// One per whole word of the program, then one for the return sentinel (an extra for a part word: BAD_PC)
+	std::vector<MicroOp> ops;
+
+	void decode_program()
+	{
+		ops.assign(((program.size() + 3) & ~3ull)/4 + 1, MicroOp{});
+		for (size_t i = 0; i < program.size()/4; i++)
+			ops[i] = decode(i*4);
+		ops.back().code = SENTINEL;
+		verify();
+	#ifdef TINYRISCV64_JIT
+		jit_compiles = 0;
+		jit_compile();
+	#endif
+	}
 
+	// The words of a store into the program region
+	void redecode(const u64 addr, const size_t size)
+	{
+		for (u64 i = addr/4; i <= (addr + size - 1)/4 && i < program.size()/4; i++)
+		{
+			const auto op = decode(i*4);
+		#ifdef TINYRISCV64_JIT
+			// (self modifying code - the native version of it is out of date)
+			if (i < jit_translated.size() && jit_translated[i] && !(op == ops[i]))
+				jit_stale = true;
+		#endif
+			// (and it was only verified as it was loaded)
+			if (i < verify_code.size() && verify_code[i] && !(op == ops[i]))
+			{
+				fast_ops.clear();
+				verify_code.clear();
+				verify_err = "the program modified its own instructions";
+			}
+			ops[i] = op;
+		}
+	}
+
+	MicroOp decode(const u64 at) const
+	{
+		u32 inst;
+		memcpy(&inst,&program[at],4);
+		MicroOp op;
+		op.code = SLOW;
+		op.rd = rd(inst) ? rd(inst) : ZeroSink;
+		op.rs1 = rs1(inst);
+		op.rs2 = rs2(inst);
+		const auto target = [this,at](const i64 offset)
+		{
+			const u64 t = at + offset;
+			return ((t & 3) || t/4 >= ops.size()) ? NoTarget : static_cast<u32>(t/4);
+		};
+		static constexpr u8 load_ops[] = {LB,LH,LW,LD,LBU,LHU,LWU};
+		static constexpr u8 store_ops[] = {SB,SH,SW,SD};
+		static constexpr u8 branch_ops[] = {BEQ,BNE,SLOW,SLOW,BLT,BGE,BLTU,BGEU};
+		static constexpr u8 alu_imm_ops[] = {ADDI,SLLI,SLTI,SLTIU,XORI,SRLI,ORI,ANDI};
+		const auto f3 = funct3(inst);
+		const auto f7 = funct7(inst);
+
+		switch (opcode(inst))
+		{
+			case 0x37: op.code = LI; op.imm = imm_u(inst); break;                      // LUI
+			case 0x17: op.code = LI; op.imm = at + imm_u(inst); break;                 // AUIPC
+			case 0x6f: op.code = JAL; op.imm = at + imm_j(inst); op.target = target(imm_j(inst)); break;
+			case 0x67: op.code = JALR; op.imm = imm_i(inst); break;
+			case 0x63: op.code = branch_ops[f3]; op.imm = at + imm_b(inst); op.target = target(imm_b(inst)); break;
+			case 0x03: if (f3 < 7) { op.code = load_ops[f3]; op.imm = imm_i(inst); } break;
+			case 0x23: if (f3 < 4) { op.code = store_ops[f3]; op.imm = imm_s(inst); } break;
+			case 0x13:
+				op.code = alu_imm_ops[f3];
+				op.imm = imm_i(inst);
+				if (f3 == 1 || f3 == 5)
+				{
+					if (f3 == 5 && (op.imm & 0x400)) op.code = SRAI;
+					op.imm &= 0x3f;
+				}
+				break;
+			case 0x1b:
+				op.imm = imm_i(inst);
+				if (f3 == 0) op.code = ADDIW;
+				else if (f3 == 1) { op.code = SLLIW; op.imm &= 0x1f; }
+				else if (f3 == 5) { op.code = (op.imm & 0x400) ? SRAIW : SRLIW; op.imm &= 0x1f; }
+				break;
+			case 0x33:
+				switch (f7 << 3 | f3)
+				{
+					case 0x000: op.code = ADD; break;
+					case 0x100: op.code = SUB; break;
+					case 0x001: op.code = SLL; break;
+					case 0x002: op.code = SLT; break;
+					case 0x003: op.code = SLTU; break;
+					case 0x004: op.code = XOR; break;
+					case 0x005: op.code = SRL; break;
+					case 0x105: op.code = SRA; break;
+					case 0x006: op.code = OR; break;
+					case 0x007: op.code = AND; break;
+					case 0x008: op.code = MUL; break;
+					case 0x009: op.code = MULH; break;
+					case 0x00a: op.code = MULHSU; break;
+					case 0x00b: op.code = MULHU; break;
+					case 0x00c: op.code = DIV; break;
+					case 0x00d: op.code = DIVU; break;
+					case 0x00e: op.code = REM; break;
+					case 0x00f: op.code = REMU; break;
+				}
+				break;
+			case 0x3b:
+				switch (f7 << 3 | f3)
+				{
+					case 0x000: op.code = ADDW; break;
+					case 0x100: op.code = SUBW; break;
+					case 0x001: op.code = SLLW; break;
+					case 0x005: op.code = SRLW; break;
+					case 0x105: op.code = SRAW; break;
+					case 0x008: op.code = MULW; break;
+					case 0x00c: op.code = DIVW; break;
+					case 0x00d: op.code = DIVUW; break;
+					case 0x00e: op.code = REMW; break;
+					case 0x00f: op.code = REMUW; break;
+				}
+				break;
+			case 0x0f: op.code = NOP; break; // FENCE
+		}
+		return op;
+	}
+
+	// The micro-op for a jump target - or nullptr if it isn't a whole word in the program (or the return)
+	const MicroOp* target_op(const u64 target) const
+	{
+		if ((target & 3) || target/4 >= ops.size() || ops[target/4].code == BAD_PC) [[unlikely]]
+			return nullptr;
+		return &ops[target/4];
+	}
+
+	// From pc, one instruction at a time
+	//   (also where the pre-decoded run goes for a jump that isn't to a micro-op - it fails the same way, or runs
+	//   whatever's at a half word aligned address, like it always has)
+	void run_stepwise(size_t budget)
+	{
+		const auto prog_sz = program.size();
+		const auto sentinel_pc = ((prog_sz + 3) & ~3ull);
+
+		while (!halted)
+		{
+			if (pc > prog_sz-4) [[unlikely]]
+				throw std::runtime_error("PC jumped program region");
+			if (budget-- == 0) [[unlikely]]
+				throw std::runtime_error("Maximum instruction count exceeded");
+
+			execute_instruction();
+
+			if(pc == sentinel_pc) [[unlikely]]
+				halted = true;
+		}
+	}
+
+	template<typename T>
+	inline void store(const u64 addr, const u64 value)
+	{
+		mem_store<T>(addr, static_cast<T>(value));
+		if (addr < p_end) [[unlikely]]
+			redecode(addr, sizeof(T));
+	}
+
+	// (verified loads and stores - the host address is already known to be in bounds)
+	template<typename T>
+	static inline T host_load(const u64 host)
+	{
+		T value;
+		memcpy(&value, reinterpret_cast<const u8*>(static_cast<uintptr_t>(host)), sizeof(T));
+		return value;
+	}
+	template<typename T>
+	static inline void host_store(const u64 host, const u64 value)
+	{
+		const auto v = static_cast<T>(value);
+		memcpy(reinterpret_cast<u8*>(static_cast<uintptr_t>(host)), &v, sizeof(T));
+	}
+
+	static inline u64 sext32(const u32 v) { return static_cast<u64>(static_cast<i64>(static_cast<i32>(v))); }
+
+	// (GCC would otherwise merge the handlers' identical dispatch tails, and undo the threading)
+	//   Verified: running fast_ops (see verify()) - no budget, and nothing that could fail is left to check
+	template<bool Verified = false>
+	#if defined(__GNUC__) && !defined(__clang__)
+	__attribute__((optimize("no-crossjumping")))
+	#endif
+	void run_decoded(const MicroOp* op, size_t budget)
+	{
+		const MicroOp* const base = Verified ? fast_ops.data() : ops.data();
+		const u64* const delta = verify_delta.data();
+		auto& r = x;
+		#define TINYRISCV64_PC (static_cast<u64>(op - base) * 4)
+		#define TINYRISCV64_TAKE(t) { \
+				if constexpr (!Verified) { if ((t) == NoTarget) [[unlikely]] { pc = op->imm; goto stepwise; } } \
+				op = base + (t); \
+				if constexpr (!Verified) { if (halted.load(std::memory_order_relaxed)) [[unlikely]] goto halt; } \
+				TINYRISCV64_NEXT; \
+			}
+		#define TINYRISCV64_BRANCH(cond) if (cond) TINYRISCV64_TAKE(op->target); ++op; TINYRISCV64_NEXT
+
+	#if defined(__GNUC__) && !defined(TINYRISCV64_NO_THREADED_DISPATCH)
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wpedantic"
+		#define TINYRISCV64_LABEL(name) &&L_##name,
+		static const void* const dispatch[] = { TINYRISCV64_OPS(TINYRISCV64_LABEL) };
+		#undef TINYRISCV64_LABEL
+		#define TINYRISCV64_OP(name) L_##name:
+		#define TINYRISCV64_NEXT do { if constexpr (!Verified) { if (budget-- == 0) [[unlikely]] goto out_of_budget; } goto *dispatch[op->code]; } while(0)
+		TINYRISCV64_NEXT;
+		{
+	#else
+		#define TINYRISCV64_OP(name) case name:
+		#define TINYRISCV64_NEXT continue
+		for (;;)
+		{
+			if constexpr (!Verified)
+				if (budget-- == 0) [[unlikely]]
+					goto out_of_budget;
+			switch (op->code)
+			{
+	#endif
+			TINYRISCV64_OP(LI) r[op->rd] = op->imm; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(JAL) r[op->rd] = TINYRISCV64_PC + 4; TINYRISCV64_TAKE(op->target);
+			TINYRISCV64_OP(JALR)
+			{
+				const u64 target = (r[op->rs1] + op->imm) & ~1ULL;
+				r[op->rd] = TINYRISCV64_PC + 4;
+				if constexpr (Verified)
+					op = base + target/4;
+				else
+				{
+					op = target_op(target);
+					if (!op) [[unlikely]] { pc = target; goto stepwise; }
+					if (halted.load(std::memory_order_relaxed)) [[unlikely]] goto halt;
+				}
+				TINYRISCV64_NEXT;
+			}
+			TINYRISCV64_OP(BEQ) TINYRISCV64_BRANCH(r[op->rs1] == r[op->rs2]);
+			TINYRISCV64_OP(BNE) TINYRISCV64_BRANCH(r[op->rs1] != r[op->rs2]);
+			TINYRISCV64_OP(BLT) TINYRISCV64_BRANCH(static_cast<i64>(r[op->rs1]) < static_cast<i64>(r[op->rs2]));
+			TINYRISCV64_OP(BGE) TINYRISCV64_BRANCH(static_cast<i64>(r[op->rs1]) >= static_cast<i64>(r[op->rs2]));
+			TINYRISCV64_OP(BLTU) TINYRISCV64_BRANCH(r[op->rs1] < r[op->rs2]);
+			TINYRISCV64_OP(BGEU) TINYRISCV64_BRANCH(r[op->rs1] >= r[op->rs2]);
+
+			TINYRISCV64_OP(LB) r[op->rd] = static_cast<i64>(mem_load<i8>(r[op->rs1] + op->imm)); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(LH) r[op->rd] = static_cast<i64>(mem_load<i16>(r[op->rs1] + op->imm)); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(LW) r[op->rd] = static_cast<i64>(mem_load<i32>(r[op->rs1] + op->imm)); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(LD) r[op->rd] = mem_load<u64>(r[op->rs1] + op->imm); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(LBU) r[op->rd] = mem_load<u8>(r[op->rs1] + op->imm); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(LHU) r[op->rd] = mem_load<u16>(r[op->rs1] + op->imm); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(LWU) r[op->rd] = mem_load<u32>(r[op->rs1] + op->imm); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SB) store<u8>(r[op->rs1] + op->imm, r[op->rs2]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SH) store<u16>(r[op->rs1] + op->imm, r[op->rs2]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SW) store<u32>(r[op->rs1] + op->imm, r[op->rs2]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SD) store<u64>(r[op->rs1] + op->imm, r[op->rs2]); ++op; TINYRISCV64_NEXT;
+
+			TINYRISCV64_OP(VLB) r[op->rd] = static_cast<i64>(host_load<i8>(r[op->rs1] + op->imm + delta[op->target])); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(VLH) r[op->rd] = static_cast<i64>(host_load<i16>(r[op->rs1] + op->imm + delta[op->target])); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(VLW) r[op->rd] = static_cast<i64>(host_load<i32>(r[op->rs1] + op->imm + delta[op->target])); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(VLD) r[op->rd] = host_load<u64>(r[op->rs1] + op->imm + delta[op->target]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(VLBU) r[op->rd] = host_load<u8>(r[op->rs1] + op->imm + delta[op->target]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(VLHU) r[op->rd] = host_load<u16>(r[op->rs1] + op->imm + delta[op->target]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(VLWU) r[op->rd] = host_load<u32>(r[op->rs1] + op->imm + delta[op->target]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(VSB) host_store<u8>(r[op->rs1] + op->imm + delta[op->target], r[op->rs2]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(VSH) host_store<u16>(r[op->rs1] + op->imm + delta[op->target], r[op->rs2]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(VSW) host_store<u32>(r[op->rs1] + op->imm + delta[op->target], r[op->rs2]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(VSD) host_store<u64>(r[op->rs1] + op->imm + delta[op->target], r[op->rs2]); ++op; TINYRISCV64_NEXT;
+
+			TINYRISCV64_OP(ADDI) r[op->rd] = r[op->rs1] + op->imm; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SLLI) r[op->rd] = r[op->rs1] << op->imm; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SLTI) r[op->rd] = static_cast<i64>(r[op->rs1]) < op->imm; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SLTIU) r[op->rd] = r[op->rs1] < static_cast<u64>(op->imm); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(XORI) r[op->rd] = r[op->rs1] ^ op->imm; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SRLI) r[op->rd] = r[op->rs1] >> op->imm; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SRAI) r[op->rd] = static_cast<u64>(static_cast<i64>(r[op->rs1]) >> op->imm); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(ORI) r[op->rd] = r[op->rs1] | op->imm; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(ANDI) r[op->rd] = r[op->rs1] & op->imm; ++op; TINYRISCV64_NEXT;
+
+			TINYRISCV64_OP(ADDIW) r[op->rd] = sext32(static_cast<u32>(r[op->rs1]) + static_cast<u32>(op->imm)); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SLLIW) r[op->rd] = sext32(static_cast<u32>(r[op->rs1]) << op->imm); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SRLIW) r[op->rd] = sext32(static_cast<u32>(r[op->rs1]) >> op->imm); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SRAIW) r[op->rd] = sext32(static_cast<u32>(static_cast<i32>(r[op->rs1]) >> op->imm)); ++op; TINYRISCV64_NEXT;
+
+			TINYRISCV64_OP(ADD) r[op->rd] = r[op->rs1] + r[op->rs2]; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SUB) r[op->rd] = r[op->rs1] - r[op->rs2]; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SLL) r[op->rd] = r[op->rs1] << (r[op->rs2] & 0x3f); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SLT) r[op->rd] = static_cast<i64>(r[op->rs1]) < static_cast<i64>(r[op->rs2]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SLTU) r[op->rd] = r[op->rs1] < r[op->rs2]; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(XOR) r[op->rd] = r[op->rs1] ^ r[op->rs2]; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SRL) r[op->rd] = r[op->rs1] >> (r[op->rs2] & 0x3f); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SRA) r[op->rd] = static_cast<u64>(static_cast<i64>(r[op->rs1]) >> (r[op->rs2] & 0x3f)); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(OR) r[op->rd] = r[op->rs1] | r[op->rs2]; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(AND) r[op->rd] = r[op->rs1] & r[op->rs2]; ++op; TINYRISCV64_NEXT;
+
+			TINYRISCV64_OP(MUL) r[op->rd] = r[op->rs1] * r[op->rs2]; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(MULH) r[op->rd] = mulh(r[op->rs1],r[op->rs2]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(MULHSU) r[op->rd] = mulhsu(r[op->rs1],r[op->rs2]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(MULHU) r[op->rd] = mulhu(r[op->rs1],r[op->rs2]); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(DIV)
+			{
+				const auto a = static_cast<i64>(r[op->rs1]), b = static_cast<i64>(r[op->rs2]);
+				r[op->rd] = !b ? 0xFFFFFFFFFFFFFFFFULL : (a == INT64_MIN && b == -1) ? static_cast<u64>(INT64_MIN) : static_cast<u64>(a / b);
+				++op; TINYRISCV64_NEXT;
+			}
+			TINYRISCV64_OP(DIVU) r[op->rd] = r[op->rs2] ? r[op->rs1] / r[op->rs2] : 0xFFFFFFFFFFFFFFFFULL; ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(REM)
+			{
+				const auto a = static_cast<i64>(r[op->rs1]), b = static_cast<i64>(r[op->rs2]);
+				r[op->rd] = !b ? static_cast<u64>(a) : (a == INT64_MIN && b == -1) ? 0ULL : static_cast<u64>(a % b);
+				++op; TINYRISCV64_NEXT;
+			}
+			TINYRISCV64_OP(REMU) r[op->rd] = r[op->rs2] ? r[op->rs1] % r[op->rs2] : r[op->rs1]; ++op; TINYRISCV64_NEXT;
+
+			TINYRISCV64_OP(ADDW) r[op->rd] = sext32(static_cast<u32>(r[op->rs1]) + static_cast<u32>(r[op->rs2])); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SUBW) r[op->rd] = sext32(static_cast<u32>(r[op->rs1]) - static_cast<u32>(r[op->rs2])); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SLLW) r[op->rd] = sext32(static_cast<u32>(r[op->rs1]) << (r[op->rs2] & 0x1f)); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SRLW) r[op->rd] = sext32(static_cast<u32>(r[op->rs1]) >> (r[op->rs2] & 0x1f)); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SRAW) r[op->rd] = sext32(static_cast<u32>(static_cast<i32>(r[op->rs1]) >> (r[op->rs2] & 0x1f))); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(MULW) r[op->rd] = sext32(static_cast<u32>(r[op->rs1]) * static_cast<u32>(r[op->rs2])); ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(DIVW)
+			{
+				const auto a = static_cast<i32>(r[op->rs1]), b = static_cast<i32>(r[op->rs2]);
+				r[op->rd] = sext32(static_cast<u32>(!b ? -1 : (a == INT32_MIN && b == -1) ? INT32_MIN : a / b));
+				++op; TINYRISCV64_NEXT;
+			}
+			TINYRISCV64_OP(DIVUW)
+			{
+				const auto a = static_cast<u32>(r[op->rs1]), b = static_cast<u32>(r[op->rs2]);
+				r[op->rd] = sext32(b ? a / b : 0xFFFFFFFFu);
+				++op; TINYRISCV64_NEXT;
+			}
+			TINYRISCV64_OP(REMW)
+			{
+				const auto a = static_cast<i32>(r[op->rs1]), b = static_cast<i32>(r[op->rs2]);
+				r[op->rd] = sext32(static_cast<u32>(!b ? a : (a == INT32_MIN && b == -1) ? 0 : a % b));
+				++op; TINYRISCV64_NEXT;
+			}
+			TINYRISCV64_OP(REMUW)
+			{
+				const auto a = static_cast<u32>(r[op->rs1]), b = static_cast<u32>(r[op->rs2]);
+				r[op->rd] = sext32(b ? a % b : a);
+				++op; TINYRISCV64_NEXT;
+			}
+
+			TINYRISCV64_OP(NOP) ++op; TINYRISCV64_NEXT;
+			TINYRISCV64_OP(SLOW)
+			{
+				pc = TINYRISCV64_PC;
+				execute_instruction();
+				if (halted) return;
+				op = target_op(pc);
+				if (!op) [[unlikely]] goto stepwise;
+				TINYRISCV64_NEXT;
+			}
+			TINYRISCV64_OP(BAD_PC) throw std::runtime_error("PC jumped program region");
+			TINYRISCV64_OP(SENTINEL)
+				pc = TINYRISCV64_PC;
+				halted = true;
+				return;
+	#if defined(__GNUC__) && !defined(TINYRISCV64_NO_THREADED_DISPATCH)
+		}
+		#pragma GCC diagnostic pop
+	#else
+			}
+		}
+	#endif
+
+	[[maybe_unused]] out_of_budget:
+		if (op->code == SENTINEL) // (the last one allowed was the return)
+		{
+			pc = TINYRISCV64_PC;
+			halted = true;
+			return;
+		}
+		if (op->code == BAD_PC) // (that's checked first)
+			throw std::runtime_error("PC jumped program region");
+		throw std::runtime_error("Maximum instruction count exceeded");
+	[[maybe_unused]] halt:
+		pc = TINYRISCV64_PC;
+		return;
+	stepwise:
+		run_stepwise(budget);
+		return;
+
+		#undef TINYRISCV64_PC
+		#undef TINYRISCV64_TAKE
+		#undef TINYRISCV64_BRANCH
+		#undef TINYRISCV64_OP
+		#undef TINYRISCV64_NEXT
+	}
+	#undef TINYRISCV64_OPS
+
+	// Load time verification
+	//   verify() follows every path through the program from the start, on abstract register values: each is a number
+	//   in a known range, or its value at entry plus an offset in a known range, or unknown. A branch it can't decide
+	//   goes both ways (and a length check against a1 - the data size - is remembered on the way it went), so a loop
+	//   has to be one it can count (eg. a constant trip count, or a pointer stepping to an end pointer), and every path
+	//   has to get back to the caller within VerifyMaxSteps altogether. Every load and store has to be one of:
+	//     a0 plus an offset less than the data size it's checked for (on that path),
+	//     a fixed range from what some other register was at entry (checked once per run, on the way in), or
+	//     a constant address in the program - loads anywhere, but stores only into words that aren't instructions.
+	//   Indirect jumps can only be the return (to ra as it was at entry) or to a constant. Then a run that starts the
+	//   way it was verified (verified_entry()) can't fail, and can't take more than the longest path - so it runs
+	//   fast_ops: without the instruction budget, or halt checks, and with the loads and stores going straight to host
+	//   memory (plus the verify_delta of their region). Anything else runs as normal
+	static constexpr size_t VerifyMaxSteps = 1 << 18;
+	static constexpr i64 VerifyMaxRange = i64(1) << 48; // (ranges are kept small enough not to overflow)
+	static constexpr u8 VerifyProgram = 32;             // verify_delta index for constant addresses in the program
+	static constexpr u8 VerifyChecked = 33;             //   (a constant store into the program stays checked)
+	static constexpr u8 VerifyNone = 0xFF;
+
+	struct VerifyValue
+	{
+		static constexpr u8 Number = 0;     // base: just [lo,hi] (1-31: that register at entry, plus [lo,hi])
+		static constexpr u8 Unknown = 0xFF;
+		u8 base = Unknown;
+		i64 lo = 0, hi = 0;
+
+		bool exact() const { return base == Number && lo == hi; }
+		bool small() const { return lo >= -VerifyMaxRange && hi <= VerifyMaxRange; }
+		bool non_negative() const { return base == Number && lo >= 0; }
+		static VerifyValue number(const u64 v) { return {Number, static_cast<i64>(v), static_cast<i64>(v)}; }
+		static VerifyValue range(const u8 base, const i64 lo, const i64 hi)
+		{
+			if (base == Unknown || lo > hi || lo < -VerifyMaxRange || hi > VerifyMaxRange)
+				return {};
+			return {base, lo, hi};
+		}
+	};
+	struct VerifyPath
+	{
+		std::array<VerifyValue,32> r;
+		i64 min_len = 0;                // the least a1 was at entry (on this path)
+		size_t index = 0;
+		size_t steps = 0;
+	};
+	struct VerifySpan { u8 base; i64 beg; i64 end; };
+
+	bool verify_enabled = true;
+	std::string verify_err;
+	std::vector<MicroOp> fast_ops;      // (empty if it isn't verified)
+	std::vector<bool> verify_code;      // the micro-ops that can run
+	std::vector<VerifySpan> verify_spans;
+	std::array<u64,34> verify_delta{};  // host address - virtual address, for each region a V* micro-op can use
+	size_t verify_bound = 0;
+	bool verify_len = false;            // (it relies on a0/a1 being the data)
+	bool verify_ra = false;             // (it relies on ra being the return)
+	bool verify_prog_stores = false;    // (it stores into the program)
+
+	// Whether the run can go the verified way (and if so, where each register's accesses go)
+	bool verified_entry(const u64 entry_point, const size_t max_instructions)
+	{
+		if (fast_ops.empty() || entry_point != p_beg || verify_bound > max_instructions)
+			return false;
+		if (verify_ra && x[1] != (ops.size() - 1) * 4)
+			return false;
+		const auto data_delta = static_cast<u64>(reinterpret_cast<uintptr_t>(data.data())) - d_beg;
+		if (verify_len)
+		{
+			if (x[10] != d_beg || x[11] != d_end - d_beg)
+				return false;
+			verify_delta[10] = data_delta;
+		}
+		for (const auto& span : verify_spans)
+		{
+			const u64 beg = x[span.base] + span.beg, len = span.end - span.beg;
+			if (beg >= d_beg && beg <= d_end && len <= d_end - beg)
+				verify_delta[span.base] = data_delta;
+			else if (!(verify_len && span.base == 10) && beg >= s_beg && beg <= s_end && len <= s_end - beg)
+				verify_delta[span.base] = static_cast<u64>(reinterpret_cast<uintptr_t>(stack.data())) - s_beg;
+			else if (!(verify_len && span.base == 10) && beg >= sh_beg && beg <= sh_end && len <= sh_end - beg)
+				verify_delta[span.base] = static_cast<u64>(reinterpret_cast<uintptr_t>(shared.data())) - sh_beg;
+			else
+				return false;
+		}
+		verify_delta[VerifyProgram] = static_cast<u64>(reinterpret_cast<uintptr_t>(program.data())) - p_beg;
+		return true;
+	}
+
+	// The result of an operation on abstract values
+	static VerifyValue verify_alu(const u8 code, const VerifyValue& a, const VerifyValue& b)
+	{
+		using V = VerifyValue;
+		if (a.exact() && b.exact())
+		{
+			const auto u = static_cast<u64>(a.lo), v = static_cast<u64>(b.lo);
+			switch (code)
+			{
+				case ADD: case ADDI: return V::number(u + v);
+				case SUB: return V::number(u - v);
+				case SLL: case SLLI: return V::number(u << (v & 0x3f));
+				case SLT: case SLTI: return V::number(a.lo < b.lo);
+				case SLTU: case SLTIU: return V::number(u < v);
+				case XOR: case XORI: return V::number(u ^ v);
+				case SRL: case SRLI: return V::number(u >> (v & 0x3f));
+				case SRA: case SRAI: return V::number(static_cast<u64>(a.lo >> (v & 0x3f)));
+				case OR: case ORI: return V::number(u | v);
+				case AND: case ANDI: return V::number(u & v);
+				case MUL: return V::number(u * v);
+				case MULH: return V::number(mulh(a.lo, b.lo));
+				case MULHSU: return V::number(mulhsu(a.lo, v));
+				case MULHU: return V::number(mulhu(u, v));
+				case ADDW: case ADDIW: return V::number(sext32(static_cast<u32>(u + v)));
+				case SUBW: return V::number(sext32(static_cast<u32>(u - v)));
+				case SLLW: case SLLIW: return V::number(sext32(static_cast<u32>(u) << (v & 0x1f)));
+				case SRLW: case SRLIW: return V::number(sext32(static_cast<u32>(u) >> (v & 0x1f)));
+				case SRAW: case SRAIW: return V::number(sext32(static_cast<u32>(static_cast<i32>(u) >> (v & 0x1f))));
+				case MULW: return V::number(sext32(static_cast<u32>(u) * static_cast<u32>(v)));
+				default: return {}; // (divides)
+			}
+		}
+		const bool small = a.small() && b.small();
+		const auto shift = b.exact() ? static_cast<u8>(b.lo & 0x3f) : 0xFF;
+		switch (code)
+		{
+			case ADD: case ADDI:
+				if (!small || (a.base != V::Number && b.base != V::Number)) return {};
+				return V::range(a.base == V::Number ? b.base : a.base, a.lo + b.lo, a.hi + b.hi);
+			case SUB:
+				if (small && b.base == V::Number) return V::range(a.base, a.lo - b.hi, a.hi - b.lo);
+				if (small && a.base != V::Unknown && a.base == b.base) return V::range(V::Number, a.lo - b.hi, a.hi - b.lo); // (the offset between them)
+				return {};
+			case AND: case ANDI:
+				if (a.non_negative() && b.non_negative()) return V::range(V::Number, 0, std::min(a.hi, b.hi));
+				if (a.non_negative()) return V::range(V::Number, 0, a.hi);
+				if (b.non_negative()) return V::range(V::Number, 0, b.hi);
+				return {};
+			case OR: case ORI: case XOR: case XORI:
+			{
+				if (!small || !a.non_negative() || !b.non_negative()) return {};
+				i64 bits = 1;
+				while (bits <= std::max(a.hi, b.hi)) bits <<= 1;
+				return V::range(V::Number, 0, bits - 1);
+			}
+			case SLL: case SLLI:
+				if (shift > 63 || !a.non_negative() || a.hi > (VerifyMaxRange >> shift)) return {};
+				return V::range(V::Number, a.lo << shift, a.hi << shift);
+			case SRL: case SRLI:
+				if (shift > 63) return {};
+				if (shift == 0) return a; // (~0 >> 0 doesn't fit in an i64)
+				if (a.non_negative()) return V::range(V::Number, a.lo >> shift, a.hi >> shift);
+				return V::range(V::Number, 0, static_cast<i64>(~0ull >> shift));
+			case SRA: case SRAI:
+				if (shift > 63 || a.base != V::Number) return {};
+				return V::range(V::Number, a.lo >> shift, a.hi >> shift);
+			case SLT: case SLTI: case SLTU: case SLTIU:
+				return V::range(V::Number, 0, 1);
+			case MUL:
+				if (!small || !a.non_negative() || !b.non_negative() || (a.hi && b.hi > VerifyMaxRange / a.hi)) return {};
+				return V::range(V::Number, a.lo * b.lo, a.hi * b.hi);
+			case SRLW: case SRLIW:
+				if (shift > 63 || (shift & 0x1f) == 0) return {};
+				return V::range(V::Number, 0, 0xFFFFFFFF >> (shift & 0x1f));
+			case ADDW: case ADDIW: case SUBW: case SLLW: case SLLIW: case SRAW: case SRAIW: case MULW:
+			{
+				// the same as the 64 bit version, for 32 bit numbers - if the result is one too
+				const auto i32_range = [](const VerifyValue& v) { return v.base == V::Number && v.lo >= INT32_MIN && v.hi <= INT32_MAX; };
+				const bool is_shift = code == SLLW || code == SLLIW || code == SRAW || code == SRAIW;
+				if (!i32_range(a) || !i32_range(b) || (is_shift && shift > 31))
+					return {};
+				const u8 code64 = code == SUBW ? SUB : code == MULW ? MUL : (code == SLLW || code == SLLIW) ? SLL : (code == SRAW || code == SRAIW) ? SRA : ADD;
+				const auto result = verify_alu(code64, a, b);
+				if (result.base != V::Number || result.lo < INT32_MIN || result.hi > INT32_MAX) return {};
+				return result;
+			}
+			default: return {};
+		}
+	}
+
+	// Whether a branch is taken: 1 always, 0 never, -1 it could go either way
+	static int verify_branch(const u8 code, const VerifyValue& a, const VerifyValue& b)
+	{
+		using V = VerifyValue;
+		int equal = -1, less = -1, less_unsigned = -1;
+		if (a.base != V::Unknown && a.base == b.base)
+		{
+			if (a.lo == a.hi && b.lo == b.hi) equal = a.lo == b.lo;
+			else if (a.hi < b.lo || b.hi < a.lo) equal = 0;
+		}
+		if (a.base == V::Number && b.base == V::Number)
+		{
+			less = a.hi < b.lo ? 1 : a.lo >= b.hi ? 0 : -1;
+			// (unsigned, it's the same if they're on the same side of zero - and the negative ones are bigger)
+			const bool a_pos = a.lo >= 0, a_neg = a.hi < 0, b_pos = b.lo >= 0, b_neg = b.hi < 0;
+			if ((a_pos && b_pos) || (a_neg && b_neg)) less_unsigned = less;
+			else if (a_pos && b_neg) less_unsigned = 1;
+			else if (a_neg && b_pos) less_unsigned = 0;
+		}
+		const auto negate = [](const int v) { return v < 0 ? v : !v; };
+		switch (code)
+		{
+			case BEQ: return equal;
+			case BNE: return negate(equal);
+			case BLT: return less;
+			case BGE: return negate(less);
+			case BLTU: return less_unsigned;
+			default: return negate(less_unsigned); // BGEU
+		}
+	}
+
+	// What a branch going one way says about the data size (a1 at entry) - the least it can be
+	static i64 verify_length(const u8 code, const VerifyValue& a, const VerifyValue& b, const bool taken, const i64 min_len)
+	{
+		const auto is_len = [](const VerifyValue& v) { return v.base == 11 && v.lo == 0 && v.hi == 0; };
+		const bool less = code == BLT || code == BLTU, at_least = code == BGE || code == BGEU;
+		i64 len = 0;
+		if ((code == BEQ && taken) || (code == BNE && !taken)) // a == b
+			len = is_len(a) && b.non_negative() ? b.lo : is_len(b) && a.non_negative() ? a.lo : 0;
+		else if ((less && taken) || (at_least && !taken))      // a < b (with a >= 0, signed or not)
+			len = is_len(b) && a.non_negative() && a.lo < INT64_MAX ? a.lo + 1 : 0;
+		else if ((at_least && taken) || (less && !taken))      // a >= b (with b >= 0, signed or not)
+			len = is_len(a) && b.non_negative() ? b.lo : 0;
+		return std::max(min_len, len);
+	}
+
+	void verify()
+	{
+		fast_ops.clear();
+		verify_code.clear();
+		verify_spans.clear();
+		verify_bound = 0;
+		verify_len = verify_ra = verify_prog_stores = false;
+		verify_err = verify_enabled ? "" : "verification disabled";
+		if (!verify_enabled || ops.size() < 2)
+			return;
+		const auto fail = [this](const std::string& why)
+		{
+			verify_err = why;
+			verify_code.clear();
+			verify_spans.clear();
+		};
+		using V = VerifyValue;
+		const size_t sentinel = ops.size() - 1;
+		const auto at = [](const size_t i) { return std::format(" (at 0x{:x})", i*4); };
+
+		std::vector<u8> region(sentinel, VerifyNone);
+		std::array<std::pair<i64,i64>,32> spans;
+		spans.fill({INT64_MAX, INT64_MIN});
+		std::vector<std::pair<i64,i64>> prog_stores;
+		verify_code.assign(sentinel, false);
+
+		VerifyPath start;
+		start.r[0] = V::number(0);
+		for (u8 n = 1; n < 32; n++)
+			start.r[n] = {n, 0, 0};
+		std::vector<VerifyPath> paths = {start};
+		size_t work = 0;
+		while (!paths.empty())
+		{
+			auto p = std::move(paths.back());
+			paths.pop_back();
+			auto& r = p.r;
+			while (p.index != sentinel)
+			{
+				if (++work > VerifyMaxSteps)
+					return fail(std::format("more than {} instructions to follow - too many paths, or a loop it can't count", VerifyMaxSteps));
+				const auto i = p.index;
+				const auto& op = ops[i];
+				verify_code[i] = true;
+				p.steps++;
+				p.index++;
+				const auto set = [&](const V& v) { if (op.rd != ZeroSink) r[op.rd] = v; };
+				// a load or store of 2^log2_size bytes
+				const auto access = [&](const u8 log2_size, const bool is_store) -> bool
+				{
+					const auto addr = verify_alu(ADDI, r[op.rs1], V::number(op.imm));
+					const i64 size = i64(1) << log2_size;
+					u8 used;
+					if (addr.base == V::Unknown)
+						return fail("a load or store it can't bound" + at(i)), false;
+					if (addr.base == V::Number)
+					{
+						if (addr.lo < 0 || addr.hi > static_cast<i64>(p_end) - size)
+							return fail("a constant address outside the program" + at(i)), false;
+						used = is_store ? VerifyChecked : VerifyProgram;
+						if (is_store)
+							prog_stores.emplace_back(addr.lo, addr.hi + size);
+					}
+					else
+					{
+						used = addr.base;
+						if (addr.base == 10 && addr.lo >= 0 && addr.hi + size <= p.min_len)
+							verify_len = true;
+						else
+						{
+							auto& span = spans[addr.base];
+							span = {std::min(span.first, addr.lo), std::max(span.second, addr.hi + size)};
+						}
+					}
+					if (region[i] != VerifyNone && region[i] != used)
+						return fail("a load or store that isn't always relative to the same register" + at(i)), false;
+					region[i] = used;
+					return true;
+				};
+				const auto load = [&](const u8 log2_size, const V& result)
+				{
+					if (!access(log2_size, false)) return false;
+					set(result);
+					return true;
+				};
+
+				switch (op.code)
+				{
+					case LI: set(V::number(op.imm)); break;
+					case JAL:
+						if (op.target == NoTarget)
+							return fail("a jump out of the program" + at(i));
+						set(V::number((i + 1) * 4));
+						p.index = op.target;
+						break;
+					case JALR:
+					{
+						const auto target = verify_alu(ADDI, r[op.rs1], V::number(op.imm));
+						set(V::number((i + 1) * 4));
+						if (target.base == 1 && target.lo == 0 && target.hi == 0)
+						{
+							verify_ra = true;
+							p.index = sentinel;
+						}
+						else if (target.exact() && target.lo >= 0 && !(target.lo & 3) && static_cast<u64>(target.lo)/4 <= sentinel
+							&& ops[target.lo/4].code != BAD_PC)
+							p.index = target.lo/4;
+						else
+							return fail("an indirect jump that isn't a return, or to a constant address" + at(i));
+						break;
+					}
+					case BEQ: case BNE: case BLT: case BGE: case BLTU: case BGEU:
+					{
+						if (op.target == NoTarget)
+							return fail("a branch out of the program" + at(i));
+						const auto a = r[op.rs1], b = r[op.rs2];
+						const auto taken = verify_branch(op.code, a, b);
+						if (taken < 0)
+						{
+							auto other = p;
+							other.index = op.target;
+							other.min_len = verify_length(op.code, a, b, true, p.min_len);
+							paths.push_back(std::move(other));
+							p.min_len = verify_length(op.code, a, b, false, p.min_len);
+						}
+						else if (taken)
+							p.index = op.target;
+						break;
+					}
+
+					case LB: if (!load(0, V::range(V::Number, INT8_MIN, INT8_MAX))) return; break;
+					case LH: if (!load(1, V::range(V::Number, INT16_MIN, INT16_MAX))) return; break;
+					case LW: if (!load(2, V::range(V::Number, INT32_MIN, INT32_MAX))) return; break;
+					case LD: if (!load(3, V{})) return; break;
+					case LBU: if (!load(0, V::range(V::Number, 0, UINT8_MAX))) return; break;
+					case LHU: if (!load(1, V::range(V::Number, 0, UINT16_MAX))) return; break;
+					case LWU: if (!load(2, V::range(V::Number, 0, UINT32_MAX))) return; break;
+					case SB: if (!access(0, true)) return; break;
+					case SH: if (!access(1, true)) return; break;
+					case SW: if (!access(2, true)) return; break;
+					case SD: if (!access(3, true)) return; break;
+
+					case ADDI: case SLLI: case SLTI: case SLTIU: case XORI: case SRLI: case SRAI: case ORI: case ANDI:
+					case ADDIW: case SLLIW: case SRLIW: case SRAIW:
+						set(verify_alu(op.code, r[op.rs1], V::number(op.imm)));
+						break;
+					case NOP: break;
+					case SLOW:
+						return fail("an instruction that needs the interpreter (SYSTEM, or not valid)" + at(i));
+					case BAD_PC:
+						return fail("a jump past the end of the program" + at(i));
+					default:
+						set(verify_alu(op.code, r[op.rs1], r[op.rs2]));
+				}
+			}
+			verify_bound = std::max(verify_bound, p.steps);
+		}
+
+		for (const auto& [beg, end] : prog_stores)
+			for (auto w = static_cast<size_t>(beg)/4; w <= static_cast<size_t>(end - 1)/4; w++)
+				if (w < sentinel && verify_code[w])
+					return fail(std::format("a store into its own instructions (at 0x{:x})", w*4));
+		verify_prog_stores = !prog_stores.empty();
+
+		for (u8 n = 1; n < 32; n++)
+			if (spans[n].first < spans[n].second)
+				verify_spans.push_back({n, spans[n].first, spans[n].second});
+		static constexpr u8 fast_load[] = {VLB,VLH,VLW,VLD,VLBU,VLHU,VLWU}, fast_store[] = {VSB,VSH,VSW,VSD};
+		fast_ops = ops;
+		for (size_t i = 0; i < sentinel; i++)
+		{
+			if (region[i] == VerifyNone || region[i] == VerifyChecked)
+				continue;
+			auto& op = fast_ops[i];
+			op.target = region[i];
+			op.code = op.code >= SB ? fast_store[op.code - SB] : fast_load[op.code - LB];
+		}
+	}
+
+#ifdef TINYRISCV64_JIT
+	// x86-64 JIT
+	//   jit_compile() translates the micro-ops reachable from the start of the program to native code, in basic blocks.
+	//   The registers stay in x (so the interpreter can carry on from any point), and the instruction budget is taken
+	//   a block at a time, on the way in. Loads and stores are bounds checked against the data, stack, shared and program
+	//   regions as they're mapped at the time. Anything the native code doesn't do itself - SYSTEM and invalid
+	//   instructions, accesses that fail the checks, stores into the program region, jumps to a target that
+	//   isn't the start of a block, or not enough budget left for a block - hands over to the interpreter
+	//   (run_decoded()) at that micro-op, with the rest of the budget. So it behaves (and fails) exactly the same.
+	//   The native code is re-made (up to a limit) if the program modifies any of the instructions it was made from.
+	//   Like the interpreter, an external halt is noticed at backward jumps and returns
+	enum JitExit : u32 { JIT_DONE, JIT_INTERPRET, JIT_HALT };
+	struct JitContext
+	{
+		u64 budget;                     // in: max instructions, out: what's left
+		u64 index;                      // in: where to start, out: where to carry on (JIT_INTERPRET) or stopped (JIT_HALT)
+		u64* regs;
+		const void* const* table;       // the native code for each micro-op (up to the last one translated)
+		const std::atomic_bool* halted;
+		struct Region
+		{
+			u64 beg;
+			u8* ptr;
+			u64 lim[4];                 // an access of 1<<n bytes at addr is in the region if addr-beg < lim[n]
+		} region[4];
+	};
+	enum JitRegion { JIT_DATA, JIT_STACK, JIT_SHARED, JIT_PROG };
+	static constexpr size_t JitMaxOps = 65536;
+	static constexpr size_t JitMaxCompiles = 16;
+
+	// An executable mapping of some generated code
+	class JitCode
+	{
+	public:
+		JitCode() = default;
+		JitCode(const JitCode&) = delete;
+		JitCode& operator=(const JitCode&) = delete;
+		~JitCode() { release(); }
+
+		// (mapped writeable to copy in, then only executable)
+		bool load(const std::vector<u8>& code)
+		{
+			release();
+			void* const mem = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mem == MAP_FAILED)
+				return false;
+			std::memcpy(mem, code.data(), code.size());
+			if (mprotect(mem, code.size(), PROT_READ | PROT_EXEC) != 0)
+			{
+				munmap(mem, code.size());
+				return false;
+			}
+			base = static_cast<u8*>(mem);
+			size = code.size();
+			return true;
+		}
+		void release()
+		{
+			if (base)
+				munmap(base, size);
+			base = nullptr;
+			size = 0;
+		}
+		using Function = u32 (*)(JitContext*);
+		const u8* entry() const { return base; }
+		Function function() const { return reinterpret_cast<Function>(base); }
+
+	private:
+		u8* base = nullptr;
+		size_t size = 0;
+	};
+
+	bool jit_enabled = false;
+	bool jit_stale = false;             // (the program modified code that was translated)
+	size_t jit_compiles = 0;
+	JitCode jit_code;
+	std::vector<const void*> jit_table;
+	std::vector<bool> jit_translated;
+	JitContext jit_ctx{};
+
+	void run_jit(const u64 entry, const size_t max_instructions)
+	{
+		const auto set_region = [](JitContext::Region& region, const u64 beg, u8* const ptr, const u64 len)
+		{
+			region.beg = beg;
+			region.ptr = ptr;
+			for (size_t n = 0; n < 4; n++)
+				region.lim[n] = len >= (1ull << n) ? len - (1ull << n) + 1 : 0;
+		};
+		set_region(jit_ctx.region[JIT_DATA], d_beg, data.data(), d_end - d_beg);
+		set_region(jit_ctx.region[JIT_STACK], s_beg, stack.data(), s_end - s_beg);
+		set_region(jit_ctx.region[JIT_SHARED], sh_beg, shared.data(), sh_end - sh_beg);
+		set_region(jit_ctx.region[JIT_PROG], p_beg, program.data(), p_end - p_beg);
+		jit_ctx.budget = max_instructions;
+		jit_ctx.index = entry;
+		jit_ctx.regs = x.data();
+		jit_ctx.table = jit_table.data();
+		jit_ctx.halted = &halted;
+
+		switch (jit_code.function()(&jit_ctx))
+		{
+			case JIT_DONE:
+				pc = (ops.size() - 1) * 4;
+				halted = true;
+				return;
+			case JIT_HALT:
+				pc = jit_ctx.index * 4;
+				return;
+			default:
+				return run_decoded(&ops[jit_ctx.index], jit_ctx.budget);
+		}
+	}
+
+	// The M extension divides (with the RISC-V results for divide by zero and overflow) - called from the native code
+	static u64 jit_divide(const u64 code, const u64 a, const u64 b)
+	{
+		const auto sa = static_cast<i64>(a), sb = static_cast<i64>(b);
+		const auto a32 = static_cast<i32>(a), b32 = static_cast<i32>(b);
+		switch (code)
+		{
+			case DIV: return !b ? 0xFFFFFFFFFFFFFFFFULL : (sa == INT64_MIN && sb == -1) ? a : static_cast<u64>(sa / sb);
+			case DIVU: return b ? a / b : 0xFFFFFFFFFFFFFFFFULL;
+			case REM: return !b ? a : (sa == INT64_MIN && sb == -1) ? 0ULL : static_cast<u64>(sa % sb);
+			case REMU: return b ? a % b : a;
+			case DIVW: return sext32(static_cast<u32>(!b32 ? -1 : (a32 == INT32_MIN && b32 == -1) ? INT32_MIN : a32 / b32));
+			case DIVUW: return sext32(static_cast<u32>(b) ? static_cast<u32>(a) / static_cast<u32>(b) : 0xFFFFFFFFu);
+			case REMW: return sext32(static_cast<u32>(!b32 ? a32 : (a32 == INT32_MIN && b32 == -1) ? 0 : a32 % b32));
+			default: return sext32(static_cast<u32>(b) ? static_cast<u32>(a) % static_cast<u32>(b) : static_cast<u32>(a)); // REMUW
+		}
+	}
+
+	// Just enough of an x86-64 assembler for the translation. Jumps are all rel32, to labels resolved at the end
+	struct X86
+	{
+		enum Reg : u8 { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+		enum Cond : u8 { B = 0x2, AE = 0x3, E = 0x4, NE = 0x5, L = 0xc, GE = 0xd };
+		// opcodes of the 'op r/m64, r64' forms (and +2 for 'op r64, r/m64'), and the group 1 /ext of the immediate forms
+		enum Alu : u8 { ADD = 0x01, OR = 0x09, AND = 0x21, SUB = 0x29, XOR = 0x31, CMP = 0x39, MOV = 0x89 };
+		enum AluExt : u8 { ADD_I = 0, OR_I = 1, AND_I = 4, SUB_I = 5, XOR_I = 6, CMP_I = 7 };
+		enum ShiftExt : u8 { SHL = 4, SHR = 5, SAR = 7 };
+
+		std::vector<u8> code;
+		std::vector<i64> labels;
+		std::vector<std::pair<size_t,size_t>> fixups; // (where a rel32 is, its label)
+
+		size_t label() { labels.push_back(-1); return labels.size() - 1; }
+		void bind(const size_t l) { labels[l] = static_cast<i64>(code.size()); }
+		bool resolve()
+		{
+			for (const auto& [at, l] : fixups)
+			{
+				if (labels[l] < 0)
+					return false;
+				const auto rel = static_cast<i32>(labels[l] - static_cast<i64>(at + 4));
+				std::memcpy(&code[at], &rel, 4);
+			}
+			return true;
+		}
+
+		void b(const u8 v) { code.push_back(v); }
+		void d32(const u32 v) { for (int i = 0; i < 4; i++) b(static_cast<u8>(v >> (8*i))); }
+		void rel(const size_t l) { fixups.emplace_back(code.size(), l); d32(0); }
+		void rex(const bool w, const u8 reg, const u8 rm) { const u8 r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3); if (r != 0x40) b(r); }
+		void modrm_reg(const u8 reg, const u8 rm) { b(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+		void modrm_mem(const u8 reg, const u8 base, const i32 disp) // [base+disp32]
+		{
+			b(0x80 | ((reg & 7) << 3) | (base & 7));
+			if ((base & 7) == RSP) b(0x24);
+			d32(static_cast<u32>(disp));
+		}
+		static bool fits_i32(const i64 v) { return v == static_cast<i32>(v); }
+
+		void load(const Reg dst, const Reg base, const i32 disp) { rex(true, dst, base); b(0x8B); modrm_mem(dst, base, disp); }
+		void store(const Reg src, const Reg base, const i32 disp) { rex(true, src, base); b(0x89); modrm_mem(src, base, disp); }
+		void store_imm(const Reg base, const i32 disp, const i64 v) // (v must fit in 32 bits, sign extended)
+		{
+			rex(true, 0, base); b(0xC7); modrm_mem(0, base, disp); d32(static_cast<u32>(v));
+		}
+		void alu(const Alu op, const Reg dst, const Reg src, const bool w = true) { rex(w, src, dst); b(op); modrm_reg(src, dst); }
+		void alu_mem(const Alu op, const Reg dst, const Reg base, const i32 disp) { rex(true, dst, base); b(op + 2); modrm_mem(dst, base, disp); }
+		void alu_imm(const AluExt ext, const Reg dst, const i32 v, const bool w = true)
+		{
+			rex(w, 0, dst);
+			if (v == static_cast<i8>(v)) { b(0x83); modrm_reg(ext, dst); b(static_cast<u8>(v)); }
+			else { b(0x81); modrm_reg(ext, dst); d32(static_cast<u32>(v)); }
+		}
+		void mov_imm(const Reg dst, const i64 v)
+		{
+			if (fits_i32(v)) { rex(true, 0, dst); b(0xC7); modrm_reg(0, dst); d32(static_cast<u32>(v)); }
+			else { rex(true, 0, dst); b(0xB8 | (dst & 7)); for (int i = 0; i < 8; i++) b(static_cast<u8>(static_cast<u64>(v) >> (8*i))); }
+		}
+		void mov_imm32(const Reg dst, const u32 v) { rex(false, 0, dst); b(0xB8 | (dst & 7)); d32(v); } // (zero extended)
+		void shift_imm(const ShiftExt ext, const Reg dst, const u8 n, const bool w = true) { rex(w, 0, dst); b(0xC1); modrm_reg(ext, dst); b(n); }
+		void shift_cl(const ShiftExt ext, const Reg dst, const bool w = true) { rex(w, 0, dst); b(0xD3); modrm_reg(ext, dst); }
+		void imul(const Reg dst, const Reg src, const bool w = true) { rex(w, dst, src); b(0x0F); b(0xAF); modrm_reg(dst, src); }
+		void mul_rdx_rax(const Reg src, const bool is_signed) { rex(true, 0, src); b(0xF7); modrm_reg(is_signed ? 5 : 4, src); }
+		void movsxd(const Reg dst, const Reg src) { rex(true, dst, src); b(0x63); modrm_reg(dst, src); }
+		void setcc_rax(const Cond cc) { b(0x0F); b(0x90 | cc); b(0xC0); b(0x0F); b(0xB6); b(0xC0); } // setcc al; movzx eax,al
+		void jcc(const Cond cc, const size_t l) { b(0x0F); b(0x80 | cc); rel(l); }
+		void jmp(const size_t l) { b(0xE9); rel(l); }
+		void jmp_table(const Reg table, const Reg index) { rex(false, 0, table); b(0xFF); b(0x24); b(0xC0 | ((index & 7) << 3) | (table & 7)); } // jmp [table+index*8]
+		void call(const Reg fn) { rex(false, 0, fn); b(0xFF); modrm_reg(2, fn); }
+		void push(const Reg r) { rex(false, 0, r); b(0x50 | (r & 7)); }
+		void pop(const Reg r) { rex(false, 0, r); b(0x58 | (r & 7)); }
+		void ret() { b(0xC3); }
+		void test_halted(const Reg halted_ptr) { b(0x80); b(0x38 | (halted_ptr & 7)); b(0x00); } // cmp byte [reg],0 (rax/rcx/rdx only)
+	};
+
+	void jit_compile()
+	{
+		jit_code.release();
+		jit_table.clear();
+		jit_translated.clear();
+		jit_stale = false;
+		if (!jit_enabled || ops.size() < 2 || jit_compiles >= JitMaxCompiles)
+			return;
+		jit_compiles++;
+
+		// What's reachable from the start, and where the blocks start: the start, jump targets, after a jump
+		//   (incl. the return from a call), and anything that isn't translated (which just hands over)
+		const size_t sentinel = ops.size() - 1;
+		std::vector<bool> reachable(sentinel), leader(sentinel);
+		std::vector<size_t> todo = {0};
+		reachable[0] = leader[0] = true;
+		size_t num_reachable = 0, table_size = 0;
+		const auto visit = [&](const size_t i, const bool starts_block)
+		{
+			if (i >= sentinel)
+				return;
+			leader[i] = leader[i] || starts_block;
+			if (!reachable[i])
+			{
+				reachable[i] = true;
+				todo.push_back(i);
+			}
+		};
+		while (!todo.empty())
+		{
+			const auto i = todo.back();
+			todo.pop_back();
+			if (++num_reachable > JitMaxOps)
+				return;
+			table_size = std::max(table_size, i + 1);
+			const auto& op = ops[i];
+			switch (op.code)
+			{
+				case SLOW: case BAD_PC:
+					leader[i] = true;
+					break;
+				case BEQ: case BNE: case BLT: case BGE: case BLTU: case BGEU:
+					if (op.target != NoTarget) visit(op.target, true);
+					visit(i + 1, true);
+					break;
+				case JAL:
+					if (op.target != NoTarget) visit(op.target, true);
+					if (op.rd != ZeroSink) visit(i + 1, true);
+					break;
+				case JALR:
+					if (op.rd != ZeroSink) visit(i + 1, true);
+					break;
+				default:
+					visit(i + 1, false);
+			}
+		}
+
+		using R = X86::Reg;
+		X86 a;
+		// Registers: rbx -> x, r12: budget, r13 -> JitContext, r14 -> jit_table. rax, rcx and rdx are scratch
+		const auto reg = [](const u8 n) { return static_cast<i32>(n * sizeof(u64)); };
+		const auto ctx = [](const size_t offset) { return static_cast<i32>(offset); };
+		const auto region_offset = [](const JitRegion r) { return offsetof(JitContext, region) + r * sizeof(JitContext::Region); };
+
+		const auto done = a.label(), interpret = a.label(), halt = a.label(), exit = a.label();
+		std::vector<size_t> labels(sentinel);
+		for (size_t i = 0; i < sentinel; i++)
+			if (reachable[i] && leader[i])
+				labels[i] = a.label();
+
+		// Hand overs, emitted after the translation (out of the way): the micro-op, and the budget to give back
+		struct Stub { size_t label; size_t index; u32 refund; };
+		std::vector<Stub> stubs;
+		const auto stub = [&](const size_t index, const u32 refund)
+		{
+			stubs.push_back({a.label(), index, refund});
+			return stubs.back().label;
+		};
+		// The label to jump to for a target micro-op (checking for a halt first, if it's backwards)
+		struct Backward { size_t label; size_t target; };
+		std::vector<Backward> backwards;
+		const auto target_label = [&](const size_t from, const u32 target, const u32 refund)
+		{
+			if (target == NoTarget)
+				return stub(from, refund);
+			if (target == sentinel)
+				return done;
+			if (target > from)
+				return labels[target];
+			backwards.push_back({a.label(), target});
+			return backwards.back().label;
+		};
+
+		// Prologue (5 pushes - the stack's 16 byte aligned for calls)
+		a.push(R::RBX); a.push(R::R12); a.push(R::R13); a.push(R::R14); a.push(R::R15);
+		a.alu(X86::MOV, R::R13, R::RDI);
+		a.load(R::RBX, R::R13, ctx(offsetof(JitContext, regs)));
+		a.load(R::R14, R::R13, ctx(offsetof(JitContext, table)));
+		a.load(R::R12, R::R13, ctx(offsetof(JitContext, budget)));
+		a.load(R::RCX, R::R13, ctx(offsetof(JitContext, index)));
+		a.jmp_table(R::R14, R::RCX);
+
+		size_t block_end = 0; // (one past the last micro-op of the current block)
+		for (size_t i = 0; i < sentinel; i++)
+		{
+			if (!reachable[i])
+				continue;
+			const auto& op = ops[i];
+			if (leader[i])
+			{
+				a.bind(labels[i]);
+				if (op.code == SLOW || op.code == BAD_PC)
+				{
+					a.mov_imm32(R::RCX, static_cast<u32>(i));
+					a.jmp(interpret);
+					continue;
+				}
+				// take the whole block's budget up front (giving it back to hand over, if there isn't enough)
+				block_end = i + 1;
+				while (block_end < sentinel && !leader[block_end] && reachable[block_end])
+					block_end++;
+				const auto len = static_cast<u32>(block_end - i);
+				a.alu_imm(X86::SUB_I, R::R12, static_cast<i32>(len));
+				a.jcc(X86::B, stub(i, len));
+			}
+			const auto refund = static_cast<u32>(block_end - i);
+
+			const auto rd = reg(op.rd), rs1 = reg(op.rs1), rs2 = reg(op.rs2);
+			const auto imm = static_cast<i32>(op.imm);
+			const bool to_zero = op.rd == ZeroSink;
+			const auto alu_imm = [&](const X86::AluExt ext, const bool w = true)
+			{
+				if (to_zero) return;
+				a.load(R::RAX, R::RBX, rs1);
+				a.alu_imm(ext, R::RAX, imm, w);
+				if (!w) a.movsxd(R::RAX, R::RAX);
+				a.store(R::RAX, R::RBX, rd);
+			};
+			const auto shift_imm = [&](const X86::ShiftExt ext, const bool w = true)
+			{
+				if (to_zero) return;
+				a.load(R::RAX, R::RBX, rs1);
+				a.shift_imm(ext, R::RAX, static_cast<u8>(op.imm), w);
+				if (!w) a.movsxd(R::RAX, R::RAX);
+				a.store(R::RAX, R::RBX, rd);
+			};
+			const auto alu_reg = [&](const X86::Alu alu, const bool w = true)
+			{
+				if (to_zero) return;
+				a.load(R::RAX, R::RBX, rs1);
+				a.alu_mem(alu, R::RAX, R::RBX, rs2);
+				if (!w) a.movsxd(R::RAX, R::RAX);
+				a.store(R::RAX, R::RBX, rd);
+			};
+			const auto shift_reg = [&](const X86::ShiftExt ext, const bool w = true)
+			{
+				if (to_zero) return;
+				a.load(R::RAX, R::RBX, rs1);
+				a.load(R::RCX, R::RBX, rs2);
+				a.shift_cl(ext, R::RAX, w); // (x86 masks the count the same way)
+				if (!w) a.movsxd(R::RAX, R::RAX);
+				a.store(R::RAX, R::RBX, rd);
+			};
+			const auto set_if = [&](const X86::Cond cc, const bool immediate)
+			{
+				if (to_zero) return;
+				a.load(R::RAX, R::RBX, rs1);
+				if (immediate) a.alu_imm(X86::CMP_I, R::RAX, imm);
+				else a.alu_mem(X86::CMP, R::RAX, R::RBX, rs2);
+				a.setcc_rax(cc);
+				a.store(R::RAX, R::RBX, rd);
+			};
+			const auto mul_high = [&](const bool is_signed, const bool signed_unsigned)
+			{
+				if (to_zero) return;
+				a.load(R::RAX, R::RBX, rs1);
+				a.load(R::RCX, R::RBX, rs2);
+				a.mul_rdx_rax(R::RCX, is_signed);
+				if (signed_unsigned) // (the unsigned high half, less rs2 if rs1 is negative)
+				{
+					a.load(R::RAX, R::RBX, rs1);
+					a.shift_imm(X86::SAR, R::RAX, 63);
+					a.alu(X86::AND, R::RAX, R::RCX);
+					a.alu(X86::SUB, R::RDX, R::RAX);
+				}
+				a.store(R::RDX, R::RBX, rd);
+			};
+			const auto divide = [&]()
+			{
+				if (to_zero) return;
+				a.mov_imm32(R::RDI, op.code);
+				a.load(R::RSI, R::RBX, rs1);
+				a.load(R::RDX, R::RBX, rs2);
+				a.mov_imm(R::RAX, static_cast<i64>(reinterpret_cast<uintptr_t>(&jit_divide)));
+				a.call(R::RAX);
+				a.store(R::RAX, R::RBX, rd);
+			};
+			const auto branch = [&](const X86::Cond cc)
+			{
+				a.load(R::RAX, R::RBX, rs1);
+				a.alu_mem(X86::CMP, R::RAX, R::RBX, rs2);
+				a.jcc(cc, target_label(i, op.target, refund));
+			};
+			// Bounds checked load/store: the address in rax, then the host address in rcx
+			const auto memory = [&](const u8 log2_size, const bool is_store)
+			{
+				a.load(R::RAX, R::RBX, rs1);
+				if (imm) a.alu_imm(X86::ADD_I, R::RAX, imm);
+				if (is_store) a.load(R::RDX, R::RBX, rs2);
+				std::vector<JitRegion> regions = (op.rs1 == 2 || op.rs1 == 8) ? std::vector<JitRegion>{JIT_STACK, JIT_DATA} : std::vector<JitRegion>{JIT_DATA, JIT_STACK};
+				regions.push_back(JIT_SHARED);
+				if (!is_store) regions.push_back(JIT_PROG); // (stores into the program hand over - they need re-decoding)
+				const auto found = a.label();
+				for (size_t n = 0; n < regions.size(); n++)
+				{
+					const auto offset = region_offset(regions[n]);
+					const bool last = n + 1 == regions.size();
+					const auto next = last ? stub(i, refund) : a.label();
+					a.alu(X86::MOV, R::RCX, R::RAX);
+					a.alu_mem(X86::SUB, R::RCX, R::R13, ctx(offset + offsetof(JitContext::Region, beg)));
+					a.alu_mem(X86::CMP, R::RCX, R::R13, ctx(offset + offsetof(JitContext::Region, lim) + log2_size * sizeof(u64)));
+					a.jcc(X86::AE, next);
+					a.alu_mem(X86::ADD, R::RCX, R::R13, ctx(offset + offsetof(JitContext::Region, ptr)));
+					if (!last)
+					{
+						a.jmp(found);
+						a.bind(next);
+					}
+				}
+				a.bind(found);
+			};
+			const auto load = [&](const u8 log2_size, std::initializer_list<u8> insn)
+			{
+				memory(log2_size, false);
+				for (const auto byte : insn) a.b(byte); // (rax <- [rcx])
+				a.store(R::RAX, R::RBX, rd);
+			};
+			const auto store = [&](const u8 log2_size, std::initializer_list<u8> insn)
+			{
+				memory(log2_size, true);
+				for (const auto byte : insn) a.b(byte); // ([rcx] <- rdx)
+			};
+
+			switch (op.code)
+			{
+				case LI: if (!to_zero) { if (X86::fits_i32(op.imm)) a.store_imm(R::RBX, rd, op.imm); else { a.mov_imm(R::RAX, op.imm); a.store(R::RAX, R::RBX, rd); } } break;
+				case JAL:
+					if (!to_zero) a.store_imm(R::RBX, rd, static_cast<i64>((i + 1) * 4));
+					a.jmp(target_label(i, op.target, refund));
+					break;
+				case JALR:
+				{
+					// target = (rs1+imm) & ~1, as a micro-op index in rcx
+					a.load(R::RAX, R::RBX, rs1);
+					if (imm) a.alu_imm(X86::ADD_I, R::RAX, imm);
+					a.alu_imm(X86::AND_I, R::RAX, -2);
+					a.b(0xA8); a.b(0x03); // test al,3
+					a.jcc(X86::NE, stub(i, refund));
+					a.alu(X86::MOV, R::RCX, R::RAX);
+					a.shift_imm(X86::SHR, R::RCX, 2);
+					const auto in_table = a.label();
+					a.alu_imm(X86::CMP_I, R::RCX, static_cast<i32>(table_size));
+					a.jcc(X86::B, in_table);
+					a.alu_imm(X86::CMP_I, R::RCX, static_cast<i32>(sentinel));
+					a.jcc(X86::NE, stub(i, refund));
+					if (!to_zero) a.store_imm(R::RBX, rd, static_cast<i64>((i + 1) * 4));
+					a.jmp(done);
+					a.bind(in_table);
+					if (!to_zero) a.store_imm(R::RBX, rd, static_cast<i64>((i + 1) * 4));
+					a.load(R::RAX, R::R13, ctx(offsetof(JitContext, halted)));
+					a.test_halted(R::RAX);
+					a.jcc(X86::NE, halt);
+					a.jmp_table(R::R14, R::RCX);
+					break;
+				}
+				case BEQ: branch(X86::E); break;
+				case BNE: branch(X86::NE); break;
+				case BLT: branch(X86::L); break;
+				case BGE: branch(X86::GE); break;
+				case BLTU: branch(X86::B); break;
+				case BGEU: branch(X86::AE); break;
+
+				case LB: load(0, {0x48, 0x0F, 0xBE, 0x01}); break; // movsx rax, byte [rcx]
+				case LH: load(1, {0x48, 0x0F, 0xBF, 0x01}); break; // movsx rax, word [rcx]
+				case LW: load(2, {0x48, 0x63, 0x01}); break;       // movsxd rax, dword [rcx]
+				case LD: load(3, {0x48, 0x8B, 0x01}); break;       // mov rax, [rcx]
+				case LBU: load(0, {0x0F, 0xB6, 0x01}); break;      // movzx eax, byte [rcx]
+				case LHU: load(1, {0x0F, 0xB7, 0x01}); break;      // movzx eax, word [rcx]
+				case LWU: load(2, {0x8B, 0x01}); break;            // mov eax, [rcx]
+				case SB: store(0, {0x88, 0x11}); break;            // mov [rcx], dl
+				case SH: store(1, {0x66, 0x89, 0x11}); break;      // mov [rcx], dx
+				case SW: store(2, {0x89, 0x11}); break;            // mov [rcx], edx
+				case SD: store(3, {0x48, 0x89, 0x11}); break;      // mov [rcx], rdx
+
+				case ADDI: alu_imm(X86::ADD_I); break;
+				case SLLI: shift_imm(X86::SHL); break;
+				case SLTI: set_if(X86::L, true); break;
+				case SLTIU: set_if(X86::B, true); break;
+				case XORI: alu_imm(X86::XOR_I); break;
+				case SRLI: shift_imm(X86::SHR); break;
+				case SRAI: shift_imm(X86::SAR); break;
+				case ORI: alu_imm(X86::OR_I); break;
+				case ANDI: alu_imm(X86::AND_I); break;
+
+				case ADDIW: alu_imm(X86::ADD_I, false); break;
+				case SLLIW: shift_imm(X86::SHL, false); break;
+				case SRLIW: shift_imm(X86::SHR, false); break;
+				case SRAIW: shift_imm(X86::SAR, false); break;
+
+				case ADD: alu_reg(X86::ADD); break;
+				case SUB: alu_reg(X86::SUB); break;
+				case SLL: shift_reg(X86::SHL); break;
+				case SLT: set_if(X86::L, false); break;
+				case SLTU: set_if(X86::B, false); break;
+				case XOR: alu_reg(X86::XOR); break;
+				case SRL: shift_reg(X86::SHR); break;
+				case SRA: shift_reg(X86::SAR); break;
+				case OR: alu_reg(X86::OR); break;
+				case AND: alu_reg(X86::AND); break;
+
+				case MUL:
+					if (to_zero) break;
+					a.load(R::RAX, R::RBX, rs1);
+					a.load(R::RCX, R::RBX, rs2);
+					a.imul(R::RAX, R::RCX);
+					a.store(R::RAX, R::RBX, rd);
+					break;
+				case MULH: mul_high(true, false); break;
+				case MULHSU: mul_high(false, true); break;
+				case MULHU: mul_high(false, false); break;
+				case DIV: case DIVU: case REM: case REMU: case DIVW: case DIVUW: case REMW: case REMUW: divide(); break;
+
+				case ADDW: alu_reg(X86::ADD, false); break;
+				case SUBW: alu_reg(X86::SUB, false); break;
+				case SLLW: shift_reg(X86::SHL, false); break;
+				case SRLW: shift_reg(X86::SHR, false); break;
+				case SRAW: shift_reg(X86::SAR, false); break;
+				case MULW:
+					if (to_zero) break;
+					a.load(R::RAX, R::RBX, rs1);
+					a.load(R::RCX, R::RBX, rs2);
+					a.imul(R::RAX, R::RCX, false);
+					a.movsxd(R::RAX, R::RAX);
+					a.store(R::RAX, R::RBX, rd);
+					break;
+
+				case NOP: break;
+				default: return; // (can't happen - SLOW and BAD_PC start blocks, and SENTINEL isn't reachable)
+			}
+			// falling off the end of the program is the return
+			if (i + 1 == sentinel && op.code != JAL && op.code != JALR)
+				a.jmp(done);
+		}
+
+		for (const auto& b : backwards)
+		{
+			a.bind(b.label);
+			a.load(R::RAX, R::R13, ctx(offsetof(JitContext, halted)));
+			a.test_halted(R::RAX);
+			a.jcc(X86::E, labels[b.target]);
+			a.mov_imm32(R::RCX, static_cast<u32>(b.target));
+			a.jmp(halt);
+		}
+		for (const auto& s : stubs)
+		{
+			a.bind(s.label);
+			a.mov_imm32(R::RCX, static_cast<u32>(s.index));
+			if (s.refund) a.alu_imm(X86::ADD_I, R::R12, static_cast<i32>(s.refund));
+			a.jmp(interpret);
+		}
+		// Epilogue: eax = the JitExit, and the index in rcx
+		a.bind(done);
+		a.mov_imm32(R::RAX, JIT_DONE);
+		a.jmp(exit);
+		a.bind(halt);
+		a.mov_imm32(R::RAX, JIT_HALT);
+		a.jmp(exit);
+		a.bind(interpret);
+		a.mov_imm32(R::RAX, JIT_INTERPRET);
+		a.bind(exit);
+		a.store(R::RCX, R::R13, ctx(offsetof(JitContext, index)));
+		a.store(R::R12, R::R13, ctx(offsetof(JitContext, budget)));
+		a.pop(R::R15); a.pop(R::R14); a.pop(R::R13); a.pop(R::R12); a.pop(R::RBX);
+		a.ret();
+
+		if (!a.resolve() || !jit_code.load(a.code))
+			return;
+		// (anything that isn't the start of a translated block hands over to the interpreter - with its index in rcx)
+		const auto base = jit_code.entry();
+		jit_table.assign(table_size, base + a.labels[interpret]);
+		for (size_t i = 0; i < table_size; i++)
+			if (reachable[i] && leader[i])
+				jit_table[i] = base + a.labels[labels[i]];
+		jit_translated.assign(reachable.begin(), reachable.begin() + table_size);
+	}
+#endif
 
 	inline void execute_instruction()
 	{
@@ -293,6 +1881,8 @@ protected:
 			return data.data() + addr - d_beg;
 		if(addr >= s_beg && addr_max < s_end)
 			return stack.data() + addr - s_beg;
+		if(addr >= sh_beg && addr_max < sh_end)
+			return shared.data() + addr - sh_beg;
 
 		[[unlikely]] throw std::runtime_error("Memory access out of bounds");
 	}
@@ -0,0 +1,294 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include "UringIO.h"
+#include "BatchIO.h"
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+//the kernel shares these indices with us - acquire what it publishes, release what we publish
+template<typename T> static T load_acquire(T* p) { return std::atomic_ref<T>(*p).load(std::memory_order_acquire); }
+template<typename T> static void store_release(T* p, const T v) { std::atomic_ref<T>(*p).store(v,std::memory_order_release); }
+
+static std::runtime_error uring_error(const std::string& what)
+{
+	return std::runtime_error("io_uring "+what+" failed: "+std::strerror(errno));
+}
+
+UringIO::UringIO(const size_t max_bufs, const size_t payload_size, const size_t send_slots, const bool with_gro):
+	recv_control_size(with_gro ? CMSG_SPACE(sizeof(int)) : 0),
+	recv_header_size(sizeof(io_uring_recvmsg_out)+RecvNameSize+recv_control_size),
+	buf_size(recv_header_size+payload_size),
+	send_msgs(send_slots),
+	send_iovs(send_slots),
+	send_names(send_slots)
+{
+	//the buffer ring size has to be a power of 2, and buffer ids are 16 bit
+	buf_ring_entries = std::bit_ceil(std::clamp<size_t>(max_bufs,1,32768));
+
+	//room for every send, plus the receive (and a re-arm)
+	const auto sq_entries = std::bit_ceil(send_slots+2);
+	//each provided buffer and send slot can have a completion outstanding
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+	params.cq_entries = std::bit_ceil(buf_ring_entries+send_slots+2);
+
+	ring_fd = syscall(__NR_io_uring_setup,sq_entries,&params);
+	if(ring_fd < 0)
+		throw uring_error("setup");
+
+	try
+	{
+		sq_ring_sz = params.sq_off.array + params.sq_entries*sizeof(uint32_t);
+		cq_ring_sz = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+		if(params.features & IORING_FEAT_SINGLE_MMAP)
+			sq_ring_sz = cq_ring_sz = std::max(sq_ring_sz,cq_ring_sz);
+
+		sq_ring = mmap(nullptr,sq_ring_sz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQ_RING);
+		if(sq_ring == MAP_FAILED)
+		{
+			sq_ring = nullptr;
+			throw uring_error("SQ ring mmap");
+		}
+		if(params.features & IORING_FEAT_SINGLE_MMAP)
+			cq_ring = sq_ring;
+		else
+		{
+			cq_ring = mmap(nullptr,cq_ring_sz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_CQ_RING);
+			if(cq_ring == MAP_FAILED)
+			{
+				cq_ring = nullptr;
+				throw uring_error("CQ ring mmap");
+			}
+		}
+		sqes_sz = params.sq_entries*sizeof(io_uring_sqe);
+		auto sqes_map = mmap(nullptr,sqes_sz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQES);
+		if(sqes_map == MAP_FAILED)
+			throw uring_error("SQE mmap");
+		sqes = static_cast<io_uring_sqe*>(sqes_map);
+
+		auto sq_base = static_cast<uint8_t*>(sq_ring);
+		sq_head = reinterpret_cast<uint32_t*>(sq_base+params.sq_off.head);
+		sq_tail = reinterpret_cast<uint32_t*>(sq_base+params.sq_off.tail);
+		sq_mask = *reinterpret_cast<uint32_t*>(sq_base+params.sq_off.ring_mask);
+		sq_array = reinterpret_cast<uint32_t*>(sq_base+params.sq_off.array);
+		sq_local_tail = *sq_tail;
+		//SQEs are always used in order, so the indirection array is just the identity
+		for(uint32_t i=0; i<params.sq_entries; i++)
+			sq_array[i] = i;
+
+		auto cq_base = static_cast<uint8_t*>(cq_ring);
+		cq_head = reinterpret_cast<uint32_t*>(cq_base+params.cq_off.head);
+		cq_tail = reinterpret_cast<uint32_t*>(cq_base+params.cq_off.tail);
+		cq_mask = *reinterpret_cast<uint32_t*>(cq_base+params.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(cq_base+params.cq_off.cqes);
+
+		buf_ring_sz = buf_ring_entries*sizeof(io_uring_buf);
+		auto buf_ring_map = mmap(nullptr,buf_ring_sz,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+		if(buf_ring_map == MAP_FAILED)
+			throw uring_error("buffer ring mmap");
+		buf_ring = static_cast<io_uring_buf*>(buf_ring_map);
+
+		io_uring_buf_reg reg = {};
+		reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+		reg.ring_entries = buf_ring_entries;
+		reg.bgid = 0;
+		if(syscall(__NR_io_uring_register,ring_fd,IORING_REGISTER_PBUF_RING,&reg,1) != 0)
+			throw uring_error("buffer ring registration");
+	}
+	catch(...)
+	{
+		Close();
+		throw;
+	}
+
+	//ask for room for any address family we might see, and optionally the GRO control message
+	recv_msg.msg_namelen = RecvNameSize;
+	recv_msg.msg_controllen = recv_control_size;
+
+	for(size_t i=0; i<send_slots; i++)
+	{
+		send_msgs[i] = {};
+		send_msgs[i].msg_name = &send_names[i];
+		send_msgs[i].msg_iov = &send_iovs[i];
+		send_msgs[i].msg_iovlen = 1;
+	}
+}
+
+UringIO::~UringIO()
+{
+	Close();
+}
+
+void UringIO::Close()
+{
+	if(ring_fd >= 0)
+		close(ring_fd);
+	if(buf_ring)
+		munmap(buf_ring,buf_ring_sz);
+	if(sqes)
+		munmap(sqes,sqes_sz);
+	if(cq_ring && cq_ring != sq_ring)
+		munmap(cq_ring,cq_ring_sz);
+	if(sq_ring)
+		munmap(sq_ring,sq_ring_sz);
+	ring_fd = -1;
+	buf_ring = nullptr;
+	sqes = nullptr;
+	cq_ring = sq_ring = nullptr;
+}
+
+bool UringIO::AddBuf()
+{
+	if(bufs.size() >= buf_ring_entries)
+		return false;
+	bufs.emplace_back(new uint8_t[buf_size]);
+	ReturnBuf(bufs.size()-1);
+	return true;
+}
+
+void UringIO::ReturnBuf(const uint16_t bid)
+{
+	auto& buf = buf_ring[buf_ring_tail & (buf_ring_entries-1)];
+	buf.addr = reinterpret_cast<uint64_t>(bufs[bid].get());
+	buf.len = buf_size;
+	buf.bid = bid;
+	store_release(&buf_ring[0].resv,++buf_ring_tail);
+	bufs_available++;
+}
+
+io_uring_sqe* UringIO::NextSQE()
+{
+	if(sq_local_tail - load_acquire(sq_head) >= params.sq_entries) [[unlikely]]
+		return nullptr;
+	auto sqe = &sqes[sq_local_tail++ & sq_mask];
+	*sqe = {};
+	return sqe;
+}
+
+bool UringIO::PrepRecv(const int fd)
+{
+	auto sqe = NextSQE();
+	if(!sqe)
+		return false;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(&recv_msg);
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = RecvTag;
+	return true;
+}
+
+bool UringIO::PrepSend(const int fd, const uint32_t slot, const uint8_t* const buf, const size_t len, const asio::ip::udp::endpoint& dest)
+{
+	auto sqe = NextSQE();
+	if(!sqe)
+		return false;
+	std::memcpy(&send_names[slot],dest.data(),dest.size());
+	send_msgs[slot].msg_namelen = dest.size();
+	send_iovs[slot].iov_base = const_cast<uint8_t*>(buf);
+	send_iovs[slot].iov_len = len;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(&send_msgs[slot]);
+	sqe->len = 1;
+	sqe->user_data = slot;
+	return true;
+}
+
+size_t UringIO::Submit(asio::error_code& err)
+{
+	err.clear();
+	//anything the kernel hasn't consumed yet - including leftovers from a previous partial submit
+	const auto to_submit = sq_local_tail - load_acquire(sq_head);
+	if(to_submit == 0)
+		return 0;
+	store_release(sq_tail,sq_local_tail);
+
+	int n;
+	do n = syscall(__NR_io_uring_enter,ring_fd,to_submit,0,0,nullptr,0);
+	while(n < 0 && errno == EINTR);
+
+	if(n < 0)
+	{
+		if(errno == EAGAIN || errno == EBUSY)
+			err = asio::error::would_block;
+		else
+			err = asio::error_code(errno,asio::error::get_system_category());
+		return 0;
+	}
+	return n;
+}
+
+const io_uring_cqe* UringIO::NextCQE()
+{
+	const auto head = *cq_head;
+	if(head == load_acquire(cq_tail))
+		return nullptr;
+	return &cqes[head & cq_mask];
+}
+
+void UringIO::SeenCQE()
+{
+	store_release(cq_head,*cq_head+1);
+}
+
+int UringIO::ParseRecv(const io_uring_cqe& cqe, uint8_t*& payload, size_t& len, asio::ip::udp::endpoint& sender, bool& truncated, size_t& segment_size)
+{
+	if(!(cqe.flags & IORING_CQE_F_BUFFER))
+		return -1;
+	const uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+	bufs_available--;
+	auto buf = bufs[bid].get();
+
+	io_uring_recvmsg_out out;
+	std::memcpy(&out,buf,sizeof(out));
+	const auto name = buf+sizeof(out);
+
+	const auto namelen = std::min<size_t>(out.namelen,recv_msg.msg_namelen);
+	std::memcpy(sender.data(),name,namelen);
+	sender.resize(namelen);
+
+	segment_size = 0;
+	if(recv_control_size)
+	{
+		msghdr control_msg = {};
+		control_msg.msg_control = name+RecvNameSize;
+		control_msg.msg_controllen = std::min<size_t>(out.controllen,recv_control_size);
+		segment_size = GROSegmentSize(control_msg);
+	}
+
+	payload = buf+recv_header_size;
+	len = std::min<size_t>(out.payloadlen,buf_size-recv_header_size);
+	truncated = out.flags & MSG_TRUNC;
+	return bid;
+}
+
+#endif //HAVE_IO_URING
@@ -0,0 +1,130 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef URINGIO_H
+#define URINGIO_H
+
+/// io_uring datagram I/O - HAVE_IO_URING is defined by the build if the kernel headers
+/// support multishot recvmsg and provided-buffer rings (Linux 6.0+)
+#ifdef HAVE_IO_URING
+
+#include <asio.hpp>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+//A minimal io_uring (raw system calls - no liburing dependency) for one UDP socket:
+//	* a provided-buffer ring that the kernel picks receive buffers from
+//	* one multishot recvmsg that keeps posting a completion per datagram until it runs out of buffers
+//	* a fixed number of sendmsg slots, submitted in batches
+//	Not thread safe - the owner serialises access (eg. on a strand)
+class UringIO
+{
+public:
+	static constexpr uint64_t RecvTag = ~0ULL; //user_data of the receive completions - otherwise it's the send slot
+	//the kernel writes an io_uring_recvmsg_out header, then the sender address, then any control messages,
+	//	then the payload into each receive buffer. Room for a sockaddr_in6, padded to keep the control messages aligned
+	static constexpr size_t RecvNameSize = 32;
+
+	//payload_size: the biggest datagram to receive into each provided buffer
+	//with_gro: make room for the UDP_GRO segment size control message
+	UringIO(const size_t max_bufs, const size_t payload_size, const size_t send_slots, const bool with_gro = false);
+	~UringIO();
+	UringIO(const UringIO&) = delete;
+	UringIO& operator=(const UringIO&) = delete;
+
+	int Fd() const { return ring_fd; }
+
+	//Provided receive buffers. They're allocated as needed (up to max_bufs), and each one belongs
+	//	to the kernel until it comes back in a receive completion, and to us until ReturnBuf()
+	bool AddBuf();
+	size_t BufCount() const { return bufs.size(); }
+	size_t BufsAvailable() const { return bufs_available; } //given to the kernel, but not used yet
+	void ReturnBuf(const uint16_t bid);
+
+	//Queue submissions - nothing goes to the kernel until Submit()
+	//	return false if the submission queue is full
+	bool PrepRecv(const int fd);
+	bool PrepSend(const int fd, const uint32_t slot, const uint8_t* const buf, const size_t len, const asio::ip::udp::endpoint& dest);
+	size_t SendSlots() const { return send_msgs.size(); }
+	//one io_uring_enter for everything queued
+	//	returns the number of submissions consumed by the kernel
+	size_t Submit(asio::error_code& err);
+
+	//Completion queue - NextCQE() returns nullptr if there are none, otherwise call SeenCQE() when done with it
+	const io_uring_cqe* NextCQE();
+	void SeenCQE();
+	//Decode a receive completion
+	//	returns the id of the buffer holding the datagram (at payload, after the header in the buffer)
+	//	or -1 if the completion didn't consume a buffer
+	//	segment_size is non-zero if the datagram is a GRO coalesced train of segments
+	int ParseRecv(const io_uring_cqe& cqe, uint8_t*& payload, size_t& len, asio::ip::udp::endpoint& sender, bool& truncated, size_t& segment_size);
+	static bool MoreRecvs(const io_uring_cqe& cqe) { return cqe.flags & IORING_CQE_F_MORE; }
+
+private:
+	io_uring_sqe* NextSQE();
+	void Close();
+
+	int ring_fd = -1;
+	io_uring_params params = {};
+
+	//mmapped rings
+	void* sq_ring = nullptr;
+	size_t sq_ring_sz = 0;
+	void* cq_ring = nullptr;
+	size_t cq_ring_sz = 0;
+	io_uring_sqe* sqes = nullptr;
+	size_t sqes_sz = 0;
+
+	uint32_t* sq_head = nullptr;
+	uint32_t* sq_tail = nullptr;
+	uint32_t sq_mask = 0;
+	uint32_t* sq_array = nullptr;
+	uint32_t sq_local_tail = 0; //queued, but not yet published to the kernel
+	uint32_t* cq_head = nullptr;
+	uint32_t* cq_tail = nullptr;
+	uint32_t cq_mask = 0;
+	io_uring_cqe* cqes = nullptr;
+
+	//provided buffers
+	//	the ring is an array of io_uring_buf, with the tail overlaid on the first entry's resv field
+	//	(not io_uring_buf_ring - its flexible array member isn't laid out the same in C++)
+	io_uring_buf* buf_ring = nullptr;
+	size_t buf_ring_sz = 0;
+	uint32_t buf_ring_entries = 0;
+	uint16_t buf_ring_tail = 0;
+	const size_t recv_control_size;
+	const size_t recv_header_size;
+	const size_t buf_size;
+	std::vector<std::unique_ptr<uint8_t[]>> bufs;
+	size_t bufs_available = 0;
+
+	//the recvmsg header only describes the name/control sizes for multishot
+	msghdr recv_msg = {};
+
+	//sendmsg slots - these have to stay put until the send completes
+	std::vector<msghdr> send_msgs;
+	std::vector<iovec> send_iovs;
+	std::vector<sockaddr_in6> send_names;
+};
+
+#endif //HAVE_IO_URING
+
+#endif // URINGIO_H
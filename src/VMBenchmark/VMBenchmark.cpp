@@ -0,0 +1,496 @@
+/*	MiniPlex
+ *
+ *	Copyright (c) 2023: Neil Stephens
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+//Cost of Switch mode address extraction per datagram, for the example bytecode programs
+//	decoding each instruction as it's executed (how the VM used to do it) vs. the pre-decoded VM (threaded dispatch)
+//	vs. the same for a verified program (without the budget and bounds checks) vs. the x86-64 JIT (where there is one)
+//	vs. the declarative extractor (where there's an equivalent spec - <name>.spec next to <name>.bin)
+//	First, as a differential test, they all run the example datagrams and then randomized ones (mutated, truncated,
+//	and random) side by side, and their results (return value, src and dst, or the exception) have to match
+//	(for the extractor: it has to reject the datagrams the bytecode does, and extract the same src and dst from the rest)
+//	Then a pool of VMs loaded from the fastest one (like MiniPlex has a VM per router), each on its own thread,
+//	sharing the shared state, have to get the same results running concurrently
+//	Last, random programs (the example programs only test the verifier with random data): any run the verifier lets go
+//	without the checks has to be one that doesn't fail with them, and every mode has to get the same results
+//Usage: VMBenchmark [bytecode directory (default Examples/SwitchBytecode)] [datagrams (default 1000000)]
+//	[randomized datagrams (default 100000)] [seed (default 1)]
+
+#include "../TinyRISCV64.h"
+#include "../AddrExtractor.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+using Datagram = std::vector<uint8_t>;
+enum class Mode { STEPWISE, DECODED, VERIFIED, JIT };
+
+struct Result
+{
+	uint64_t ret = 0;
+	uint64_t src = 0;
+	uint64_t dst = 0;
+	std::string error;
+	bool operator==(const Result&) const = default;
+};
+
+//Shared state for a VM (see TinyRISCV64::VM::map_shared_mem())
+struct SharedState
+{
+	uint64_t addr = 0;
+	size_t size = 0;
+};
+
+//The same calling convention as MiniPlex::GetSrcDst()
+//	before_run: called with everything set up, just before the program runs (it can throw to stop it running)
+static Result Extract(TinyRISCV64::VM& vm, Datagram& dgram, const Mode mode, const SharedState& shared = {}, const std::function<void()>& before_run = nullptr)
+{
+	Result result;
+	try
+	{
+		auto virt_buf = vm.map_data_mem(dgram.data(),dgram.size());
+		auto src_addr = vm.stack_push<uint64_t>(0);
+		auto dst_addr = vm.stack_push<uint64_t>(0);
+		vm.register_set(10,virt_buf);
+		vm.register_set(11,dgram.size());
+		vm.register_set(12,src_addr);
+		vm.register_set(13,dst_addr);
+		vm.register_set(14,shared.addr);
+		vm.register_set(15,shared.size);
+		if(before_run)
+			before_run();
+		if(mode == Mode::STEPWISE)
+			vm.execute_program_stepwise();
+		else
+			vm.execute_program();
+		result.ret = vm.register_get(10);
+		result.dst = vm.stack_pop<uint64_t>();
+		result.src = vm.stack_pop<uint64_t>();
+	}
+	catch(const std::exception& e)
+	{
+		result.error = e.what();
+	}
+	return result;
+}
+
+static void DNP3CRC(const uint8_t byte, uint16_t& crc)
+{
+	uint8_t data = byte;
+	for(int i=0; i<8; i++)
+	{
+		const bool bit = (crc ^ data) & 1;
+		crc >>= 1;
+		data >>= 1;
+		if(bit)
+			crc ^= 0xA6BC;
+	}
+}
+
+//Link layer headers (with valid CRCs) and some user data, between a few outstations and masters
+static std::vector<Datagram> DNP3Datagrams()
+{
+	std::vector<Datagram> dgrams;
+	for(uint16_t i=0; i<64; i++)
+	{
+		const uint16_t src = i%8, dst = 100+i%3;
+		Datagram d = {0x05,0x64,static_cast<uint8_t>(5+16),0x44,uint8_t(dst),uint8_t(dst>>8),uint8_t(src),uint8_t(src>>8)};
+		uint16_t crc = 0;
+		for(const auto b : d)
+			DNP3CRC(b,crc);
+		crc = ~crc;
+		d.push_back(uint8_t(crc));
+		d.push_back(uint8_t(crc>>8));
+		for(uint8_t j=0; j<18; j++)
+			d.push_back(uint8_t(i*j));
+		if(i%16 == 15)
+			d[8] ^= 0xFF; //(a bad CRC now and then)
+		dgrams.push_back(d);
+	}
+	return dgrams;
+}
+
+//Outer headers and inner Ethernet frames, on a couple of VNIs
+static std::vector<Datagram> VXLANDatagrams()
+{
+	std::vector<Datagram> dgrams;
+	for(uint8_t i=0; i<64; i++)
+	{
+		Datagram d(200);
+		for(size_t j=0; j<d.size(); j++)
+			d[j] = uint8_t(i*31+j);
+		d[40] = i%2;
+		dgrams.push_back(d);
+	}
+	dgrams.push_back(Datagram(100)); //(too short)
+	return dgrams;
+}
+
+//Handshakes (initiation, response) then transport messages, for a few sessions
+static std::vector<Datagram> WireGuardDatagrams()
+{
+	auto msg = [](const uint8_t type, const uint32_t a, const uint32_t b, const size_t size)
+	{
+		Datagram d(size);
+		d[0] = type;
+		for(int k=0; k<4; k++)
+		{
+			d[4+k] = uint8_t(a >> (8*k));
+			d[8+k] = uint8_t(b >> (8*k));
+		}
+		return d;
+	};
+	std::vector<Datagram> dgrams;
+	for(uint32_t s=0; s<8; s++)
+	{
+		//(IDs that don't share a 'hash' table slot, so the results don't depend on the order - see BenchPool())
+		const uint32_t initiator = 0x10000+s*7919, responder = 0x20001+s*104729;
+		dgrams.push_back(msg(1,initiator,0,148));
+		dgrams.push_back(msg(2,responder,initiator,92));
+		for(int t=0; t<6; t++)
+		{
+			dgrams.push_back(msg(4,responder,0,64));
+			dgrams.push_back(msg(4,initiator,0,64));
+		}
+	}
+	return dgrams;
+}
+
+//Variations on the example datagrams: bytes changed, cut short or made longer, and some that are just random
+static Datagram Randomize(const std::vector<Datagram>& examples, std::mt19937_64& rng)
+{
+	auto pick = [&](const size_t n){ return static_cast<size_t>(rng() % n); };
+	Datagram d;
+	if(pick(8) == 0)
+		d.resize(pick(300));
+	else
+	{
+		d = examples[pick(examples.size())];
+		if(pick(4) == 0)
+			d.resize(pick(d.size()+64));
+	}
+	for(auto& b : d)
+		if(d.size() < 16 || pick(8) == 0)
+			b = uint8_t(rng());
+	return d;
+}
+
+static std::string Describe(const Result& r)
+{
+	return r.error.empty() ? "ret "+std::to_string(r.ret)+" src "+std::to_string(r.src)+" dst "+std::to_string(r.dst) : "'"+r.error+"'";
+}
+
+//The pool: a VM per thread, loaded from proto, each extracting its share of n datagrams (from its own copy of them)
+//	returns ns/datagram (wall clock), and whether they all got the expected results
+static std::pair<double,bool> BenchPool(const TinyRISCV64::VM& proto, const SharedState& shared, const std::vector<Datagram>& dgrams,
+	const std::vector<Result>& expected, const size_t n, const size_t threads)
+{
+	std::vector<std::unique_ptr<TinyRISCV64::VM>> pool;
+	for(size_t t=0; t<threads; t++)
+	{
+		pool.push_back(std::make_unique<TinyRISCV64::VM>(4096));
+		pool.back()->program_load(proto);
+	}
+	std::atomic<size_t> mismatches = 0;
+	std::vector<std::thread> workers;
+	const auto start = Clock::now();
+	for(size_t t=0; t<threads; t++)
+		workers.emplace_back([&,t]()
+		{
+			auto copies = dgrams;
+			for(size_t i=t; i<n; i+=threads)
+				if(!(Extract(*pool[t],copies[i%copies.size()],Mode::JIT,shared) == expected[i%copies.size()]))
+					mismatches++;
+		});
+	for(auto& w : workers)
+		w.join();
+	const auto ns = std::chrono::duration<double,std::nano>(Clock::now()-start).count()/n;
+	return {ns,mismatches == 0};
+}
+
+static bool Bench(const std::string& dir, const std::string& name, std::vector<Datagram> dgrams, const size_t n, const size_t num_random, std::mt19937_64& rng,
+	const size_t shared_size = 0)
+{
+	TinyRISCV64::VM stepwise(4096), decoded(4096), verified(4096), jit(4096);
+	stepwise.program_load(dir+"/"+name);
+	decoded.verify_enable(false);
+	decoded.program_load(dir+"/"+name);
+	verified.program_load(dir+"/"+name);
+	if(!verified.verified())
+		std::printf("%-26s not verified: %s\n",name.c_str(),verified.verify_error().c_str());
+	const bool have_jit = jit.jit_enable();
+	jit.program_load(dir+"/"+name);
+	const std::vector<std::pair<TinyRISCV64::VM*,Mode>> vms = {{&stepwise,Mode::STEPWISE},{&decoded,Mode::DECODED},{&verified,Mode::VERIFIED},{&jit,Mode::JIT}};
+	//(each has its own, so they all keep the same state)
+	std::vector<std::vector<uint8_t>> shared_mem(vms.size(),std::vector<uint8_t>(shared_size));
+	std::vector<SharedState> shared(vms.size());
+	for(size_t v=0; v<vms.size() && shared_size; v++)
+		shared[v] = {vms[v].first->map_shared_mem(shared_mem[v].data(),shared_size),shared_size};
+	const char* const mode_names[] = {"stepwise","pre-decoded","verified","JIT"};
+	const auto spec = dir+"/"+name.substr(0,name.rfind('.'))+".spec";
+	const auto extractor = std::ifstream(spec) ? AddrExtractor(spec) : AddrExtractor();
+
+	//(programs can keep state between datagrams - eg. WireGuard sessions - so they all see the same sequence)
+	size_t mismatches = 0, errors = 0;
+	auto check = [&](Datagram d)
+	{
+		auto copy = d;
+		const auto expected = Extract(stepwise,copy,Mode::STEPWISE,shared[0]);
+		for(size_t v=1; v<vms.size(); v++)
+		{
+			copy = d;
+			const auto got = Extract(*vms[v].first,copy,vms[v].second,shared[v]);
+			if(!(expected == got) && mismatches++ < 5)
+				std::printf("%-26s MISMATCH (%s, %zu byte datagram): expected %s, got %s\n",name.c_str(),mode_names[static_cast<int>(vms[v].second)],
+					d.size(),Describe(expected).c_str(),Describe(got).c_str());
+		}
+		if(!extractor.Empty())
+		{
+			uint64_t src = 0, dst = 0;
+			const bool extracted = extractor.Extract(d.data(),d.size(),src,dst) == AddrExtractor::Extracted;
+			const bool expect_extracted = expected.error.empty() && expected.ret == 0;
+			if((extracted != expect_extracted || (extracted && (src != expected.src || dst != expected.dst))) && mismatches++ < 5)
+				std::printf("%-26s MISMATCH (extractor, %zu byte datagram): expected %s, got %s\n",name.c_str(),d.size(),Describe(expected).c_str(),
+					extracted ? ("src "+std::to_string(src)+" dst "+std::to_string(dst)).c_str() : "rejected");
+		}
+		return !expected.error.empty() || expected.ret != 0;
+	};
+	for(const auto& d : dgrams)
+		errors += check(d);
+	size_t random_errors = 0;
+	for(size_t i=0; i<num_random; i++)
+		random_errors += check(Randomize(dgrams,rng));
+
+	auto time = [&](TinyRISCV64::VM& vm, const Mode mode)
+	{
+		uint64_t sink = 0;
+		const auto start = Clock::now();
+		for(size_t i=0; i<n; i++)
+			sink += Extract(vm,dgrams[i%dgrams.size()],mode,shared[static_cast<size_t>(mode)]).src;
+		const auto ns = std::chrono::duration<double,std::nano>(Clock::now()-start).count()/n;
+		return std::make_pair(ns,sink);
+	};
+	const auto [step_ns,step_sink] = time(stepwise,Mode::STEPWISE);
+	const auto [decoded_ns,decoded_sink] = time(decoded,Mode::DECODED);
+	const auto [verified_ns,verified_sink] = verified.verified() ? time(verified,Mode::VERIFIED) : std::make_pair(0.0,step_sink);
+	const auto [jit_ns,jit_sink] = have_jit && jit.jit_active() ? time(jit,Mode::JIT) : std::make_pair(0.0,step_sink);
+	auto time_extractor = [&]()
+	{
+		uint64_t sink = 0;
+		const auto start = Clock::now();
+		for(size_t i=0; i<n; i++)
+		{
+			const auto& d = dgrams[i%dgrams.size()];
+			uint64_t src = 0, dst = 0;
+			extractor.Extract(d.data(),d.size(),src,dst);
+			sink += src;
+		}
+		const auto ns = std::chrono::duration<double,std::nano>(Clock::now()-start).count()/n;
+		return std::make_pair(ns,sink);
+	};
+	const auto [extractor_ns,extractor_sink] = !extractor.Empty() ? time_extractor() : std::make_pair(0.0,step_sink);
+
+	//(the example datagrams have been through already - so what's in the shared state is what they'll all leave there)
+	std::vector<Result> expected;
+	for(auto d : dgrams)
+		expected.push_back(Extract(jit,d,Mode::JIT,shared[static_cast<size_t>(Mode::JIT)]));
+	const size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(),2,4);
+	const auto [pool_ns,pool_ok] = BenchPool(jit,shared[static_cast<size_t>(Mode::JIT)],dgrams,expected,n,threads);
+	if(!pool_ok)
+		std::printf("%-26s MISMATCH (pool of %zu)\n",name.c_str(),threads);
+
+	std::printf("%-26s %3zu datagrams (%2zu rejected), %zu randomized (%zu rejected): ns/datagram decode per instruction %7.1f, pre-decoded %7.1f (%.1fx)",
+		name.c_str(),dgrams.size(),errors,num_random,random_errors,step_ns,decoded_ns,decoded_ns > 0 ? step_ns/decoded_ns : 0);
+	if(verified_ns > 0)
+		std::printf(", verified %7.1f (%.1fx)",verified_ns,step_ns/verified_ns);
+	else
+		std::printf(", verified n/a");
+	if(jit_ns > 0)
+		std::printf(", JIT %7.1f (%.1fx)",jit_ns,step_ns/jit_ns);
+	else
+		std::printf(", JIT n/a");
+	if(extractor_ns > 0)
+		std::printf(", extractor %7.1f (%.1fx)",extractor_ns,step_ns/extractor_ns);
+	std::printf(", pool of %zu %7.1f (%.1fx)",threads,pool_ns,step_ns/pool_ns);
+	const bool ok = !mismatches && pool_ok && step_sink == decoded_sink && step_sink == verified_sink && step_sink == jit_sink && step_sink == extractor_sink;
+	std::printf("%s\n",ok ? "" : " - RESULTS DIFFER");
+	return ok;
+}
+
+//Exposes whether a run would go the verified way (without the instruction budget and bounds checks)
+class ProbeVM : public TinyRISCV64::VM
+{
+public:
+	using VM::VM;
+	bool runs_verified() { return verified_entry(p_beg,100000); }
+};
+
+static uint32_t EncodeR(const uint32_t funct7, const uint32_t funct3, const uint32_t rd, const uint32_t rs1, const uint32_t rs2)
+{
+	return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | 0x33;
+}
+static uint32_t EncodeI(const uint32_t opcode, const uint32_t funct3, const uint32_t rd, const uint32_t rs1, const int32_t imm)
+{
+	return (static_cast<uint32_t>(imm) & 0xFFF) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+static uint32_t EncodeS(const uint32_t funct3, const uint32_t rs1, const uint32_t rs2, const int32_t imm)
+{
+	const auto i = static_cast<uint32_t>(imm) & 0xFFF;
+	return (i >> 5) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (i & 0x1F) << 7 | 0x23;
+}
+static uint32_t EncodeB(const uint32_t funct3, const uint32_t rs1, const uint32_t rs2, const int32_t imm)
+{
+	const auto i = static_cast<uint32_t>(imm) & 0x1FFF;
+	return ((i >> 12) & 1) << 31 | ((i >> 5) & 0x3F) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | ((i >> 1) & 0xF) << 8 | ((i >> 11) & 1) << 7 | 0x63;
+}
+static std::vector<uint8_t> ProgramBytes(const std::vector<uint32_t>& words)
+{
+	std::vector<uint8_t> bytes;
+	for(const auto w : words)
+		for(int b=0; b<4; b++)
+			bytes.push_back(uint8_t(w >> (8*b)));
+	return bytes;
+}
+
+//Loads, stores, shifts (including by 0) and ALU ops on whatever's in the registers (so addresses can come from the data),
+//	and forward branches (so it always gets to the return at the end)
+static std::vector<uint8_t> RandomProgram(std::mt19937_64& rng)
+{
+	auto pick = [&](const size_t n){ return static_cast<uint32_t>(rng() % n); };
+	auto temp = [&](){ constexpr uint32_t t[] = {5,6,7,28,29}; return t[pick(5)]; };
+	auto source = [&](){ constexpr uint32_t r[] = {5,6,7,28,29,10,11,2,0}; return r[pick(9)]; };
+	const size_t n = 4+pick(16);
+	std::vector<uint32_t> words;
+	for(size_t i=0; i<n; i++)
+	{
+		switch(pick(6))
+		{
+			case 0:
+				words.push_back(EncodeI(0x03,pick(7),temp(),source(),int32_t(pick(24))-8));
+				break;
+			case 1:
+				words.push_back(EncodeS(pick(4),source(),temp(),int32_t(pick(24))-8));
+				break;
+			case 2:
+			{
+				const auto kind = pick(3); //SLLI, SRLI, SRAI
+				const auto shamt = pick(4) == 0 ? 0 : pick(64);
+				words.push_back(EncodeI(0x13,kind == 0 ? 1 : 5,temp(),source(),int32_t((kind == 2 ? 0x400 : 0) | shamt)));
+				break;
+			}
+			case 3:
+			{
+				constexpr uint32_t funct3[] = {0,2,3,4,6,7};
+				words.push_back(EncodeI(0x13,funct3[pick(6)],temp(),source(),int32_t(pick(4096))-2048));
+				break;
+			}
+			case 4:
+			{
+				constexpr uint32_t funct[][2] = {{0,0},{0x20,0},{0,1},{0,4},{0,5},{0x20,5},{0,6},{0,7},{1,0}};
+				const auto& f = funct[pick(9)];
+				words.push_back(EncodeR(f[0],f[1],temp(),source(),source()));
+				break;
+			}
+			default:
+			{
+				constexpr uint32_t funct3[] = {0,1,4,5,6,7};
+				words.push_back(EncodeB(funct3[pick(6)],source(),source(),int32_t(4*(1+pick(n-i)))));
+			}
+		}
+	}
+	words.push_back(0x00008067); //ret
+	return ProgramBytes(words);
+}
+
+static bool BenchRandomPrograms(const size_t num_programs, std::mt19937_64& rng)
+{
+	auto pick = [&](const size_t n){ return static_cast<size_t>(rng() % n); };
+	size_t mismatches = 0, verified_programs = 0, runs = 0, unchecked_runs = 0;
+	for(size_t p=0; p<num_programs; p++)
+	{
+		//(first, an address from the data shifted by 0 - the verifier once thought that was an empty range in the program)
+		const auto program = p == 0 ? ProgramBytes({EncodeI(0x03,3,5,10,0),EncodeI(0x13,5,5,5,0),EncodeI(0x03,3,6,5,0),0x00008067}) : RandomProgram(rng);
+		TinyRISCV64::VM stepwise(256), jit(256);
+		ProbeVM verified(256);
+		stepwise.program_load(program.data(),program.size());
+		verified.program_load(program.data(),program.size());
+		jit.jit_enable();
+		jit.program_load(program.data(),program.size());
+		verified_programs += verified.verified();
+		for(size_t d=0; d<16; d++)
+		{
+			Datagram dgram(pick(64));
+			for(auto& b : dgram)
+				b = uint8_t(rng());
+			auto copy = dgram;
+			const auto expected = Extract(stepwise,copy,Mode::STEPWISE);
+			bool unchecked = false;
+			const std::vector<std::pair<Mode,Result>> got =
+			{
+				{Mode::VERIFIED,Extract(verified,copy = dgram,Mode::VERIFIED,{},[&]()
+				{
+					unchecked = verified.runs_verified();
+					if(unchecked && !expected.error.empty())
+						throw std::runtime_error("verified, but it fails checked: "+expected.error);
+				})},
+				{Mode::JIT,Extract(jit,copy = dgram,Mode::JIT)}
+			};
+			runs++;
+			unchecked_runs += unchecked;
+			const char* const mode_names[] = {"stepwise","pre-decoded","verified","JIT"};
+			for(const auto& [mode,result] : got)
+				if(!(result == expected) && mismatches++ < 5)
+					std::printf("Random program %zu MISMATCH (%s, %zu byte datagram): expected %s, got %s\n",p,mode_names[static_cast<int>(mode)],
+						dgram.size(),Describe(expected).c_str(),Describe(result).c_str());
+		}
+	}
+	std::printf("%-26s %zu programs (%zu verified), %zu runs (%zu without the checks)%s\n","Random programs",num_programs,verified_programs,runs,unchecked_runs,
+		mismatches ? " - RESULTS DIFFER" : "");
+	return !mismatches;
+}
+
+int main(int argc, char* argv[])
+{
+	const std::string dir = argc > 1 ? argv[1] : "Examples/SwitchBytecode";
+	const size_t n = argc > 2 ? std::strtoul(argv[2],nullptr,10) : 1000000;
+	const size_t num_random = argc > 3 ? std::strtoul(argv[3],nullptr,10) : 100000;
+	std::mt19937_64 rng(argc > 4 ? std::strtoull(argv[4],nullptr,10) : 1);
+	bool ok = true;
+	try
+	{
+		for(const auto name : {"SwitchDNP3_FAST.bin","SwitchDNP3_FAST_FLOW.bin","SwitchDNP3_CRC.bin","SwitchDNP3_CRC_FLOW.bin"})
+			ok = Bench(dir,name,DNP3Datagrams(),n,num_random,rng) && ok;
+		ok = Bench(dir,"SwitchVXLAN.bin",VXLANDatagrams(),n,num_random,rng) && ok;
+		ok = Bench(dir,"SwitchWireGuard.bin",WireGuardDatagrams(),n,num_random,rng,0x80000) && ok;
+		ok = BenchRandomPrograms(num_random/10,rng) && ok;
+	}
+	catch(const std::exception& e)
+	{
+		std::printf("Error: %s\n",e.what());
+		return 1;
+	}
+	return ok ? 0 : 1;
+}
@@ -66,6 +66,7 @@ try
 	spdlog::get("MiniPlex")->info("Joining threads.");
 	for(auto& t : threads)
 		t.join();
+	MP.Stop();
 
 	spdlog::get("MiniPlex")->info("Shutdown cleanly: return 0.");
 	spdlog::apply_all([](const std::shared_ptr<spdlog::logger>& l) {l->flush(); });